@@ -0,0 +1,74 @@
+// ==========================================================================
+// Ray Acceleration Structures
+//
+// The queries the tracer makes of whatever structure finds its rays' hits
+// among the scene's bounded primitives. Planes are unbounded and are always
+// tested by the caller. The Bvh is the general-purpose choice; the Grid
+// builds faster and can trace faster for dense scenes of many small,
+// similarly sized primitives.
+// ==========================================================================
+#ifndef ACCELERATOR_H
+#define ACCELERATOR_H
+
+#include <stdint.h>
+#include <glm/glm.hpp>
+#include "Scene.h"
+
+class ClusterPager;
+
+// --------------------------------------------------------------------------
+
+// The four planes bounding a bundle of rays that leave apex, with normals
+// pointing into the bundle.
+struct Frustum
+{
+	glm::vec3 apex;
+	glm::vec3 normal[4];
+};
+
+// Nodes below which lie all the primitives a frustum may contain, found once
+// for a bundle of coherent rays so that each of them can start traversal
+// there instead of at the root.
+struct BvhCut
+{
+	static const int MAX_NODES = 16;
+	uint32_t nodes[MAX_NODES];
+	int count;
+};
+
+class Accelerator
+{
+public:
+	virtual ~Accelerator() {}
+
+	// finds the nearest primitive along o + t*d (d of unit length) closer than
+	// hit.dist, setting hit.dist and hit.prim and returning true if there is
+	// one; the rest of hit is left for completeHit(). If cut is given, the ray
+	// must lie inside the frustum it was found for.
+	virtual bool ClosestHit(const glm::vec3& o, const glm::vec3& d, SurfaceHit& hit,
+	                        const BvhCut* cut = 0) = 0;
+
+	// ClosestHit() for count rays at once, the ith from o[i] along d[i] into
+	// hits[i], setting found[i] to what it returns; a structure may trace the
+	// rays together to overlap their memory stalls. All must lie inside the
+	// frustum cut was found for, if it is given.
+	virtual void ClosestHits(const glm::vec3* o, const glm::vec3* d, SurfaceHit* hits, bool* found, int count,
+	                         const BvhCut* cut = 0)
+	{
+		for (int i = 0; i < count; i++)
+			found[i] = ClosestHit(o[i], d[i], hits[i], cut);
+	}
+
+	// fills cut with nodes covering every primitive that may lie in frustum;
+	// structures without nodes to start from leave it empty, and ignore it
+	virtual void Cull(const Frustum& frustum, BvhCut& cut) = 0;
+
+	// true if any primitive lies along o + t*d with 0 < t < maxDist
+	virtual bool Occluded(const glm::vec3& o, const glm::vec3& d, float maxDist) = 0;
+
+	// the pager streaming the structure in, if it is streamed
+	virtual ClusterPager* Pager() const { return 0; }
+};
+
+// --------------------------------------------------------------------------
+#endif // ACCELERATOR_H
@@ -0,0 +1,158 @@
+// ==========================================================================
+// Arena (Bump) Memory Allocation
+// ==========================================================================
+
+#include "Arena.h"
+
+#include <cstdlib>
+#include <algorithm>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+
+Arena::Arena(size_t blockSize)
+	: m_head(0), m_current(0), m_blockSize(blockSize)
+{
+}
+
+Arena::~Arena()
+{
+	Release();
+}
+
+Arena::Block* Arena::NewBlock(size_t minSize)
+{
+	size_t size = max(minSize, m_blockSize);
+	Block* block = static_cast<Block*>(malloc(sizeof(Block) + size));
+	if (!block)
+		throw bad_alloc();
+	block->next = 0;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+// --------------------------------------------------------------------------
+
+// offset into block of the first address at or past its used bytes that is
+// a multiple of align
+static size_t alignedOffset(char* data, size_t used, size_t align)
+{
+	size_t base = reinterpret_cast<size_t>(data);
+	return ((base + used + align - 1) & ~(align - 1)) - base;
+}
+
+void* Arena::Allocate(size_t size, size_t align)
+{
+	// walk forward through blocks kept from before the last Reset() until one
+	// has room, appending a fresh block if none does
+	Block* previous = 0;
+	for (Block* block = m_current; block; previous = block, block = block->next)
+	{
+		size_t offset = alignedOffset(block->Data(), block->used, align);
+		if (offset + size <= block->size)
+		{
+			m_current = block;
+			block->used = offset + size;
+			return block->Data() + offset;
+		}
+		// skipped blocks are treated as full until the next Reset()
+		block->used = block->size;
+	}
+
+	Block* block = NewBlock(size + align);
+	if (previous)
+		previous->next = block;
+	else
+		m_head = block;
+	m_current = block;
+
+	size_t offset = alignedOffset(block->Data(), 0, align);
+	block->used = offset + size;
+	return block->Data() + offset;
+}
+
+void Arena::Reserve(size_t bytes)
+{
+	// make the first block with enough room current, appending one if needed
+	Block* previous = 0;
+	for (Block* block = m_current; block; previous = block, block = block->next)
+	{
+		if (block->size - block->used >= bytes)
+		{
+			m_current = block;
+			return;
+		}
+		block->used = block->size;
+	}
+
+	Block* block = NewBlock(bytes);
+	if (previous)
+		previous->next = block;
+	else
+		m_head = block;
+	m_current = block;
+}
+
+Arena::Marker Arena::Mark() const
+{
+	Marker marker = { m_current, m_current ? m_current->used : 0 };
+	return marker;
+}
+
+void Arena::Rewind(const Marker &marker)
+{
+	if (!marker.block)
+	{
+		Reset();
+		return;
+	}
+
+	// blocks past the marked one were empty when the marker was taken
+	marker.block->used = marker.used;
+	for (Block* block = marker.block->next; block; block = block->next)
+		block->used = 0;
+	m_current = marker.block;
+}
+
+void Arena::Reset()
+{
+	for (Block* block = m_head; block; block = block->next)
+		block->used = 0;
+	m_current = m_head;
+}
+
+void Arena::Release()
+{
+	while (m_head)
+	{
+		Block* next = m_head->next;
+		free(m_head);
+		m_head = next;
+	}
+	m_current = 0;
+}
+
+void Arena::Swap(Arena& other)
+{
+	std::swap(m_head, other.m_head);
+	std::swap(m_current, other.m_current);
+	std::swap(m_blockSize, other.m_blockSize);
+}
+
+size_t Arena::BytesUsed() const
+{
+	size_t used = 0;
+	for (Block* block = m_head; block; block = block->next)
+		used += block->used;
+	return used;
+}
+
+// --------------------------------------------------------------------------
+
+Arena& threadScratch()
+{
+	static thread_local Arena scratch(256 << 10);
+	return scratch;
+}
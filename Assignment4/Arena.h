@@ -0,0 +1,136 @@
+// ==========================================================================
+// Arena (Bump) Memory Allocation
+//
+// An Arena hands out memory by advancing a pointer through large blocks
+// obtained from the heap, and gives it all back at once when reset or
+// destroyed. Scene geometry and acceleration structures live in one arena
+// per scene, and every render thread owns a scratch arena for per-ray
+// records that is rewound at the start of each tile, so the render loop
+// itself never touches the general-purpose heap.
+//
+// Only trivially destructible types may be placed in an arena; destructors
+// are never run.
+// ==========================================================================
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <vector>
+#include <type_traits>
+
+// --------------------------------------------------------------------------
+// A fixed-length array whose storage belongs to an Arena.
+
+template <typename T>
+struct ArenaArray
+{
+	T*      data;
+	size_t  count;
+
+	ArenaArray() : data(0), count(0)
+	{}
+
+	size_t size() const  { return count; }
+	bool empty() const   { return count == 0; }
+	T* begin()           { return data; }
+	T* end()             { return data + count; }
+	const T* begin() const { return data; }
+	const T* end() const   { return data + count; }
+	T& operator[](size_t i)             { return data[i]; }
+	const T& operator[](size_t i) const { return data[i]; }
+};
+
+// --------------------------------------------------------------------------
+
+class Arena
+{
+	// blocks are kept in allocation order; m_current is the one being filled
+	struct Block
+	{
+		Block*  next;
+		size_t  size;
+		size_t  used;
+		char*   Data() { return reinterpret_cast<char*>(this + 1); }
+	};
+
+	Block*  m_head;
+	Block*  m_current;
+	size_t  m_blockSize;
+
+	Block* NewBlock(size_t minSize);
+
+	Arena(const Arena&);
+	Arena& operator=(const Arena&);
+
+public:
+	explicit Arena(size_t blockSize = 1 << 20);
+	~Arena();
+
+	// returns size bytes aligned to align, which must be a power of two
+	void* Allocate(size_t size, size_t align = alignof(std::max_align_t));
+
+	// returns count default-constructed objects of type T
+	template <typename T>
+	T* Allocate(size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value,
+		              "arena objects are never destroyed");
+		T* p = static_cast<T*>(Allocate(count * sizeof(T), alignof(T)));
+		for (size_t i = 0; i < count; ++i)
+			new (p + i) T();
+		return p;
+	}
+
+	template <typename T>
+	ArenaArray<T> NewArray(size_t count)
+	{
+		ArenaArray<T> a;
+		a.data = count ? Allocate<T>(count) : 0;
+		a.count = count;
+		return a;
+	}
+
+	template <typename T>
+	ArenaArray<T> Copy(const std::vector<T>& v)
+	{
+		ArenaArray<T> a = NewArray<T>(v.size());
+		if (!v.empty())
+			memcpy(a.data, v.data(), v.size() * sizeof(T));
+		return a;
+	}
+
+	// makes sure the next bytes of allocation come from a single block
+	void Reserve(size_t bytes);
+
+	// a position in the arena that later allocations can be rewound to
+	struct Marker
+	{
+		Block*  block;
+		size_t  used;
+	};
+	Marker Mark() const;
+
+	// forgets every allocation made since marker was taken
+	void Rewind(const Marker &marker);
+
+	// forgets every allocation but keeps the blocks for reuse
+	void Reset();
+
+	// returns all blocks to the heap
+	void Release();
+
+	// exchanges every block, and so every allocation, with other
+	void Swap(Arena& other);
+
+	// bytes handed out since the last Reset() or Release()
+	size_t BytesUsed() const;
+};
+
+// the calling thread's scratch arena, for memory needed only until the end of
+// the current tile
+Arena& threadScratch();
+
+// --------------------------------------------------------------------------
+#endif // ARENA_H
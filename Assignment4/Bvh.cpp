@@ -0,0 +1,1150 @@
+// ==========================================================================
+// Bounding Volume Hierarchy
+// ==========================================================================
+
+#include "Bvh.h"
+#include "ClusterPager.h"
+#include "Parallel.h"
+
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace glm;
+using namespace std;
+
+// cost of visiting a node, relative to intersecting one primitive
+static const float TRAVERSAL_COST = 1.f;
+
+const float Bvh::REBUILD_GROWTH = 2.f;
+
+static const char* BUILDER_NAMES[BVH_BUILDER_COUNT] = { "sah", "linear", "treelet" };
+
+// nodes with at least this many primitives are binned by all threads together
+static const uint32_t PARALLEL_BINNING = 1 << 15;
+
+// an eager build splits the top of the tree until there are this many
+// subtrees for each thread, or the largest has fewer than MIN_SHARED_SUBTREE
+// primitives, before sharing them out
+static const int SUBTREES_PER_THREAD = 4;
+static const uint32_t MIN_SHARED_SUBTREE = 1 << 10;
+
+// --------------------------------------------------------------------------
+
+static float surfaceArea(const vec3& lower, const vec3& upper) {
+	vec3 e(glm::max(upper - lower, vec3(0)));
+	return 2*(e.x*e.y + e.y*e.z + e.z*e.x);
+}
+
+// slab test of o + t*d against a box, for t in [0, tMax]; tNear receives
+// the entry distance
+static inline bool hitBox(const BvhNode& node, const vec3& o, const vec3& invD, float tMax, float& tNear) {
+	vec3 t0((node.lower - o) * invD);
+	vec3 t1((node.upper - o) * invD);
+	vec3 tmin(glm::min(t0, t1));
+	vec3 tmax(glm::max(t0, t1));
+	tNear = std::max(std::max(tmin.x, tmin.y), std::max(tmin.z, 0.f));
+	float tFar = std::min(std::min(tmax.x, tmax.y), std::min(tmax.z, tMax));
+	return tNear <= tFar;
+}
+
+const char* bvhBuilderName(BvhBuilder builder)
+{
+	return BUILDER_NAMES[builder];
+}
+
+bool parseBvhBuilder(const string& name, BvhBuilder& builder)
+{
+	for (int i = 0; i < BVH_BUILDER_COUNT; i++)
+		if (name == BUILDER_NAMES[i]) {
+			builder = BvhBuilder(i);
+			return true;
+		}
+	return false;
+}
+
+// --------------------------------------------------------------------------
+
+Bvh::Bvh()
+	: m_scene(0), m_nodes(0), m_prims(0), m_lower(0), m_upper(0), m_centroid(0),
+	  m_nodeCount(0), m_capacity(0), m_lazy(false), m_threads(1), m_builder(SAH_BUILDER),
+	  m_state(0), m_pager(0)
+{
+}
+
+void Bvh::Build(Scene& scene, bool lazy, int threads)
+{
+	Arena& arena = scene.arena;
+	uint32_t n = boundedPrimitiveCount(scene);
+
+	// a binary tree whose leaves all hold primitives has fewer than 2n nodes
+	uint32_t capacity = std::max(2*n, 1u);
+
+	m_scene = &scene;
+	m_lazy = lazy && m_builder == SAH_BUILDER;
+	m_threads = buildThreads(threads);
+	m_capacity = capacity;
+	m_nodes = arena.Allocate<BvhNode>(capacity);
+	m_prims = arena.Allocate<uint32_t>(std::max(n, 1u));
+	m_lower = arena.Allocate<vec3>(std::max(n, 1u));
+	m_upper = arena.Allocate<vec3>(std::max(n, 1u));
+	m_centroid = arena.Allocate<vec3>(std::max(n, 1u));
+	m_state = m_lazy ? arena.Allocate<atomic<uint8_t> >(capacity) : 0;
+	Rebuild();
+}
+
+// builds the hierarchy again from its root, in the arrays already allocated
+void Bvh::Rebuild()
+{
+	uint32_t n = boundedPrimitiveCount(*m_scene);
+	int threads = n >= PARALLEL_BINNING ? m_threads : 1;
+	vector<vec3> partLower(threads, vec3(INFINITY)), partUpper(threads, vec3(-INFINITY));
+	size_t chunk = parallelChunk(threads, n);
+	parallelFor(threads, n, [&](size_t first, size_t last) {
+		size_t part = first / std::max(chunk, size_t(1));
+		for (size_t i = first; i < last; i++) {
+			m_prims[i] = uint32_t(i);
+			primitiveBounds(*m_scene, uint32_t(i), m_lower[i], m_upper[i]);
+			m_centroid[i] = 0.5f * (m_lower[i] + m_upper[i]);
+			partLower[part] = glm::min(partLower[part], m_lower[i]);
+			partUpper[part] = glm::max(partUpper[part], m_upper[i]);
+		}
+	});
+
+	BvhNode& root = m_nodes[0];
+	root.lower = vec3(INFINITY);
+	root.upper = vec3(-INFINITY);
+	root.first = 0;
+	root.count = n;
+	for (int i = 0; i < threads; i++) {
+		root.lower = glm::min(root.lower, partLower[i]);
+		root.upper = glm::max(root.upper, partUpper[i]);
+	}
+	m_nodeCount = 1;
+
+	if (m_lazy) {
+		for (uint32_t i = 0; i < m_capacity; i++)
+			m_state[i].store(UNBUILT, memory_order_relaxed);
+		return;
+	}
+
+	if (m_builder == SAH_BUILDER)
+		SplitAll(0);
+	else
+		BuildLinear();
+}
+
+// runs build(subtree) for each of subtrees on threads, every thread taking
+// the next in the list whenever it finishes one
+template <typename Root, typename Build>
+static void shareSubtrees(int threads, const vector<Root>& subtrees, Build build)
+{
+	atomic<size_t> next(0);
+	auto work = [&subtrees, &next, &build]() {
+		for (size_t i = next++; i < subtrees.size(); i = next++)
+			build(subtrees[i]);
+	};
+	vector<thread> helpers;
+	for (int i = 1; i < threads && size_t(i) < subtrees.size(); i++)
+		helpers.push_back(thread(work));
+	work();
+	for (thread& helper : helpers)
+		helper.join();
+}
+
+// Eager build: splits node and everything below it. The largest nodes are
+// split first, binned by all threads, until there are enough subtrees to
+// keep every thread busy; then each thread builds whole subtrees, taking
+// the largest left.
+void Bvh::SplitAll(uint32_t node)
+{
+	vector<uint32_t> subtrees(1, node);
+	auto fewer = [this](uint32_t a, uint32_t b) { return m_nodes[a].count < m_nodes[b].count; };
+	while (m_threads > 1 && subtrees.size() < size_t(SUBTREES_PER_THREAD * m_threads)) {
+		vector<uint32_t>::iterator largest = max_element(subtrees.begin(), subtrees.end(), fewer);
+		uint32_t children[2];
+		if (m_nodes[*largest].count < MIN_SHARED_SUBTREE || !Split(*largest, children, m_threads))
+			break;
+		*largest = children[0];
+		subtrees.push_back(children[1]);
+	}
+	sort(subtrees.begin(), subtrees.end(), [fewer](uint32_t a, uint32_t b) { return fewer(b, a); });
+	shareSubtrees(m_threads, subtrees, [this](uint32_t subtree) { SplitSubtree(subtree); });
+}
+
+// splits node and everything below it on the calling thread, depth first
+void Bvh::SplitSubtree(uint32_t node)
+{
+	vector<uint32_t> pending(1, node);
+	while (!pending.empty()) {
+		uint32_t next = pending.back();
+		pending.pop_back();
+
+		uint32_t children[2];
+		if (Split(next, children)) {
+			pending.push_back(children[0]);
+			pending.push_back(children[1]);
+		}
+	}
+}
+
+void Bvh::Attach(Scene& scene, const BvhNode* nodes, uint32_t nodeCount, const uint32_t* prims)
+{
+	// a finished hierarchy is only ever read, so it may live in read-only memory
+	m_scene = &scene;
+	m_lazy = false;
+	m_nodes = const_cast<BvhNode*>(nodes);
+	m_prims = const_cast<uint32_t*>(prims);
+	m_lower = m_upper = m_centroid = 0;
+	m_state = 0;
+	m_nodeCount = nodeCount;
+	m_capacity = nodeCount;
+}
+
+// --------------------------------------------------------------------------
+// Updates
+
+uint32_t Bvh::Update(const vector<uint32_t>& moved)
+{
+	if (moved.empty())
+		return 0;
+	if (m_builder != SAH_BUILDER) {
+		Rebuild();
+		return 1;
+	}
+
+	uint32_t n = boundedPrimitiveCount(*m_scene);
+	vector<uint8_t> isMoved(n, 0);
+	for (uint32_t prim : moved) {
+		primitiveBounds(*m_scene, prim, m_lower[prim], m_upper[prim]);
+		m_centroid[prim] = 0.5f * (m_lower[prim] + m_upper[prim]);
+		isMoved[prim] = 1;
+	}
+
+	vector<Subtree> degraded;
+	Refit(0, isMoved, degraded);
+
+	// splitting a subtree again needs fresh nodes, as many as twice its primitives;
+	// its old ones are abandoned until the next full build reclaims them
+	uint32_t needed = 0;
+	for (const Subtree& subtree : degraded)
+		needed += 2 * subtree.count;
+	if (!degraded.empty() && (degraded[0].node == 0 || m_nodeCount + needed > m_capacity)) {
+		Rebuild();
+		return 1;
+	}
+
+	for (const Subtree& subtree : degraded) {
+		BvhNode& node = m_nodes[subtree.node];
+		node.first = subtree.first;
+		node.count = subtree.count;
+		if (m_lazy)
+			m_state[subtree.node].store(UNBUILT, memory_order_relaxed);
+		else
+			SplitAll(subtree.node);
+	}
+	return uint32_t(degraded.size());
+}
+
+// Recomputes the boxes of index and the nodes below it holding moved
+// primitives, bottom up. Subtrees that grew past REBUILD_GROWTH are added to
+// degraded, only the highest where one lies inside another.
+Bvh::Subtree Bvh::Refit(uint32_t index, const vector<uint8_t>& moved, vector<Subtree>& degraded)
+{
+	BvhNode& node = m_nodes[index];
+	Subtree subtree = { index, node.first, node.count, false };
+	float area = surfaceArea(node.lower, node.upper);
+
+	if (node.count > 0 || (m_lazy && m_state[index].load(memory_order_relaxed) != BUILT)) {
+		for (uint32_t i = node.first; i < node.first + node.count && !subtree.moved; i++)
+			subtree.moved = moved[m_prims[i]] != 0;
+		if (!subtree.moved)
+			return subtree;
+
+		node.lower = vec3(INFINITY);
+		node.upper = vec3(-INFINITY);
+		for (uint32_t i = node.first; i < node.first + node.count; i++) {
+			node.lower = glm::min(node.lower, m_lower[m_prims[i]]);
+			node.upper = glm::max(node.upper, m_upper[m_prims[i]]);
+		}
+		return subtree;
+	}
+
+	size_t mark = degraded.size();
+	Subtree left = Refit(node.first, moved, degraded);
+	Subtree right = Refit(node.first + 1, moved, degraded);
+	subtree.first = left.first;
+	subtree.count = left.count + right.count;
+	subtree.moved = left.moved || right.moved;
+	if (!subtree.moved)
+		return subtree;
+
+	const BvhNode& l = m_nodes[node.first];
+	const BvhNode& r = m_nodes[node.first + 1];
+	node.lower = glm::min(l.lower, r.lower);
+	node.upper = glm::max(l.upper, r.upper);
+	if (surfaceArea(node.lower, node.upper) > REBUILD_GROWTH * area) {
+		degraded.resize(mark);
+		degraded.push_back(subtree);
+	}
+	return subtree;
+}
+
+// --------------------------------------------------------------------------
+
+// Claims node for splitting, or waits until the thread that claimed it first
+// has published its children.
+void Bvh::Expand(uint32_t node)
+{
+	uint8_t expected = UNBUILT;
+	if (m_state[node].compare_exchange_strong(expected, BUILDING, memory_order_acquire)) {
+		uint32_t children[2];
+		Split(node, children);
+		m_state[node].store(BUILT, memory_order_release);
+		return;
+	}
+	while (m_state[node].load(memory_order_acquire) != BUILT)
+		this_thread::yield();
+}
+
+namespace {
+	struct Bin {
+		vec3 lower, upper;
+		uint32_t count;
+
+		Bin() : lower(INFINITY), upper(-INFINITY), count(0) {}
+
+		void Add(const vec3& primLower, const vec3& primUpper, uint32_t primCount) {
+			lower = glm::min(lower, primLower);
+			upper = glm::max(upper, primUpper);
+			count += primCount;
+		}
+	};
+
+	// the bins along each axis
+	struct Bins {
+		Bin axis[3][Bvh::BINS];
+
+		void Add(const Bins& other) {
+			for (int a = 0; a < 3; a++)
+				for (int i = 0; i < Bvh::BINS; i++)
+					axis[a][i].Add(other.axis[a][i].lower, other.axis[a][i].upper, other.axis[a][i].count);
+		}
+	};
+}
+
+// the bin of a centroid coordinate c, for bins starting at origin, scale
+// of them to a unit
+static inline int binOf(float c, float origin, float scale) {
+	return std::min(int((c - origin) * scale), Bvh::BINS - 1);
+}
+
+// Splits a node holding more than MAX_LEAF_SIZE primitives in two, between
+// the bins where the surface area heuristic's cost is lowest, sharing the
+// binning between threads if the node is large enough. A node whose
+// centroids all coincide is split in half. Returns false if the node stays
+// a leaf.
+bool Bvh::Split(uint32_t index, uint32_t children[2], int threads)
+{
+	BvhNode& node = m_nodes[index];
+	uint32_t first = node.first;
+	uint32_t count = node.count;
+	if (count <= MAX_LEAF_SIZE)
+		return false;
+	if (count < PARALLEL_BINNING)
+		threads = 1;
+
+	uint32_t* prims = m_prims + first;
+	const vec3* centroid = m_centroid;
+	Arena& scratch = threadScratch();
+	Arena::Marker mark = scratch.Mark();
+
+	// the bins divide the bounds of the centroids evenly
+	vec3 lower(INFINITY), upper(-INFINITY);
+	// parallelFor() may run fewer parts than threads, so every part starts
+	// out empty, as in Rebuild()
+	vec3* partLower = scratch.Allocate<vec3>(threads);
+	vec3* partUpper = scratch.Allocate<vec3>(threads);
+	fill(partLower, partLower + threads, vec3(INFINITY));
+	fill(partUpper, partUpper + threads, vec3(-INFINITY));
+	size_t chunk = parallelChunk(threads, count);
+	parallelFor(threads, count, [&](size_t begin, size_t end) {
+		size_t part = begin / chunk;
+		for (size_t i = begin; i < end; i++) {
+			partLower[part] = glm::min(partLower[part], centroid[prims[i]]);
+			partUpper[part] = glm::max(partUpper[part], centroid[prims[i]]);
+		}
+	});
+	for (int i = 0; i < threads; i++) {
+		lower = glm::min(lower, partLower[i]);
+		upper = glm::max(upper, partUpper[i]);
+	}
+	vec3 extent(upper - lower);
+	vec3 scale;
+	for (int axis = 0; axis < 3; axis++)
+		scale[axis] = extent[axis] > 0 ? BINS / extent[axis] : 0;
+
+	Bins* parts = scratch.Allocate<Bins>(threads);
+	parallelFor(threads, count, [&](size_t begin, size_t end) {
+		Bins& bins = parts[begin / chunk];
+		for (size_t i = begin; i < end; i++) {
+			uint32_t prim = prims[i];
+			for (int axis = 0; axis < 3; axis++) {
+				Bin& bin = bins.axis[axis][binOf(centroid[prim][axis], lower[axis], scale[axis])];
+				bin.Add(m_lower[prim], m_upper[prim], 1);
+			}
+		}
+	});
+	for (int i = 1; i < threads; i++)
+		parts[0].Add(parts[i]);
+	const Bins& bins = parts[0];
+
+	// the cost of splitting before bin i, for each axis across which the
+	// centroids spread
+	float bestCost = INFINITY;
+	int bestAxis = -1;
+	int bestSplit = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		if (scale[axis] == 0)
+			continue;
+		const Bin* bin = bins.axis[axis];
+
+		// rightCost[i] is the area bounding bins i..BINS-1 times their primitives
+		float rightCost[BINS];
+		Bin right;
+		for (int i = BINS - 1; i > 0; i--) {
+			right.Add(bin[i].lower, bin[i].upper, bin[i].count);
+			rightCost[i] = surfaceArea(right.lower, right.upper) * right.count;
+		}
+
+		Bin left;
+		for (int i = 1; i < BINS; i++) {
+			left.Add(bin[i-1].lower, bin[i-1].upper, bin[i-1].count);
+			if (left.count == 0 || left.count == count)
+				continue;
+			float cost = surfaceArea(left.lower, left.upper) * left.count + rightCost[i];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = i;
+			}
+		}
+	}
+
+	uint32_t split = count / 2;
+	Bin halves[2];
+	if (bestAxis >= 0) {
+		float origin = lower[bestAxis], axisScale = scale[bestAxis];
+		split = uint32_t(std::partition(prims, prims + count, [=](uint32_t prim) {
+			return binOf(centroid[prim][bestAxis], origin, axisScale) < bestSplit;
+		}) - prims);
+		for (int i = 0; i < BINS; i++) {
+			const Bin& bin = bins.axis[bestAxis][i];
+			halves[i >= bestSplit].Add(bin.lower, bin.upper, bin.count);
+		}
+	}
+	else {
+		for (uint32_t i = 0; i < count; i++)
+			halves[i >= split].Add(m_lower[prims[i]], m_upper[prims[i]], 1);
+	}
+
+	scratch.Rewind(mark);
+
+	uint32_t left = m_nodeCount.fetch_add(2);
+	uint32_t ranges[2][2] = { { first, split }, { first + split, count - split } };
+	for (int c = 0; c < 2; c++) {
+		BvhNode& child = m_nodes[left + c];
+		child.lower = halves[c].lower;
+		child.upper = halves[c].upper;
+		child.first = ranges[c][0];
+		child.count = ranges[c][1];
+		children[c] = left + c;
+	}
+
+	node.first = left;
+	node.count = 0;
+	return true;
+}
+
+// --------------------------------------------------------------------------
+// Linear builds
+
+// bits of each coordinate in a Morton code, and of the digits sorted by
+static const int MORTON_BITS = 21;
+static const int RADIX_BITS = 8;
+static const int RADIX_SIZE = 1 << RADIX_BITS;
+
+// leaves a treelet is grown to before it is rearranged
+static const int TREELET_LEAVES = 7;
+
+namespace {
+	// a node of a linear build, and how many levels below the root it lies
+	struct LinearNode {
+		uint32_t node;
+		int depth;
+	};
+}
+
+// spreads the low MORTON_BITS bits of x out to every third bit
+static inline uint64_t spreadBits(uint64_t x) {
+	x &= (1u << MORTON_BITS) - 1;
+	x = (x | x << 32) & 0x001f00000000ffffull;
+	x = (x | x << 16) & 0x001f0000ff0000ffull;
+	x = (x | x << 8) & 0x100f00f00f00f00full;
+	x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+	x = (x | x << 2) & 0x1249249249249249ull;
+	return x;
+}
+
+static inline int highestBit(uint64_t x) {
+#ifdef __GNUC__
+	return 63 - __builtin_clzll(x);
+#else
+	int bit = 0;
+	while (x >>= 1)
+		bit++;
+	return bit;
+#endif
+}
+
+// Sorts keys, and values alongside, by a least significant digit first radix
+// sort, each pass shared between threads. Each thread counts the digits in
+// its range, then moves its items to where the counts of all put them, so
+// every pass is stable. Passes over a digit all the keys share are skipped.
+static void radixSort(int threads, uint64_t* keys, uint32_t* values, size_t n)
+{
+	vector<uint64_t> keyBuffer(n);
+	vector<uint32_t> valueBuffer(n);
+	uint64_t* fromKeys = keys;
+	uint32_t* fromValues = values;
+	uint64_t* toKeys = keyBuffer.data();
+	uint32_t* toValues = valueBuffer.data();
+	size_t chunk = std::max(parallelChunk(threads, n), size_t(1));
+	vector<size_t> counts(size_t(threads) * RADIX_SIZE);
+
+	for (int shift = 0; shift < 64; shift += RADIX_BITS) {
+		fill(counts.begin(), counts.end(), 0);
+		parallelFor(threads, n, [&](size_t first, size_t last) {
+			size_t* count = &counts[first / chunk * RADIX_SIZE];
+			for (size_t i = first; i < last; i++)
+				count[(fromKeys[i] >> shift) & (RADIX_SIZE - 1)]++;
+		});
+
+		// turn the counts into where each thread's items of each digit go
+		size_t offset = 0;
+		bool shared = false;
+		for (int digit = 0; digit < RADIX_SIZE; digit++) {
+			size_t total = 0;
+			for (int part = 0; part < threads; part++) {
+				size_t& count = counts[size_t(part) * RADIX_SIZE + digit];
+				total += count;
+				count = offset + total - count;
+			}
+			shared = shared || total == n;
+			offset += total;
+		}
+		if (shared)
+			continue;
+
+		parallelFor(threads, n, [&](size_t first, size_t last) {
+			size_t* next = &counts[first / chunk * RADIX_SIZE];
+			for (size_t i = first; i < last; i++) {
+				size_t to = next[(fromKeys[i] >> shift) & (RADIX_SIZE - 1)]++;
+				toKeys[to] = fromKeys[i];
+				toValues[to] = fromValues[i];
+			}
+		});
+		swap(fromKeys, toKeys);
+		swap(fromValues, toValues);
+	}
+
+	if (fromKeys != keys) {
+		copy(fromKeys, fromKeys + n, keys);
+		copy(fromValues, fromValues + n, values);
+	}
+}
+
+// Sorts the primitives by the Morton codes of their centroids within the
+// root's box, then splits the root down to the leaves as the SAH build does:
+// the top one node at a time, the subtrees below on all threads. Nodes split
+// at the top are given their boxes last, from their children's.
+void Bvh::BuildLinear()
+{
+	uint32_t n = m_nodes[0].count;
+	if (n <= MAX_LEAF_SIZE)
+		return;
+	int threads = n >= PARALLEL_BINNING ? m_threads : 1;
+
+	vector<vec3> partLower(threads, vec3(INFINITY)), partUpper(threads, vec3(-INFINITY));
+	size_t chunk = parallelChunk(threads, n);
+	parallelFor(threads, n, [&](size_t first, size_t last) {
+		size_t part = first / chunk;
+		for (size_t i = first; i < last; i++) {
+			partLower[part] = glm::min(partLower[part], m_centroid[i]);
+			partUpper[part] = glm::max(partUpper[part], m_centroid[i]);
+		}
+	});
+	vec3 lower(INFINITY), upper(-INFINITY);
+	for (int i = 0; i < threads; i++) {
+		lower = glm::min(lower, partLower[i]);
+		upper = glm::max(upper, partUpper[i]);
+	}
+	vec3 extent(upper - lower);
+	vec3 scale;
+	for (int axis = 0; axis < 3; axis++)
+		scale[axis] = extent[axis] > 0 ? (1u << MORTON_BITS) / extent[axis] : 0;
+
+	vector<uint64_t> codes(n);
+	parallelFor(threads, n, [&](size_t first, size_t last) {
+		for (size_t i = first; i < last; i++) {
+			uvec3 cell(glm::min(uvec3((m_centroid[i] - lower) * scale), uvec3((1u << MORTON_BITS) - 1)));
+			codes[i] = spreadBits(cell.x) << 2 | spreadBits(cell.y) << 1 | spreadBits(cell.z);
+		}
+	});
+	radixSort(threads, codes.data(), m_prims, n);
+
+	vector<LinearNode> top, subtrees(1, LinearNode{ 0, 0 });
+	auto fewer = [this](const LinearNode& a, const LinearNode& b) {
+		return m_nodes[a.node].count < m_nodes[b.node].count;
+	};
+	while (m_threads > 1 && subtrees.size() < size_t(SUBTREES_PER_THREAD * m_threads)) {
+		vector<LinearNode>::iterator largest = max_element(subtrees.begin(), subtrees.end(), fewer);
+		uint32_t children[2];
+		if (m_nodes[largest->node].count < MIN_SHARED_SUBTREE
+		    || !SplitLinear(largest->node, largest->depth, children, codes.data()))
+			break;
+		top.push_back(*largest);
+		int depth = largest->depth + 1;
+		*largest = LinearNode{ children[0], depth };
+		subtrees.push_back(LinearNode{ children[1], depth });
+	}
+	sort(subtrees.begin(), subtrees.end(), [fewer](const LinearNode& a, const LinearNode& b) { return fewer(b, a); });
+	shareSubtrees(m_threads, subtrees, [this, &codes](const LinearNode& subtree) {
+		EmitLinear(subtree.node, subtree.depth, codes.data());
+	});
+
+	// every node at the top was split before its children
+	for (size_t i = top.size(); i-- > 0; ) {
+		BvhNode& node = m_nodes[top[i].node];
+		node.lower = glm::min(m_nodes[node.first].lower, m_nodes[node.first + 1].lower);
+		node.upper = glm::max(m_nodes[node.first].upper, m_nodes[node.first + 1].upper);
+	}
+	if (m_builder != TREELET_BUILDER)
+		return;
+
+	// treelets are rearranged bottom up, so those at the top come last,
+	// knowing the levels below every node so as to stay within MAX_DEPTH
+	vector<uint8_t> heights(m_nodeCount);
+	shareSubtrees(m_threads, subtrees, [this, &heights](const LinearNode& subtree) {
+		OptimiseTreelets(subtree.node, subtree.depth, heights);
+	});
+	for (size_t i = top.size(); i-- > 0; ) {
+		const BvhNode& node = m_nodes[top[i].node];
+		heights[top[i].node] = uint8_t(1 + std::max(heights[node.first], heights[node.first + 1]));
+		RestructureTreelet(top[i].node, top[i].depth, heights);
+	}
+	OrderPrims();
+}
+
+// levels of halving that take count primitives down to leaves
+static int halvings(uint32_t count) {
+	int levels = 0;
+	for (; count > uint32_t(Bvh::MAX_LEAF_SIZE); count -= count / 2)
+		levels++;
+	return levels;
+}
+
+// Splits a node depth levels below the root, its primitives sorted by code,
+// where the highest bit in which the codes of its first and last differ
+// changes, or in half if they are all the same. Each such bit divides the
+// codes at most once on the way down, but halving equal codes goes on below
+// that; so once halving is all that would keep the leaves within MAX_DEPTH,
+// the node is halved whatever its codes. The children are given their
+// primitives but not their boxes. Returns false if the node stays a leaf.
+bool Bvh::SplitLinear(uint32_t index, int depth, uint32_t children[2], const uint64_t* codes)
+{
+	BvhNode& node = m_nodes[index];
+	uint32_t first = node.first;
+	uint32_t count = node.count;
+	if (count <= MAX_LEAF_SIZE)
+		return false;
+
+	uint32_t split = count / 2;
+	uint64_t differ = codes[first] ^ codes[first + count - 1];
+	if (differ != 0 && depth + halvings(count) < MAX_DEPTH - 1) {
+		uint64_t bit = uint64_t(1) << highestBit(differ);
+		split = uint32_t(partition_point(codes + first, codes + first + count, [bit](uint64_t code) {
+			return (code & bit) == 0;
+		}) - (codes + first));
+	}
+
+	uint32_t left = m_nodeCount.fetch_add(2);
+	uint32_t ranges[2][2] = { { first, split }, { first + split, count - split } };
+	for (int c = 0; c < 2; c++) {
+		BvhNode& child = m_nodes[left + c];
+		child.first = ranges[c][0];
+		child.count = ranges[c][1];
+		children[c] = left + c;
+	}
+	node.first = left;
+	node.count = 0;
+	return true;
+}
+
+// splits a node with SplitLinear down to its leaves, then gives every node
+// its box, children before parents
+void Bvh::EmitLinear(uint32_t index, int depth, const uint64_t* codes)
+{
+	uint32_t children[2];
+	BvhNode& node = m_nodes[index];
+	if (SplitLinear(index, depth, children, codes)) {
+		EmitLinear(children[0], depth + 1, codes);
+		EmitLinear(children[1], depth + 1, codes);
+		node.lower = glm::min(m_nodes[children[0]].lower, m_nodes[children[1]].lower);
+		node.upper = glm::max(m_nodes[children[0]].upper, m_nodes[children[1]].upper);
+		return;
+	}
+	node.lower = vec3(INFINITY);
+	node.upper = vec3(-INFINITY);
+	for (uint32_t i = node.first; i < node.first + node.count; i++) {
+		node.lower = glm::min(node.lower, m_lower[m_prims[i]]);
+		node.upper = glm::max(node.upper, m_upper[m_prims[i]]);
+	}
+}
+
+// rearranges the treelet rooted at every interior node below and including
+// node, which lies depth levels below the root, children before parents,
+// recording the levels below each in heights
+void Bvh::OptimiseTreelets(uint32_t index, int depth, vector<uint8_t>& heights)
+{
+	const BvhNode& node = m_nodes[index];
+	if (node.count > 0) {
+		heights[index] = 0;
+		return;
+	}
+	OptimiseTreelets(node.first, depth + 1, heights);
+	OptimiseTreelets(node.first + 1, depth + 1, heights);
+	heights[index] = uint8_t(1 + std::max(heights[node.first], heights[node.first + 1]));
+	RestructureTreelet(index, depth, heights);
+}
+
+// Grows a treelet from a node by opening whichever of its leaves, the
+// subtrees below it, has the largest surface area, until it has
+// TREELET_LEAVES of them. The arrangement of those leaves whose interior
+// nodes have the least total area, which is what the surface area heuristic
+// weighs, is found by trying every split of every subset of them, smallest
+// first. If it is better than the treelet's, and would not take any node
+// past MAX_DEPTH given the heights below the leaves, the treelet's interior
+// nodes are reused for it, with their heights updated; the leaves are moved
+// whole.
+void Bvh::RestructureTreelet(uint32_t index, int depth, vector<uint8_t>& heights)
+{
+	BvhNode& root = m_nodes[index];
+	if (root.count > 0)
+		return;
+
+	// the treelet's leaves, and the first of each pair of sibling nodes it owns
+	uint32_t leaves[TREELET_LEAVES] = { root.first, root.first + 1 };
+	uint32_t pairs[TREELET_LEAVES - 1] = { root.first };
+	int leafCount = 2;
+	float area = surfaceArea(root.lower, root.upper);
+	while (leafCount < TREELET_LEAVES) {
+		int widest = -1;
+		float widestArea = -1;
+		for (int i = 0; i < leafCount; i++) {
+			const BvhNode& leaf = m_nodes[leaves[i]];
+			float leafArea = surfaceArea(leaf.lower, leaf.upper);
+			if (leaf.count == 0 && leafArea > widestArea) {
+				widest = i;
+				widestArea = leafArea;
+			}
+		}
+		if (widest < 0)
+			break;
+		uint32_t opened = m_nodes[leaves[widest]].first;
+		pairs[leafCount - 1] = opened;
+		leaves[widest] = opened;
+		leaves[leafCount++] = opened + 1;
+		area += widestArea;
+	}
+	if (leafCount < 3)
+		return;
+
+	// the boxes and least cost of every subset of the leaves, and the split
+	// of each that gives it
+	const int SUBSETS = 1 << TREELET_LEAVES;
+	BvhNode leafNodes[TREELET_LEAVES];
+	vec3 lower[SUBSETS], upper[SUBSETS];
+	float cost[SUBSETS];
+	int splits[SUBSETS];
+	int height[SUBSETS];
+	int all = (1 << leafCount) - 1;
+	for (int i = 0; i < leafCount; i++)
+		leafNodes[i] = m_nodes[leaves[i]];
+	for (int set = 1; set <= all; set++) {
+		int low = set & -set;
+		if (set == low) {
+			int leaf = highestBit(uint64_t(set));
+			lower[set] = leafNodes[leaf].lower;
+			upper[set] = leafNodes[leaf].upper;
+			cost[set] = 0;
+			height[set] = heights[leaves[leaf]];
+			continue;
+		}
+		lower[set] = glm::min(lower[low], lower[set ^ low]);
+		upper[set] = glm::max(upper[low], upper[set ^ low]);
+
+		// each split once, with the lowest leaf on the left
+		float best = INFINITY;
+		int others = set ^ low;
+		for (int rest = (others - 1) & others; ; rest = (rest - 1) & others) {
+			int left = rest | low;
+			float split = cost[left] + cost[set ^ left];
+			if (split < best) {
+				best = split;
+				splits[set] = left;
+			}
+			if (rest == 0)
+				break;
+		}
+		cost[set] = surfaceArea(lower[set], upper[set]) + best;
+		height[set] = 1 + std::max(height[splits[set]], height[set ^ splits[set]]);
+	}
+	if (!(cost[all] < area) || depth + height[all] > MAX_DEPTH - 1)
+		return;
+
+	// lays out the subset with its children in the next pair of nodes
+	int nextPair = 0;
+	struct Placed { int set; uint32_t node; };
+	Placed pending[TREELET_LEAVES * 2];
+	int top = 0;
+	pending[top++] = { all, index };
+	while (top > 0) {
+		Placed placed = pending[--top];
+		BvhNode& node = m_nodes[placed.node];
+		heights[placed.node] = uint8_t(height[placed.set]);
+		if ((placed.set & (placed.set - 1)) == 0) {
+			node = leafNodes[highestBit(uint64_t(placed.set))];
+			continue;
+		}
+		uint32_t pair = pairs[nextPair++];
+		node.lower = lower[placed.set];
+		node.upper = upper[placed.set];
+		node.first = pair;
+		node.count = 0;
+		pending[top++] = { splits[placed.set], pair };
+		pending[top++] = { placed.set ^ splits[placed.set], pair + 1 };
+	}
+}
+
+// Rewrites the primitive list in the order a depth-first walk reaches the
+// leaves, as rearranging treelets leaves subtrees' primitives scattered,
+// and caching and refitting expect each subtree's to be contiguous.
+void Bvh::OrderPrims()
+{
+	vector<uint32_t> ordered;
+	ordered.reserve(boundedPrimitiveCount(*m_scene));
+	vector<uint32_t> pending(1, 0);
+	while (!pending.empty()) {
+		BvhNode& node = m_nodes[pending.back()];
+		pending.pop_back();
+		if (node.count == 0) {
+			pending.push_back(node.first + 1);
+			pending.push_back(node.first);
+			continue;
+		}
+		uint32_t first = uint32_t(ordered.size());
+		ordered.insert(ordered.end(), m_prims + node.first, m_prims + node.first + node.count);
+		node.first = first;
+	}
+	copy(ordered.begin(), ordered.end(), m_prims);
+}
+
+// --------------------------------------------------------------------------
+// Traversal
+
+// Makes sure the cluster rooted at node, if any, is in memory. Returns false
+// if the ray must skip it because the calling thread is deferring paging.
+inline bool Bvh::Page(uint32_t node)
+{
+	uint32_t cluster = m_pager->ClusterAt(node);
+	return cluster == ClusterPager::NONE || m_pager->Use(cluster);
+}
+
+namespace {
+	struct StackEntry {
+		uint32_t node;
+		float tNear;
+	};
+
+	// a ray part way through ClosestHits(), or none once there are no more
+	// to take: which it is, a copy of it and its nearest hit so far, and the
+	// nodes it has still to visit
+	struct RayState {
+		int ray;
+		vec3 o, d, invD;
+		float dist;
+		uint32_t prim;
+		bool found;
+		int top;
+		StackEntry stack[Bvh::STACK_SIZE];
+	};
+}
+
+static inline void prefetch(const void* address) {
+#ifdef __GNUC__
+	__builtin_prefetch(address);
+#endif
+}
+
+// Pushes the nodes a ray starts from, the cut's or else the root, if it
+// meets them within tMax, the farthest at the bottom so the nearest is
+// visited first. Returns the number pushed.
+static int startTraversal(const BvhNode* nodes, const vec3& o, const vec3& invD, float tMax, const BvhCut* cut,
+                          StackEntry* stack) {
+	int top = 0;
+	float tNear;
+	if (cut) {
+		for (int i = 0; i < cut->count; i++) {
+			if (!hitBox(nodes[cut->nodes[i]], o, invD, tMax, tNear))
+				continue;
+			int j = top++;
+			for (; j > 0 && stack[j-1].tNear < tNear; j--)
+				stack[j] = stack[j-1];
+			stack[j] = { cut->nodes[i], tNear };
+		}
+	}
+	else if (hitBox(nodes[0], o, invD, tMax, tNear))
+		stack[top++] = { 0, tNear };
+	return top;
+}
+
+// pushes whichever children of an interior node a ray meets within tMax,
+// the farther first so the nearer is visited next
+static inline void pushChildren(const BvhNode* nodes, const BvhNode& node, const vec3& o, const vec3& invD,
+                                float tMax, StackEntry* stack, int& top) {
+	float tLeft, tRight;
+	bool hitLeft = hitBox(nodes[node.first], o, invD, tMax, tLeft);
+	bool hitRight = hitBox(nodes[node.first + 1], o, invD, tMax, tRight);
+	if (hitLeft && hitRight) {
+		if (tLeft < tRight) {
+			stack[top++] = { node.first + 1, tRight };
+			stack[top++] = { node.first, tLeft };
+		}
+		else {
+			stack[top++] = { node.first, tLeft };
+			stack[top++] = { node.first + 1, tRight };
+		}
+	}
+	else if (hitLeft)
+		stack[top++] = { node.first, tLeft };
+	else if (hitRight)
+		stack[top++] = { node.first + 1, tRight };
+}
+
+bool Bvh::ClosestHit(const vec3& o, const vec3& d, SurfaceHit& hit, const BvhCut* cut)
+{
+	if (!m_nodes)
+		return false;
+
+	vec3 invD(1.f / d);
+	StackEntry stack[STACK_SIZE];
+	int top = startTraversal(m_nodes, o, invD, hit.dist, cut, stack);
+	bool found = false;
+
+	while (top > 0) {
+		StackEntry entry = stack[--top];
+		if (entry.tNear > hit.dist)
+			continue;
+
+		if (m_pager && !Page(entry.node))
+			continue;
+		Touch(entry.node);
+		const BvhNode& node = m_nodes[entry.node];
+		if (node.count > 0) {
+			for (uint32_t i = node.first; i < node.first + node.count; i++) {
+				if (intersectPrimitive(*m_scene, m_prims[i], o, d, hit.dist)) {
+					hit.prim = m_prims[i];
+					found = true;
+				}
+			}
+			continue;
+		}
+		pushChildren(m_nodes, node, o, invD, hit.dist, stack, top);
+	}
+	return found;
+}
+
+// Each ray in flight takes one node from its stack and visits it just as
+// ClosestHit() would. The node it will visit next was read when it was
+// pushed, so it is likely still cached; what that node leads to, its
+// children or its primitives, is prefetched before moving on to the next
+// ray, and has had the other rays' turns to arrive by the ray's own.
+void Bvh::ClosestHits(const vec3* o, const vec3* d, SurfaceHit* hits, bool* found, int count, const BvhCut* cut)
+{
+	if (!m_nodes || m_lazy || m_pager) {
+		Accelerator::ClosestHits(o, d, hits, found, count, cut);
+		return;
+	}
+
+	// gives a ray state the next ray that meets any node at all, having
+	// handed back the hit of the ray it held
+	int next = 0;
+	auto take = [&](RayState& state) {
+		if (state.ray >= 0 && state.found) {
+			hits[state.ray].dist = state.dist;
+			hits[state.ray].prim = state.prim;
+			found[state.ray] = true;
+		}
+		for (; next < count; next++) {
+			found[next] = false;
+			state.o = o[next];
+			state.d = d[next];
+			state.invD = 1.f / state.d;
+			state.dist = hits[next].dist;
+			state.top = startTraversal(m_nodes, state.o, state.invD, state.dist, cut, state.stack);
+			if (state.top > 0) {
+				state.ray = next++;
+				state.found = false;
+				return;
+			}
+		}
+		state.ray = -1;
+	};
+
+	RayState states[INTERLEAVED_RAYS];
+	int active = 0;
+	for (RayState& state : states) {
+		state.ray = -1;
+		take(state);
+		active += state.ray >= 0;
+	}
+
+	while (active > 0) {
+		for (RayState& state : states) {
+			if (state.ray < 0)
+				continue;
+
+			StackEntry entry = state.stack[--state.top];
+			if (entry.tNear <= state.dist) {
+				const BvhNode& node = m_nodes[entry.node];
+				if (node.count > 0) {
+					for (uint32_t i = node.first; i < node.first + node.count; i++) {
+						if (intersectPrimitive(*m_scene, m_prims[i], state.o, state.d, state.dist)) {
+							state.prim = m_prims[i];
+							state.found = true;
+						}
+					}
+				}
+				else
+					pushChildren(m_nodes, node, state.o, state.invD, state.dist, state.stack, state.top);
+			}
+
+			if (state.top == 0) {
+				take(state);
+				active -= state.ray < 0;
+				continue;
+			}
+			const BvhNode& upcoming = m_nodes[state.stack[state.top - 1].node];
+			if (upcoming.count > 0)
+				prefetch(m_prims + upcoming.first);
+			else {
+				prefetch(m_nodes + upcoming.first);
+				prefetch(m_nodes + upcoming.first + 1);
+			}
+		}
+	}
+}
+
+bool Bvh::Occluded(const vec3& o, const vec3& d, float maxDist)
+{
+	if (!m_nodes)
+		return false;
+
+	vec3 invD(1.f / d);
+	uint32_t stack[STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+
+	float tNear;
+	while (top > 0) {
+		uint32_t index = stack[--top];
+		if (!hitBox(m_nodes[index], o, invD, maxDist, tNear))
+			continue;
+
+		if (m_pager && !Page(index))
+			continue;
+		Touch(index);
+		const BvhNode& node = m_nodes[index];
+		if (node.count > 0) {
+			for (uint32_t i = node.first; i < node.first + node.count; i++) {
+				float dist = maxDist;
+				if (intersectPrimitive(*m_scene, m_prims[i], o, d, dist))
+					return true;
+			}
+			continue;
+		}
+		stack[top++] = node.first;
+		stack[top++] = node.first + 1;
+	}
+	return false;
+}
+
+// --------------------------------------------------------------------------
+// Frustum culling
+
+enum { OUTSIDE, STRADDLING, INSIDE };
+
+// where a node's box lies relative to frustum, judged plane by plane from the
+// box corners farthest along and against each plane's normal
+static int classify(const Frustum& frustum, const BvhNode& node) {
+	int result = INSIDE;
+	for (int i = 0; i < 4; i++) {
+		const vec3& n = frustum.normal[i];
+		vec3 farthest(n.x > 0 ? node.upper.x : node.lower.x,
+		              n.y > 0 ? node.upper.y : node.lower.y,
+		              n.z > 0 ? node.upper.z : node.lower.z);
+		vec3 nearest(n.x > 0 ? node.lower.x : node.upper.x,
+		             n.y > 0 ? node.lower.y : node.upper.y,
+		             n.z > 0 ? node.lower.z : node.upper.z);
+		if (dot(n, farthest - frustum.apex) < 0)
+			return OUTSIDE;
+		if (dot(n, nearest - frustum.apex) < 0)
+			result = STRADDLING;
+	}
+	return result;
+}
+
+// Descends from the root, dropping nodes outside the frustum and opening those
+// that straddle it, until every remaining node is a leaf, wholly inside, the
+// root of a streamed cluster, not yet built, or the cut is full. Splitting is
+// left to the rays, which may never reach a node inside the frustum.
+void Bvh::Cull(const Frustum& frustum, BvhCut& cut)
+{
+	cut.count = 0;
+	if (!m_nodes || m_nodes[0].lower.x > m_nodes[0].upper.x)
+		return;
+
+	uint32_t pending[BvhCut::MAX_NODES];
+	int top = 0;
+	pending[top++] = 0;
+	while (top > 0) {
+		uint32_t index = pending[--top];
+		int where = classify(frustum, m_nodes[index]);
+		if (where == OUTSIDE)
+			continue;
+
+		bool open = where == STRADDLING && cut.count + top + 2 <= BvhCut::MAX_NODES
+			&& !(m_pager && m_pager->ClusterAt(index) != ClusterPager::NONE)
+			&& !(m_lazy && m_state[index].load(memory_order_acquire) != BUILT)
+			&& m_nodes[index].count == 0;
+		if (open) {
+			pending[top++] = m_nodes[index].first + 1;
+			pending[top++] = m_nodes[index].first;
+		}
+		else
+			cut.nodes[cut.count++] = index;
+	}
+}
@@ -0,0 +1,201 @@
+// ==========================================================================
+// Bounding Volume Hierarchy
+//
+// A binary BVH over the scene's bounded primitives (spheres and triangles),
+// split top-down with the surface area heuristic. Planes are unbounded and
+// are tested by the caller. Each node's primitives are binned by centroid
+// into BINS intervals along each axis, and the node split between the bins
+// where the heuristic's cost is lowest.
+//
+// An eager build shares the work between threads. The nodes at the top of
+// the tree, with the most primitives, are split one at a time, with their
+// primitives binned by all threads together, until there are a few subtrees
+// for each thread; the threads then take the subtrees, largest first, and
+// build each on its own.
+//
+// For scenes rebuilt every frame there is a much faster linear build, the
+// LBVH of Lauterbach et al.: primitives are sorted along a Morton curve
+// through their centroids with a parallel radix sort, and each node is split
+// where the highest bit of the codes it spans changes, so building costs
+// little more than the sort. Its hierarchy is slower to trace; an optional
+// pass (Karras and Aila's) rearranges every treelet of up to seven subtrees
+// into the shape of least surface area, recovering much of the difference.
+// A linear hierarchy is never lazy, and is rebuilt whole rather than refitted
+// when primitives move.
+//
+// The hierarchy can be built eagerly, or lazily for fast time-to-first-pixel:
+// a lazy build creates only the root, and every node reached by a ray for
+// the first time is split then, by whichever thread got there first. Parts
+// of the scene no ray ever reaches are never built.
+//
+// All storage comes from the scene's arena. Nodes refer to each other and to
+// primitives by index, never by pointer.
+//
+// A batch of rays can be traced together, for hierarchies too large for the
+// cache, where a ray spends most of its time waiting for nodes to arrive
+// from memory. A few rays are kept in flight, each advanced by one node in
+// turn; having visited one, a ray prefetches what its next will read and
+// yields to the others, so the wait is overlapped with their work. Every ray
+// visits the same nodes in the same order as it would on its own.
+//
+// When primitives change shape in place the hierarchy is refitted rather
+// than rebuilt: every node's box is recomputed from its children's, and only
+// subtrees that have grown so much that traversing them has clearly become
+// more expensive are split again from scratch.
+// ==========================================================================
+#ifndef BVH_H
+#define BVH_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <glm/glm.hpp>
+#include "Scene.h"
+#include "Accelerator.h"
+
+// --------------------------------------------------------------------------
+
+// how an eager hierarchy is split
+enum BvhBuilder
+{
+	SAH_BUILDER,        // binned surface area heuristic
+	LINEAR_BUILDER,     // Morton order of the centroids
+	TREELET_BUILDER,    // Morton order, then treelets restructured
+	BVH_BUILDER_COUNT
+};
+
+// name of a builder as given on the command line
+const char* bvhBuilderName(BvhBuilder builder);
+
+// sets builder to the one called name, returning false if there is none
+bool parseBvhBuilder(const std::string& name, BvhBuilder& builder);
+
+// 32 bytes, so two nodes share a cache line
+struct BvhNode
+{
+	glm::vec3 lower;
+	uint32_t  first;    // interior: left child (right is first+1)
+	                    // leaf or unbuilt: first entry in the primitive list
+	glm::vec3 upper;
+	uint32_t  count;    // primitives below a leaf or unbuilt node, 0 if interior
+};
+
+class Bvh : public Accelerator
+{
+	Scene*      m_scene;
+	BvhNode*    m_nodes;
+	uint32_t*   m_prims;        // primitive ids, grouped by leaf as nodes split
+	glm::vec3*  m_lower;        // bounds and centroid of each primitive id
+	glm::vec3*  m_upper;
+	glm::vec3*  m_centroid;
+
+	std::atomic<uint32_t> m_nodeCount;
+	uint32_t    m_capacity;     // nodes allocated
+	bool        m_lazy;
+	int         m_threads;      // threads an eager build is shared between
+	BvhBuilder  m_builder;
+
+	// per-node build state, only allocated for lazy builds
+	enum { UNBUILT, BUILDING, BUILT };
+	std::atomic<uint8_t>* m_state;
+
+	// pages clusters of a streamed hierarchy in as rays reach them
+	ClusterPager* m_pager;
+	bool Page(uint32_t node);
+
+	void Rebuild();
+	void Expand(uint32_t node);
+	bool Split(uint32_t node, uint32_t children[2], int threads = 1);
+	void SplitAll(uint32_t node);
+	void SplitSubtree(uint32_t node);
+
+	// linear builds, over primitives sorted by their Morton codes
+	void BuildLinear();
+	bool SplitLinear(uint32_t node, int depth, uint32_t children[2], const uint64_t* codes);
+	void EmitLinear(uint32_t node, int depth, const uint64_t* codes);
+	void OptimiseTreelets(uint32_t node, int depth, std::vector<uint8_t>& heights);
+	void RestructureTreelet(uint32_t node, int depth, std::vector<uint8_t>& heights);
+	void OrderPrims();
+
+	// a node's place in the primitive list, and whether it holds moved ones
+	struct Subtree
+	{
+		uint32_t node, first, count;
+		bool moved;
+	};
+	Subtree Refit(uint32_t node, const std::vector<uint8_t>& moved, std::vector<Subtree>& degraded);
+
+	// makes sure node has been split, waiting if another thread is splitting it
+	void Touch(uint32_t node)
+	{
+		if (m_lazy && m_state[node].load(std::memory_order_acquire) != BUILT)
+			Expand(node);
+	}
+
+	Bvh(const Bvh&);
+	Bvh& operator=(const Bvh&);
+
+public:
+	static const int MAX_LEAF_SIZE = 4;
+	static const int BINS = 16;
+	// Linear builds keep every node within MAX_DEPTH - 1 levels of the root,
+	// so that a traversal never holds more than MAX_DEPTH nodes on top of
+	// the cut it starts from. SAH builds are not capped.
+	static const int MAX_DEPTH = 64;
+	static const int STACK_SIZE = MAX_DEPTH + BvhCut::MAX_NODES;
+
+	// growth in surface area past which Update() rebuilds a subtree
+	static const float REBUILD_GROWTH;
+
+	Bvh();
+
+	// builds the hierarchy over scene's spheres and triangles in its arena;
+	// an eager build is shared between threads (one per core if 0)
+	void Build(Scene& scene, bool lazy, int threads = 0);
+
+	// adopts a hierarchy built earlier over scene, whose nodeCount nodes and
+	// primitive list are stored elsewhere and outlive this Bvh
+	void Attach(Scene& scene, const BvhNode* nodes, uint32_t nodeCount, const uint32_t* prims);
+
+	// the Accelerator queries
+	bool ClosestHit(const glm::vec3& o, const glm::vec3& d, SurfaceHit& hit, const BvhCut* cut = 0) override;
+	void Cull(const Frustum& frustum, BvhCut& cut) override;
+	bool Occluded(const glm::vec3& o, const glm::vec3& d, float maxDist) override;
+
+	// traces INTERLEAVED_RAYS of the rays at a time, interleaved, unless the
+	// hierarchy is lazy or streamed, when they are traced one by one
+	static const int INTERLEAVED_RAYS = 8;
+	void ClosestHits(const glm::vec3* o, const glm::vec3* d, SurfaceHit* hits, bool* found, int count,
+	                 const BvhCut* cut = 0) override;
+
+	// how the next Build() splits the hierarchy (SAH_BUILDER by default)
+	void SetBuilder(BvhBuilder builder) { m_builder = builder; }
+	BvhBuilder Builder() const { return m_builder; }
+
+	// Brings the hierarchy up to date after the bounded primitives listed in
+	// moved have changed shape in place. Boxes are refitted up the tree, and
+	// the highest subtrees whose area grew by more than REBUILD_GROWTH are
+	// split again (when rays reach them, for a lazy build); if there is no
+	// room left for their nodes, the whole hierarchy is rebuilt instead.
+	// Returns the number of subtrees rebuilt, counting a full rebuild as one.
+	// A linear hierarchy is always rebuilt in full. Only hierarchies made by
+	// Build() can be updated.
+	uint32_t Update(const std::vector<uint32_t>& moved);
+	bool Updatable() const { return m_lower != 0; }
+
+	// number of nodes created so far
+	uint32_t NodeCount() const { return m_nodeCount.load(); }
+
+	// the nodes and primitive list, for saving a finished (non-lazy) build
+	const BvhNode* Nodes() const { return m_nodes; }
+	const uint32_t* Prims() const { return m_prims; }
+	bool Lazy() const { return m_lazy; }
+
+	// streams an attached hierarchy through pager, or stops streaming if 0
+	void SetPager(ClusterPager* pager) { m_pager = pager; }
+	ClusterPager* Pager() const override { return m_pager; }
+};
+
+// --------------------------------------------------------------------------
+#endif // BVH_H
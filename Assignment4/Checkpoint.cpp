@@ -0,0 +1,230 @@
+// ==========================================================================
+// Render Checkpoints
+// ==========================================================================
+
+#include "Checkpoint.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+// File layout: a header, then the sums and the moments of every pixel.
+
+static const char MAGIC[8] = { 'R', 'T', 'C', 'H', 'E', 'C', 'K', 0 };
+static const uint32_t VERSION = 1;
+
+struct CheckpointHeader {
+	char magic[8];
+	uint32_t version;
+	int32_t samples;
+	uint64_t scene;
+	float eye[3];
+	float yaw, pitch, focal;
+	int32_t width, height;
+	int32_t x0, y0, x1, y1;
+	int32_t sampler;
+	int32_t pad;
+};
+
+static size_t pixelCount(const Checkpoint& checkpoint)
+{
+	if (checkpoint.x1 <= checkpoint.x0 || checkpoint.y1 <= checkpoint.y0)
+		return 0;
+	return size_t(checkpoint.x1 - checkpoint.x0) * size_t(checkpoint.y1 - checkpoint.y0);
+}
+
+bool Checkpoint::SameRender(const Checkpoint& other) const
+{
+	return scene == other.scene && eye == other.eye && yaw == other.yaw && pitch == other.pitch
+	    && focal == other.focal && width == other.width && height == other.height
+	    && x0 == other.x0 && y0 == other.y0 && x1 == other.x1 && y1 == other.y1 && sampler == other.sampler;
+}
+
+// FNV-1a, continuing from hash
+static uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
+{
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+template <typename T>
+static uint64_t hashValue(uint64_t hash, const T& value)
+{
+	return hashBytes(hash, &value, sizeof(value));
+}
+
+template <typename T>
+static uint64_t hashArray(uint64_t hash, const ArenaArray<T>& array)
+{
+	hash = hashValue(hash, uint64_t(array.size()));
+	return hashBytes(hash, array.begin(), array.size() * sizeof(T));
+}
+
+// The light's fields are hashed one by one, and the primitives whole, as
+// they are made only of floats.
+uint64_t sceneFingerprint(const Scene& scene)
+{
+	const Light& light = scene.light;
+	uint64_t hash = 14695981039346656037ull;
+	hash = hashValue(hash, light.p);
+	hash = hashValue(hash, light.r);
+	hash = hashValue(hash, light.intensity);
+	hash = hashValue(hash, int32_t(light.shape));
+	hash = hashValue(hash, light.radius);
+	hash = hashValue(hash, light.u);
+	hash = hashValue(hash, light.v);
+	hash = hashValue(hash, int32_t(light.samples));
+	hash = hashArray(hash, scene.planes);
+	hash = hashArray(hash, scene.spheres);
+	hash = hashArray(hash, scene.triangles);
+	return hashArray(hash, scene.materials);
+}
+
+// --------------------------------------------------------------------------
+// Reading and writing
+
+bool writeCheckpoint(const string& filename, const Checkpoint& checkpoint)
+{
+	CheckpointHeader header = CheckpointHeader();
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.samples = checkpoint.samples;
+	header.scene = checkpoint.scene;
+	for (int i = 0; i < 3; i++)
+		header.eye[i] = checkpoint.eye[i];
+	header.yaw = checkpoint.yaw;
+	header.pitch = checkpoint.pitch;
+	header.focal = checkpoint.focal;
+	header.width = checkpoint.width;
+	header.height = checkpoint.height;
+	header.x0 = checkpoint.x0;
+	header.y0 = checkpoint.y0;
+	header.x1 = checkpoint.x1;
+	header.y1 = checkpoint.y1;
+	header.sampler = checkpoint.sampler;
+
+	size_t pixels = pixelCount(checkpoint);
+	if (checkpoint.sums.size() != pixels || checkpoint.moments.size() != pixels)
+		return false;
+
+	// as with the scene cache, write beside the file and rename over it
+	string partial = filename + ".partial";
+	{
+		ofstream output(partial.c_str(), ios::binary | ios::trunc);
+		output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		output.write(reinterpret_cast<const char*>(checkpoint.sums.data()), pixels * sizeof(glm::vec3));
+		output.write(reinterpret_cast<const char*>(checkpoint.moments.data()), pixels * sizeof(glm::vec2));
+		output.flush();
+		if (!output) {
+			output.close();
+			remove(partial.c_str());
+			return false;
+		}
+	}
+#ifdef _WIN32
+	remove(filename.c_str());
+#endif
+	return rename(partial.c_str(), filename.c_str()) == 0;
+}
+
+bool readCheckpoint(const string& filename, Checkpoint& checkpoint)
+{
+	ifstream input(filename.c_str(), ios::binary);
+	CheckpointHeader header;
+	if (!input.read(reinterpret_cast<char*>(&header), sizeof(header))
+	    || memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION)
+		return false;
+
+	checkpoint.samples = header.samples;
+	checkpoint.scene = header.scene;
+	checkpoint.eye = glm::vec3(header.eye[0], header.eye[1], header.eye[2]);
+	checkpoint.yaw = header.yaw;
+	checkpoint.pitch = header.pitch;
+	checkpoint.focal = header.focal;
+	checkpoint.width = header.width;
+	checkpoint.height = header.height;
+	checkpoint.x0 = header.x0;
+	checkpoint.y0 = header.y0;
+	checkpoint.x1 = header.x1;
+	checkpoint.y1 = header.y1;
+	checkpoint.sampler = header.sampler;
+
+	size_t pixels = pixelCount(checkpoint);
+	checkpoint.sums.resize(pixels);
+	checkpoint.moments.resize(pixels);
+	input.read(reinterpret_cast<char*>(checkpoint.sums.data()), pixels * sizeof(glm::vec3));
+	input.read(reinterpret_cast<char*>(checkpoint.moments.data()), pixels * sizeof(glm::vec2));
+	return bool(input);
+}
+
+// --------------------------------------------------------------------------
+
+CheckpointWriter::CheckpointWriter()
+	: m_writing(false), m_failed(false), m_stopping(false)
+{
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_stopping = true;
+	}
+	m_wake.notify_all();
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void CheckpointWriter::SetFile(const string& filename)
+{
+	Flush();
+	lock_guard<mutex> lock(m_lock);
+	m_filename = filename;
+}
+
+void CheckpointWriter::Submit(unique_ptr<Checkpoint> checkpoint)
+{
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_pending = std::move(checkpoint);
+		if (!m_thread.joinable())
+			m_thread = thread(&CheckpointWriter::Work, this);
+	}
+	m_wake.notify_all();
+}
+
+bool CheckpointWriter::Flush()
+{
+	unique_lock<mutex> lock(m_lock);
+	m_idle.wait(lock, [this] { return !m_pending && !m_writing; });
+	return !m_failed;
+}
+
+// writes whatever is waiting, until stopped with nothing left to write
+void CheckpointWriter::Work()
+{
+	unique_lock<mutex> lock(m_lock);
+	while (true) {
+		m_wake.wait(lock, [this] { return m_pending || m_stopping; });
+		if (!m_pending)
+			break;
+
+		unique_ptr<Checkpoint> checkpoint(std::move(m_pending));
+		string filename(m_filename);
+		m_writing = true;
+		lock.unlock();
+		bool written = writeCheckpoint(filename, *checkpoint);
+		lock.lock();
+		m_writing = false;
+		m_failed = !written;
+		if (!m_pending)
+			m_idle.notify_all();
+	}
+}
@@ -0,0 +1,113 @@
+// ==========================================================================
+// Render Checkpoints
+//
+// A long path traced render can be saved part way through and carried on
+// later, after the process has been killed, to exactly the image it would
+// have made uninterrupted. What a render has accumulated is no more than
+// every pixel's sum of paths and of their luminance and its square, since
+// the samples of the next path are found from the pixel, the path's index
+// and the sampler alone (see Sampler.h): no generator state need be kept.
+//
+// A checkpoint holds those sums for the pixels being traced, the number of
+// paths through each, and what identifies the render they belong to: the
+// scene, camera, image size, crop window and sampler. Only a render that
+// matches in all of them resumes from it.
+//
+// Checkpoints are written by a thread of their own, so that the renderer
+// only hands over a copy of its sums and goes on tracing. Each is written
+// beside the file and renamed over it, so the file on disk is always a
+// complete checkpoint, however the process is stopped.
+// ==========================================================================
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <glm/glm.hpp>
+#include "Scene.h"
+
+// --------------------------------------------------------------------------
+
+struct Checkpoint
+{
+	// the render: a hash of the scene, the camera's eye, yaw, pitch and
+	// focal length, the image size, the traced rectangle and the sampler
+	uint64_t  scene;
+	glm::vec3 eye;
+	float     yaw, pitch, focal;
+	int32_t   width, height;
+	int32_t   x0, y0, x1, y1;
+	int32_t   sampler;
+
+	// paths traced through every pixel of the rectangle, and for each, row
+	// by row from the bottom, the sum of their colours and of their
+	// luminance and its square
+	int32_t   samples;
+	std::vector<glm::vec3> sums;
+	std::vector<glm::vec2> moments;
+
+	Checkpoint() : scene(0), eye(0), yaw(0), pitch(0), focal(0), width(0), height(0),
+	               x0(0), y0(0), x1(0), y1(0), sampler(0), samples(0)
+	{}
+
+	// true if both were taken of the same render
+	bool SameRender(const Checkpoint& other) const;
+};
+
+// a hash of everything in the scene that affects how it renders
+uint64_t sceneFingerprint(const Scene& scene);
+
+// writes checkpoint to filename, replacing it only once the new one is complete
+bool writeCheckpoint(const std::string& filename, const Checkpoint& checkpoint);
+
+// reads the checkpoint in filename, returning false if there is none or it
+// was written by a different version of the format
+bool readCheckpoint(const std::string& filename, Checkpoint& checkpoint);
+
+// --------------------------------------------------------------------------
+// Writes checkpoints to one file on a background thread. A checkpoint handed
+// over while the last is still being written waits for it, replacing any
+// other still waiting, so only the latest is ever written.
+
+class CheckpointWriter
+{
+	std::string m_filename;
+	std::unique_ptr<Checkpoint> m_pending;
+	bool m_writing;
+	bool m_failed;          // whether the latest write failed
+	bool m_stopping;
+
+	std::thread m_thread;
+	std::mutex m_lock;
+	std::condition_variable m_wake;     // a checkpoint is waiting, or stopping
+	std::condition_variable m_idle;     // nothing is waiting or being written
+
+	void Work();
+
+	CheckpointWriter(const CheckpointWriter&);
+	CheckpointWriter& operator=(const CheckpointWriter&);
+
+public:
+	CheckpointWriter();
+
+	// writes whatever is still waiting before returning
+	~CheckpointWriter();
+
+	// the file written from now on
+	void SetFile(const std::string& filename);
+
+	// queues checkpoint to be written, starting the thread if need be
+	void Submit(std::unique_ptr<Checkpoint> checkpoint);
+
+	// blocks until every checkpoint handed over has been written, returning
+	// false if the latest could not be
+	bool Flush();
+};
+
+// --------------------------------------------------------------------------
+#endif // CHECKPOINT_H
@@ -0,0 +1,213 @@
+// ==========================================================================
+// Cluster Paging for Out-of-Core Scenes
+// ==========================================================================
+
+#include "ClusterPager.h"
+
+#include <algorithm>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+enum { EVICTED, RESIDENT };
+
+// --------------------------------------------------------------------------
+// Memory ranges
+
+static size_t pageSize() {
+#ifdef _WIN32
+	return 4096;
+#else
+	static size_t size = size_t(sysconf(_SC_PAGESIZE));
+	return size;
+#endif
+}
+
+// faults in the pages holding bytes [data, data + size), in address order
+static void loadRange(const void* data, size_t size) {
+	if (size == 0)
+		return;
+	const char* p = static_cast<const char*>(data);
+#ifndef _WIN32
+	size_t page = pageSize();
+	uintptr_t start = reinterpret_cast<uintptr_t>(p) & ~(page - 1);
+	madvise(reinterpret_cast<void*>(start), reinterpret_cast<uintptr_t>(p) + size - start, MADV_WILLNEED);
+#endif
+	volatile char sink = 0;
+	for (size_t offset = 0; offset < size; offset += pageSize())
+		sink += p[offset];
+	sink += p[size - 1];
+}
+
+// lets the system drop the pages lying wholly inside [data, data + size);
+// pages shared with a neighbouring cluster are left alone. On Windows the
+// system trims the mapping by itself under memory pressure.
+static void evictRange(const void* data, size_t size) {
+#ifndef _WIN32
+	size_t page = pageSize();
+	uintptr_t begin = (reinterpret_cast<uintptr_t>(data) + page - 1) & ~(page - 1);
+	uintptr_t end = (reinterpret_cast<uintptr_t>(data) + size) & ~(page - 1);
+	if (end > begin)
+		madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+#endif
+}
+
+// --------------------------------------------------------------------------
+// Per-thread deferral
+
+namespace {
+	struct Deferral {
+		bool deferring;
+		vector<uint32_t> missing;
+
+		Deferral() : deferring(false)
+		{}
+	};
+}
+
+static Deferral& threadDeferral() {
+	static thread_local Deferral deferral;
+	return deferral;
+}
+
+void ClusterPager::SetDeferring(bool deferring)
+{
+	threadDeferral().deferring = deferring;
+}
+
+vector<uint32_t>& ClusterPager::Missing()
+{
+	return threadDeferral().missing;
+}
+
+// --------------------------------------------------------------------------
+
+const uint32_t ClusterPager::NONE;
+const uint32_t ClusterPager::CLUSTER_SIZE;
+
+ClusterPager::ClusterPager()
+	: m_scene(0), m_nodes(0), m_prims(0), m_clusters(0), m_clusterCount(0),
+	  m_budget(0), m_residentBytes(0), m_epoch(0)
+{
+}
+
+void ClusterPager::Attach(const Scene& scene, const BvhNode* nodes, const uint32_t* prims,
+                          const ClusterInfo* clusters, uint32_t clusterCount, uint32_t residentNodes,
+                          size_t budget)
+{
+	m_scene = &scene;
+	m_nodes = nodes;
+	m_prims = prims;
+	m_clusters = clusters;
+	m_clusterCount = clusterCount;
+	m_budget = budget;
+	m_residentBytes = 0;
+	m_epoch = 0;
+
+	m_clusterOf.assign(residentNodes, NONE);
+	m_resident.reset(new atomic<uint8_t>[clusterCount]);
+	m_lastUse.reset(new atomic<uint32_t>[clusterCount]);
+	for (uint32_t c = 0; c < clusterCount; c++) {
+		m_clusterOf[clusters[c].root] = c;
+		m_resident[c].store(EVICTED, memory_order_relaxed);
+		m_lastUse[c].store(0, memory_order_relaxed);
+	}
+
+	// every ray passes through the top levels, so they are read in at once
+	loadRange(nodes, residentNodes*sizeof(BvhNode));
+}
+
+size_t ClusterPager::Bytes(uint32_t cluster) const
+{
+	const ClusterInfo& info = m_clusters[cluster];
+	return info.nodeCount*sizeof(BvhNode) + info.primCount*sizeof(uint32_t)
+		+ info.triCount*(sizeof(Triangle) + sizeof(Material));
+}
+
+bool ClusterPager::Use(uint32_t cluster)
+{
+	uint32_t epoch = m_epoch.load(memory_order_relaxed);
+	if (m_lastUse[cluster].load(memory_order_relaxed) != epoch)
+		m_lastUse[cluster].store(epoch, memory_order_relaxed);
+	if (m_resident[cluster].load(memory_order_acquire) == RESIDENT)
+		return true;
+
+	Deferral& deferral = threadDeferral();
+	if (deferral.deferring) {
+		deferral.missing.push_back(cluster);
+		return false;
+	}
+	vector<uint32_t> one(1, cluster);
+	PageIn(one);
+	return true;
+}
+
+void ClusterPager::Load(uint32_t cluster)
+{
+	const ClusterInfo& info = m_clusters[cluster];
+	uint32_t spheres = uint32_t(m_scene->spheres.size());
+	loadRange(m_nodes + info.nodeFirst, info.nodeCount*sizeof(BvhNode));
+	loadRange(m_prims + info.primFirst, info.primCount*sizeof(uint32_t));
+	loadRange(m_scene->triangles.data + info.triFirst, info.triCount*sizeof(Triangle));
+	loadRange(m_scene->materials.data + spheres + info.triFirst, info.triCount*sizeof(Material));
+}
+
+void ClusterPager::Evict(uint32_t cluster)
+{
+	const ClusterInfo& info = m_clusters[cluster];
+	uint32_t spheres = uint32_t(m_scene->spheres.size());
+	evictRange(m_nodes + info.nodeFirst, info.nodeCount*sizeof(BvhNode));
+	evictRange(m_prims + info.primFirst, info.primCount*sizeof(uint32_t));
+	evictRange(m_scene->triangles.data + info.triFirst, info.triCount*sizeof(Triangle));
+	evictRange(m_scene->materials.data + spheres + info.triFirst, info.triCount*sizeof(Material));
+}
+
+// Drops the least recently used clusters until the resident total is back
+// under the budget, with some slack so the next batch does not immediately
+// trigger another pass. A ray still inside an evicted cluster is unaffected
+// apart from speed: its pages are simply read from the file again.
+void ClusterPager::EnforceBudget()
+{
+	if (m_residentBytes <= m_budget)
+		return;
+
+	vector<uint32_t> resident;
+	for (uint32_t c = 0; c < m_clusterCount; c++)
+		if (m_resident[c].load(memory_order_relaxed) == RESIDENT)
+			resident.push_back(c);
+	atomic<uint32_t>* lastUse = m_lastUse.get();
+	sort(resident.begin(), resident.end(), [lastUse](uint32_t a, uint32_t b) {
+		return lastUse[a].load(memory_order_relaxed) < lastUse[b].load(memory_order_relaxed);
+	});
+
+	size_t target = m_budget - m_budget / 8;
+	for (size_t i = 0; i < resident.size() && m_residentBytes > target; i++) {
+		m_resident[resident[i]].store(EVICTED, memory_order_release);
+		Evict(resident[i]);
+		m_residentBytes -= Bytes(resident[i]);
+	}
+}
+
+void ClusterPager::PageIn(vector<uint32_t>& clusters)
+{
+	// clusters are numbered in file order, so sorting makes the reads sequential
+	sort(clusters.begin(), clusters.end());
+	clusters.erase(unique(clusters.begin(), clusters.end()), clusters.end());
+
+	lock_guard<mutex> lock(m_lock);
+	uint32_t epoch = m_epoch.fetch_add(1, memory_order_relaxed) + 1;
+	for (uint32_t c : clusters) {
+		m_lastUse[c].store(epoch, memory_order_relaxed);
+		if (m_resident[c].load(memory_order_relaxed) == RESIDENT)
+			continue;
+		Load(c);
+		m_resident[c].store(RESIDENT, memory_order_release);
+		m_residentBytes += Bytes(c);
+	}
+	EnforceBudget();
+	clusters.clear();
+}
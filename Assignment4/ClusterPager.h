@@ -0,0 +1,100 @@
+// ==========================================================================
+// Cluster Paging for Out-of-Core Scenes
+//
+// A scene cache stores its BVH as a few resident top levels above a set of
+// clusters: subtrees of at most CLUSTER_SIZE primitives whose nodes,
+// primitive list entries, triangles and materials are each contiguous in the
+// file. When streaming, only the top levels are assumed to be in memory; a
+// cluster's pages are brought in the first time a ray enters it, and the
+// least recently used clusters are dropped again whenever the resident total
+// passes the memory budget.
+//
+// Waiting on the disk for every ray that strays into a missing cluster would
+// make reads random, so the renderer traces a tile with paging deferred: such
+// rays give up and record the cluster they needed, and the tile's misses are
+// then paged in together in file order before those rays are traced again.
+// ==========================================================================
+#ifndef CLUSTERPAGER_H
+#define CLUSTERPAGER_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+#include "Scene.h"
+#include "Bvh.h"
+
+// --------------------------------------------------------------------------
+
+// where one cluster lives in the cache, in elements of each section
+struct ClusterInfo
+{
+	uint32_t root;          // resident node at the top of the cluster
+	uint32_t nodeFirst, nodeCount;
+	uint32_t primFirst, primCount;
+	uint32_t triFirst, triCount;
+};
+
+class ClusterPager
+{
+	const Scene*        m_scene;
+	const BvhNode*      m_nodes;
+	const uint32_t*     m_prims;
+	const ClusterInfo*  m_clusters;
+	uint32_t            m_clusterCount;
+
+	// cluster rooted at each resident node, or NONE
+	std::vector<uint32_t> m_clusterOf;
+
+	size_t  m_budget;
+	std::atomic<size_t> m_residentBytes;
+	std::unique_ptr<std::atomic<uint8_t>[]>  m_resident;
+	std::unique_ptr<std::atomic<uint32_t>[]> m_lastUse;     // epoch of last use
+	std::atomic<uint32_t> m_epoch;
+	std::mutex m_lock;
+
+	size_t Bytes(uint32_t cluster) const;
+	void Load(uint32_t cluster);
+	void Evict(uint32_t cluster);
+	void EnforceBudget();
+
+	ClusterPager(const ClusterPager&);
+	ClusterPager& operator=(const ClusterPager&);
+
+public:
+	static const uint32_t NONE = 0xffffffff;
+	static const uint32_t CLUSTER_SIZE = 4096;
+
+	ClusterPager();
+
+	// starts paging the clusters of scene and the BVH nodes and primitive
+	// list it was saved with, keeping about budget bytes of them in memory
+	void Attach(const Scene& scene, const BvhNode* nodes, const uint32_t* prims,
+	            const ClusterInfo* clusters, uint32_t clusterCount, uint32_t residentNodes,
+	            size_t budget);
+
+	// the cluster whose root is node, or NONE
+	uint32_t ClusterAt(uint32_t node) const
+	{
+		return node < m_clusterOf.size() ? m_clusterOf[node] : NONE;
+	}
+
+	// Called as a ray enters cluster. Returns true once the cluster is in
+	// memory, which is immediately unless the calling thread is deferring,
+	// in which case a missing cluster is added to Missing() and false returned.
+	bool Use(uint32_t cluster);
+
+	// pages in the listed clusters in file order, then empties the list
+	void PageIn(std::vector<uint32_t>& clusters);
+
+	size_t ResidentBytes() const { return m_residentBytes; }
+
+	// paging deferral for the calling thread, and the clusters its rays have
+	// missed while deferring
+	static void SetDeferring(bool deferring);
+	static std::vector<uint32_t>& Missing();
+};
+
+// --------------------------------------------------------------------------
+#endif // CLUSTERPAGER_H
@@ -0,0 +1,156 @@
+// ==========================================================================
+// Fast Approximate Math for Shading
+// ==========================================================================
+
+#include "FastMath.h"
+
+#include <algorithm>
+#include <random>
+
+using namespace glm;
+using namespace std;
+
+MathMode mathMode = EXACT_MATH;
+
+// --------------------------------------------------------------------------
+// Batched lighting
+
+#ifdef FASTMATH_SSE
+
+static inline __m128 dot4(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+}
+
+// 1/sqrt(x) in four lanes, refined by one Newton step
+static inline __m128 rsqrt4(__m128 x)
+{
+	__m128 y = _mm_rsqrt_ps(x);
+	__m128 yyx = _mm_mul_ps(_mm_mul_ps(y, y), x);
+	return _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_set1_ps(0.5f), yyx)));
+}
+
+void phongBatch(ShadeBatch& b, unsigned power)
+{
+	for (int i = 0; i < ShadeBatch::WIDTH; i += 4) {
+		__m128 nx = _mm_loadu_ps(b.nx + i), ny = _mm_loadu_ps(b.ny + i), nz = _mm_loadu_ps(b.nz + i);
+		__m128 lx = _mm_loadu_ps(b.lx + i), ly = _mm_loadu_ps(b.ly + i), lz = _mm_loadu_ps(b.lz + i);
+		__m128 dx = _mm_loadu_ps(b.dx + i), dy = _mm_loadu_ps(b.dy + i), dz = _mm_loadu_ps(b.dz + i);
+
+		// the lengths are divided out of the dot products rather than the vectors
+		__m128 invN = rsqrt4(dot4(nx, ny, nz, nx, ny, nz));
+		__m128 invL = rsqrt4(dot4(lx, ly, lz, lx, ly, lz));
+		__m128 invD = rsqrt4(dot4(dx, dy, dz, dx, dy, dz));
+		__m128 nl = _mm_mul_ps(dot4(nx, ny, nz, lx, ly, lz), _mm_mul_ps(invN, invL));
+		__m128 dl = _mm_mul_ps(dot4(dx, dy, dz, lx, ly, lz), _mm_mul_ps(invD, invL));
+		__m128 dn = _mm_mul_ps(dot4(dx, dy, dz, nx, ny, nz), _mm_mul_ps(invD, invN));
+
+		// d.reflect(l, n) = d.l - 2 (n.l)(d.n), for unit vectors
+		__m128 rv = _mm_sub_ps(dl, _mm_mul_ps(_mm_set1_ps(2.f), _mm_mul_ps(nl, dn)));
+
+		// lanes whose factors get too small to multiply safely are zeroed
+		__m128 result = _mm_set1_ps(1.f), x = rv;
+		__m128 sign = _mm_set1_ps(-0.f), tiny = _mm_set1_ps(POW_UNDERFLOW);
+		for (unsigned n = power; n; n >>= 1) {
+			x = _mm_and_ps(x, _mm_cmpge_ps(_mm_andnot_ps(sign, x), tiny));
+			if (n & 1) {
+				result = _mm_mul_ps(result, x);
+				result = _mm_and_ps(result, _mm_cmpge_ps(_mm_andnot_ps(sign, result), tiny));
+			}
+			x = _mm_mul_ps(x, x);
+		}
+		__m128 facing = _mm_cmplt_ps(rv, _mm_setzero_ps());
+		_mm_storeu_ps(b.diffuse + i, nl);
+		_mm_storeu_ps(b.specular + i, _mm_and_ps(facing, result));
+	}
+}
+
+#else
+
+void phongBatch(ShadeBatch& b, unsigned power)
+{
+	for (int i = 0; i < ShadeBatch::WIDTH; i++) {
+		vec3 n(fastNormalize(vec3(b.nx[i], b.ny[i], b.nz[i])));
+		vec3 l(fastNormalize(vec3(b.lx[i], b.ly[i], b.lz[i])));
+		vec3 d(fastNormalize(vec3(b.dx[i], b.dy[i], b.dz[i])));
+		float rv = dot(d, reflect(l, n));
+		b.diffuse[i] = dot(n, l);
+		b.specular[i] = rv < 0 ? powInt(rv, power) : 0.f;
+	}
+}
+
+#endif
+
+void phongBatchExact(ShadeBatch& b, unsigned power)
+{
+	for (int i = 0; i < ShadeBatch::WIDTH; i++) {
+		vec3 n(normalize(vec3(b.nx[i], b.ny[i], b.nz[i])));
+		vec3 l(normalize(vec3(b.lx[i], b.ly[i], b.lz[i])));
+		vec3 d(normalize(vec3(b.dx[i], b.dy[i], b.dz[i])));
+		float rv = dot(d, reflect(l, n));
+		b.diffuse[i] = dot(n, l);
+		b.specular[i] = rv < 0 ? pow(rv, float(power)) : 0.f;
+	}
+}
+
+// --------------------------------------------------------------------------
+// Self-check
+
+FastMathErrors fastMathTolerances()
+{
+	// one Newton step leaves about 2^-22 of relative error; raising to the
+	// 256th power multiplies an error in the cosine by up to 256
+	FastMathErrors tolerance = { 2e-6f, 2e-6f, 1e-4f, 1e-5f, 2e-3f };
+	return tolerance;
+}
+
+FastMathErrors measureFastMathErrors(int samples)
+{
+	FastMathErrors worst = { 0, 0, 0, 0, 0 };
+	mt19937 generator(453);
+	uniform_real_distribution<float> coordinate(-10.f, 10.f);
+	uniform_real_distribution<float> cosine(-1.f, 1.f);
+	uniform_real_distribution<float> exponent(-20.f, 20.f);
+
+	auto randomVector = [&]() {
+		vec3 v;
+		do
+			v = vec3(coordinate(generator), coordinate(generator), coordinate(generator));
+		while (dot(v, v) < 1e-4f);
+		return v;
+	};
+
+	for (int i = 0; i < samples; i++) {
+		float x = ldexp(uniform_real_distribution<float>(1.f, 2.f)(generator), int(exponent(generator)));
+		worst.rsqrt = std::max(worst.rsqrt, fabs(fastRsqrt(x) * sqrt(x) - 1.f));
+
+		vec3 v(randomVector());
+		worst.normalize = std::max(worst.normalize, fabs(length(fastNormalize(v)) - 1.f));
+
+		float c = cosine(generator);
+		worst.power = std::max(worst.power, fabs(powInt(c, 256) - pow(c, 256.f)));
+	}
+
+	// the batch is checked mostly on mirror-like configurations, where the
+	// specular term is large and most sensitive to error
+	for (int i = 0; i < samples / ShadeBatch::WIDTH; i++) {
+		ShadeBatch fast, exact;
+		for (int k = 0; k < ShadeBatch::WIDTH; k++) {
+			vec3 n(randomVector()), l(randomVector());
+			vec3 d(-reflect(normalize(l), normalize(n)) + 0.05f * normalize(randomVector()));
+			if (k % 4 == 3)
+				d = randomVector();
+			fast.nx[k] = n.x; fast.ny[k] = n.y; fast.nz[k] = n.z;
+			fast.lx[k] = l.x; fast.ly[k] = l.y; fast.lz[k] = l.z;
+			fast.dx[k] = d.x; fast.dy[k] = d.y; fast.dz[k] = d.z;
+		}
+		exact = fast;
+		phongBatch(fast, 256);
+		phongBatchExact(exact, 256);
+		for (int k = 0; k < ShadeBatch::WIDTH; k++) {
+			worst.diffuse = std::max(worst.diffuse, fabs(fast.diffuse[k] - exact.diffuse[k]));
+			worst.specular = std::max(worst.specular, fabs(fast.specular[k] - exact.specular[k]));
+		}
+	}
+	return worst;
+}
@@ -0,0 +1,107 @@
+// ==========================================================================
+// File Change Notification
+// ==========================================================================
+
+#include "FileWatcher.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+
+#ifdef __linux__
+
+FileWatcher::FileWatcher()
+	: m_fd(-1)
+{
+}
+
+FileWatcher::~FileWatcher()
+{
+	if (m_fd >= 0)
+		close(m_fd);
+}
+
+bool FileWatcher::Watch(const string& path)
+{
+	if (m_fd >= 0)
+		close(m_fd);
+	m_path = path;
+
+	size_t slash = path.rfind('/');
+	string directory = (slash == string::npos) ? "." : path.substr(0, slash + 1);
+	m_name = (slash == string::npos) ? path : path.substr(slash + 1);
+
+	m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_fd < 0)
+		return false;
+	if (inotify_add_watch(m_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+		close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+	return true;
+}
+
+bool FileWatcher::Changed()
+{
+	if (m_fd < 0)
+		return false;
+
+	// drain every pending event, noting whether any concerned our file
+	bool changed = false;
+	char buffer[4096] __attribute__((aligned(__alignof__(inotify_event))));
+	ssize_t length;
+	while ((length = read(m_fd, buffer, sizeof(buffer))) > 0) {
+		for (char* p = buffer; p < buffer + length; ) {
+			const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+			if (event->len > 0 && m_name == event->name)
+				changed = true;
+			p += sizeof(inotify_event) + event->len;
+		}
+	}
+	return changed;
+}
+
+#else
+
+static time_t modificationTime(const string& path)
+{
+	struct stat status;
+	return stat(path.c_str(), &status) == 0 ? status.st_mtime : 0;
+}
+
+FileWatcher::FileWatcher()
+	: m_modified(0)
+{
+}
+
+FileWatcher::~FileWatcher()
+{
+}
+
+bool FileWatcher::Watch(const string& path)
+{
+	m_path = path;
+	m_modified = modificationTime(path);
+	return m_modified != 0;
+}
+
+bool FileWatcher::Changed()
+{
+	time_t modified = modificationTime(m_path);
+	if (modified == m_modified || modified == 0)
+		return false;
+	m_modified = modified;
+	return true;
+}
+
+#endif
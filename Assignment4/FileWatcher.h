@@ -0,0 +1,43 @@
+// ==========================================================================
+// File Change Notification
+//
+// Watches a single file for changes without blocking, so the display loop
+// can check it every frame. On Linux this uses inotify on the directory
+// holding the file, since most editors save by writing a new file and
+// renaming it over the old one, which a watch on the file itself would not
+// survive. Elsewhere the file's modification time is polled.
+// ==========================================================================
+#ifndef FILEWATCHER_H
+#define FILEWATCHER_H
+
+#include <string>
+#include <time.h>
+
+// --------------------------------------------------------------------------
+
+class FileWatcher
+{
+	std::string m_path;
+#ifdef __linux__
+	std::string m_name;     // file name within the watched directory
+	int         m_fd;
+#else
+	time_t      m_modified;
+#endif
+
+	FileWatcher(const FileWatcher&);
+	FileWatcher& operator=(const FileWatcher&);
+
+public:
+	FileWatcher();
+	~FileWatcher();
+
+	// starts watching path, returning false if it cannot be watched
+	bool Watch(const std::string& path);
+
+	// true if the file has been written or replaced since the last call
+	bool Changed();
+};
+
+// --------------------------------------------------------------------------
+#endif // FILEWATCHER_H
@@ -0,0 +1,232 @@
+// ==========================================================================
+// Uniform Grid
+// ==========================================================================
+
+#include "Grid.h"
+#include "Parallel.h"
+
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+using namespace glm;
+using namespace std;
+
+const float Grid::CELLS_PER_PRIMITIVE = 2.f;
+
+// primitives remembered per ray so that those spanning cells are tested once
+static const int MAILBOX_SIZE = 8;
+
+// --------------------------------------------------------------------------
+
+Grid::Grid()
+	: m_scene(0), m_lower(0), m_upper(0), m_resolution(0), m_cellSize(0), m_invCellSize(0)
+{
+}
+
+ivec3 Grid::CellOf(const vec3& p) const
+{
+	return clamp(ivec3((p - m_lower) * m_invCellSize), ivec3(0), m_resolution - 1);
+}
+
+// --------------------------------------------------------------------------
+// Building
+
+void Grid::Build(Scene& scene, int threads)
+{
+	m_scene = &scene;
+	m_resolution = ivec3(0);
+	m_cellStart.clear();
+	m_cellPrims.clear();
+
+	uint32_t n = boundedPrimitiveCount(scene);
+	if (n == 0)
+		return;
+	threads = buildThreads(threads);
+
+	vector<vec3> lower(n), upper(n);
+	vector<vec3> partLower(threads, vec3(INFINITY)), partUpper(threads, vec3(-INFINITY));
+	size_t chunk = parallelChunk(threads, n);
+	parallelFor(threads, n, [&](size_t first, size_t last) {
+		size_t part = first / chunk;
+		for (size_t i = first; i < last; i++) {
+			primitiveBounds(scene, uint32_t(i), lower[i], upper[i]);
+			partLower[part] = glm::min(partLower[part], lower[i]);
+			partUpper[part] = glm::max(partUpper[part], upper[i]);
+		}
+	});
+	m_lower = vec3(INFINITY);
+	m_upper = vec3(-INFINITY);
+	for (int i = 0; i < threads; i++) {
+		m_lower = glm::min(m_lower, partLower[i]);
+		m_upper = glm::max(m_upper, partUpper[i]);
+	}
+
+	// cells as near cubic as the bounds allow; a flat scene still gets a
+	// little depth so that its volume, and the cell count, is not zero
+	vec3 extent(m_upper - m_lower);
+	float largest = std::max(extent.x, std::max(extent.y, extent.z));
+	extent = glm::max(extent, vec3(largest > 0 ? largest * 1e-3f : 1.f));
+	float cellsPerUnit = cbrt(CELLS_PER_PRIMITIVE * n / (extent.x * extent.y * extent.z));
+	m_resolution = clamp(ivec3(extent * cellsPerUnit), ivec3(1), ivec3(MAX_RESOLUTION));
+	m_upper = m_lower + extent;
+	m_cellSize = extent / vec3(m_resolution);
+	m_invCellSize = vec3(m_resolution) / extent;
+
+	// count each cell's primitives, then place the lists end to end
+	size_t cells = size_t(m_resolution.x) * m_resolution.y * m_resolution.z;
+	unique_ptr<atomic<uint32_t>[]> cursor(new atomic<uint32_t>[cells]);
+	for (size_t i = 0; i < cells; i++)
+		cursor[i].store(0, memory_order_relaxed);
+
+	auto forEachCell = [this](const vec3& lower, const vec3& upper, uint32_t prim, atomic<uint32_t>* cursor,
+	                          uint32_t* prims) {
+		ivec3 from(CellOf(lower)), to(CellOf(upper));
+		for (int z = from.z; z <= to.z; z++)
+			for (int y = from.y; y <= to.y; y++)
+				for (int x = from.x; x <= to.x; x++) {
+					size_t cell = (size_t(z) * m_resolution.y + y) * m_resolution.x + x;
+					uint32_t slot = cursor[cell].fetch_add(1, memory_order_relaxed);
+					if (prims)
+						prims[slot] = prim;
+				}
+	};
+	parallelFor(threads, n, [&](size_t first, size_t last) {
+		for (size_t i = first; i < last; i++)
+			forEachCell(lower[i], upper[i], uint32_t(i), cursor.get(), 0);
+	});
+
+	m_cellStart.resize(cells + 1);
+	uint32_t total = 0;
+	for (size_t i = 0; i < cells; i++) {
+		m_cellStart[i] = total;
+		total += cursor[i].load(memory_order_relaxed);
+		cursor[i].store(m_cellStart[i], memory_order_relaxed);
+	}
+	m_cellStart[cells] = total;
+
+	m_cellPrims.resize(total);
+	parallelFor(threads, n, [&](size_t first, size_t last) {
+		for (size_t i = first; i < last; i++)
+			forEachCell(lower[i], upper[i], uint32_t(i), cursor.get(), m_cellPrims.data());
+	});
+
+	// threads fill a cell in no particular order; sorting each list makes
+	// the grid, and which of two equally near hits wins, the same every build
+	parallelFor(threads, cells, [&](size_t first, size_t last) {
+		for (size_t i = first; i < last; i++)
+			sort(m_cellPrims.begin() + m_cellStart[i], m_cellPrims.begin() + m_cellStart[i + 1]);
+	});
+}
+
+// --------------------------------------------------------------------------
+// Traversal
+
+template <typename Visit>
+void Grid::Walk(const vec3& o, const vec3& d, float tMax, Visit visit) const
+{
+	if (m_resolution.x == 0)
+		return;
+
+	// clip the ray to the grid's bounds
+	vec3 invD(1.f / d);
+	vec3 t0((m_lower - o) * invD);
+	vec3 t1((m_upper - o) * invD);
+	vec3 tmin(glm::min(t0, t1));
+	vec3 tmax(glm::max(t0, t1));
+	float tEnter = std::max(std::max(tmin.x, tmin.y), std::max(tmin.z, 0.f));
+	float tLeave = std::min(std::min(tmax.x, tmax.y), std::min(tmax.z, tMax));
+	if (tEnter > tLeave)
+		return;
+
+	// for each axis: the distance to the next cell boundary along it, the
+	// distance between boundaries, and the index just past the grid
+	ivec3 cell(CellOf(o + tEnter * d));
+	ivec3 step, out;
+	vec3 tNext, tDelta;
+	for (int a = 0; a < 3; a++) {
+		if (d[a] > 0) {
+			step[a] = 1;
+			out[a] = m_resolution[a];
+			tNext[a] = (m_lower[a] + (cell[a] + 1) * m_cellSize[a] - o[a]) * invD[a];
+			tDelta[a] = m_cellSize[a] * invD[a];
+		}
+		else if (d[a] < 0) {
+			step[a] = -1;
+			out[a] = -1;
+			tNext[a] = (m_lower[a] + cell[a] * m_cellSize[a] - o[a]) * invD[a];
+			tDelta[a] = -m_cellSize[a] * invD[a];
+		}
+		else {
+			step[a] = 0;
+			out[a] = -1;
+			tNext[a] = INFINITY;
+			tDelta[a] = INFINITY;
+		}
+	}
+
+	for (;;) {
+		int a = (tNext.x < tNext.y) ? (tNext.x < tNext.z ? 0 : 2) : (tNext.y < tNext.z ? 1 : 2);
+		size_t index = (size_t(cell.z) * m_resolution.y + cell.y) * m_resolution.x + cell.x;
+		const uint32_t* prims = m_cellPrims.data();
+		if (visit(prims + m_cellStart[index], prims + m_cellStart[index + 1], std::min(tNext[a], tLeave)))
+			return;
+
+		if (tNext[a] > tLeave)
+			return;
+		cell[a] += step[a];
+		if (cell[a] == out[a])
+			return;
+		tNext[a] += tDelta[a];
+	}
+}
+
+bool Grid::ClosestHit(const vec3& o, const vec3& d, SurfaceHit& hit, const BvhCut*)
+{
+	uint32_t mailbox[MAILBOX_SIZE];
+	fill(mailbox, mailbox + MAILBOX_SIZE, ~0u);
+	bool found = false;
+
+	// a hit lies in a cell its primitive is listed in, so once one is found
+	// no farther than the current cell's far side, no later cell can beat it
+	Walk(o, d, hit.dist, [&](const uint32_t* first, const uint32_t* last, float tExit) {
+		for (const uint32_t* p = first; p < last; p++) {
+			uint32_t& slot = mailbox[*p % MAILBOX_SIZE];
+			if (slot == *p)
+				continue;
+			slot = *p;
+			if (intersectPrimitive(*m_scene, *p, o, d, hit.dist)) {
+				hit.prim = *p;
+				found = true;
+			}
+		}
+		return found && hit.dist <= tExit;
+	});
+	return found;
+}
+
+void Grid::Cull(const Frustum&, BvhCut& cut)
+{
+	cut.count = 0;
+}
+
+bool Grid::Occluded(const vec3& o, const vec3& d, float maxDist)
+{
+	uint32_t mailbox[MAILBOX_SIZE];
+	fill(mailbox, mailbox + MAILBOX_SIZE, ~0u);
+	bool occluded = false;
+
+	Walk(o, d, maxDist, [&](const uint32_t* first, const uint32_t* last, float) {
+		for (const uint32_t* p = first; p < last && !occluded; p++) {
+			uint32_t& slot = mailbox[*p % MAILBOX_SIZE];
+			if (slot == *p)
+				continue;
+			slot = *p;
+			float dist = maxDist;
+			occluded = intersectPrimitive(*m_scene, *p, o, d, dist);
+		}
+		return occluded;
+	});
+	return occluded;
+}
@@ -0,0 +1,76 @@
+// ==========================================================================
+// Uniform Grid
+//
+// An alternative to the BVH for dense scenes of many small primitives of
+// similar size, such as particle dumps. The scene's bounds are cut into equal
+// cells, about CELLS_PER_PRIMITIVE of them for each primitive, and every cell
+// lists the primitives whose boxes overlap it. Building is a few linear
+// passes over the primitives, shared between threads, with none of the
+// sorting a hierarchy needs.
+//
+// Rays step from cell to cell in the order they pass through them with a
+// 3D-DDA (Amanatides and Woo), and stop at the first cell that holds a hit
+// no farther than its far side. A primitive listed in several cells is
+// tested only once per ray as long as it stays in a small mailbox.
+// ==========================================================================
+#ifndef GRID_H
+#define GRID_H
+
+#include <vector>
+#include <stdint.h>
+#include <glm/glm.hpp>
+#include "Scene.h"
+#include "Accelerator.h"
+
+// --------------------------------------------------------------------------
+
+class Grid : public Accelerator
+{
+	Scene*      m_scene;
+	glm::vec3   m_lower;
+	glm::vec3   m_upper;
+	glm::ivec3  m_resolution;       // cells along each axis, 0 if empty
+	glm::vec3   m_cellSize;
+	glm::vec3   m_invCellSize;
+
+	// the primitives of cell i are m_cellPrims[m_cellStart[i]] up to, but not
+	// including, m_cellPrims[m_cellStart[i+1]], in increasing order
+	std::vector<uint32_t> m_cellStart;
+	std::vector<uint32_t> m_cellPrims;
+
+	glm::ivec3 CellOf(const glm::vec3& p) const;
+
+	// calls visit(first, last, tExit) for the primitive list of each cell
+	// along o + t*d with t < tMax, nearest first, where tExit is the distance
+	// at which the ray leaves the cell, until visit returns true
+	template <typename Visit>
+	void Walk(const glm::vec3& o, const glm::vec3& d, float tMax, Visit visit) const;
+
+	Grid(const Grid&);
+	Grid& operator=(const Grid&);
+
+public:
+	static const float CELLS_PER_PRIMITIVE;
+	static const int MAX_RESOLUTION = 256;
+
+	Grid();
+
+	// bins scene's spheres and triangles into cells, on the given number of
+	// threads (one per core if 0); building again reuses the storage
+	void Build(Scene& scene, int threads = 0);
+
+	// the Accelerator queries; there is no hierarchy to cull, so cuts are
+	// left empty and ignored
+	bool ClosestHit(const glm::vec3& o, const glm::vec3& d, SurfaceHit& hit, const BvhCut* cut = 0) override;
+	void Cull(const Frustum& frustum, BvhCut& cut) override;
+	bool Occluded(const glm::vec3& o, const glm::vec3& d, float maxDist) override;
+
+	glm::ivec3 Resolution() const { return m_resolution; }
+
+	// entries in the cells' primitive lists, counting each primitive once for
+	// every cell it overlaps
+	size_t ReferenceCount() const { return m_cellPrims.size(); }
+};
+
+// --------------------------------------------------------------------------
+#endif // GRID_H
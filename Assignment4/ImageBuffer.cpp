@@ -20,6 +20,8 @@
 #include <iostream>
 #include <glm/common.hpp>
 #include <algorithm>
+#include <cstring>
+#include <thread>
 
 // --------------------------------------------------------------------------
 // Set these defines to choose which image library to use for saving image
@@ -50,12 +52,17 @@
 using namespace std;
 using namespace glm;
 
+// tile states: a flag for unsent changes, a flag for Render() copying the
+// tile, and above them the number of writers inside it
+enum { DIRTY = 1, READING = 2, WRITER = 4 };
+
 // --------------------------------------------------------------------------
 
 ImageBuffer::ImageBuffer()
-    : m_textureName(0), m_framebufferObject(0),
-      m_width(0), m_height(0), m_modified(false), destroyed(false)
+    : m_textureName(0), m_framebufferObject(0), m_nextPixelBuffer(0),
+      m_width(0), m_height(0), m_tilesX(0), m_tilesY(0), destroyed(false)
 {
+    m_pixelBuffers[0] = m_pixelBuffers[1] = 0;
 }
 
 ImageBuffer::~ImageBuffer()
@@ -66,16 +73,11 @@ ImageBuffer::~ImageBuffer()
             glDeleteFramebuffers(1, &m_framebufferObject);
         if (m_textureName)
             glDeleteTextures(1, &m_textureName);
+        if (m_pixelBuffers[0])
+            glDeleteBuffers(2, m_pixelBuffers);
     }
 }
 
-void ImageBuffer::ResetModified()
-{
-    m_modified = false;
-    m_modifiedLower = m_height;
-    m_modifiedUpper = 0;
-}
-
 // --------------------------------------------------------------------------
 
 bool ImageBuffer::Initialize()
@@ -103,7 +105,25 @@ bool ImageBuffer::Initialize()
     glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGB, m_width, m_height, 0, GL_RGB,
                  GL_FLOAT, &m_imageData[0]);
     glBindTexture(GL_TEXTURE_RECTANGLE, 0);
-    ResetModified();
+
+    // allocate a staging buffer big enough for the whole image, twice, so a
+    // frame can fill one while the driver may still be reading the other
+    if (!m_pixelBuffers[0])
+        glGenBuffers(2, m_pixelBuffers);
+    for (int i = 0; i < 2; ++i)
+    {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pixelBuffers[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, m_imageData.size() * sizeof(vec3), 0,
+                     GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    // the texture starts out matching the image, so every tile is clean
+    m_tilesX = (m_width + TILE_SIZE - 1) / TILE_SIZE;
+    m_tilesY = (m_height + TILE_SIZE - 1) / TILE_SIZE;
+    m_tileState.reset(new atomic<uint32_t>[m_tilesX * m_tilesY]);
+    for (int i = 0; i < m_tilesX * m_tilesY; ++i)
+        m_tileState[i].store(0, memory_order_relaxed);
 
     // allocate framebuffer object
     if (!m_framebufferObject)
@@ -129,6 +149,8 @@ bool ImageBuffer::Destroy()
             glDeleteFramebuffers(1, &m_framebufferObject);
         if (m_textureName)
             glDeleteTextures(1, &m_textureName);
+        if (m_pixelBuffers[0])
+            glDeleteBuffers(2, m_pixelBuffers);
         destroyed = true;
     }
     return destroyed;
@@ -138,36 +160,143 @@ bool ImageBuffer::Destroy()
 
 void ImageBuffer::SetPixel(int x, int y, vec3 colour)
 {
-    int index = y * m_width + x;
-    m_imageData[index] = colour;
+    CommitTile(x, y, 1, 1, &colour);
+}
+
+void ImageBuffer::CommitTile(int x, int y, int w, int h, const vec3 *data, int stride)
+{
+    if (stride == 0)
+        stride = w;
 
-    // mark that something was changed
-    m_modified = true;
-    m_modifiedLower = std::min(m_modifiedLower, y);
-    m_modifiedUpper = std::max(m_modifiedUpper, y+1);
+    // write the block a tile at a time, so that Render() can send the tiles
+    // already written while the rest are still being copied in
+    for (int ty = y / TILE_SIZE; ty * TILE_SIZE < y + h; ++ty)
+        for (int tx = x / TILE_SIZE; tx * TILE_SIZE < x + w; ++tx)
+        {
+            atomic<uint32_t>& state = m_tileState[ty * m_tilesX + tx];
+
+            // enter the tile, waiting if Render() is part way through copying it
+            uint32_t current = state.load(memory_order_relaxed);
+            for (;;)
+            {
+                if (current & READING)
+                {
+                    this_thread::yield();
+                    current = state.load(memory_order_relaxed);
+                }
+                else if (state.compare_exchange_weak(current, current + WRITER,
+                                                     memory_order_acquire,
+                                                     memory_order_relaxed))
+                    break;
+            }
+
+            int x0 = std::max(x, tx * TILE_SIZE);
+            int x1 = std::min(x + w, (tx + 1) * TILE_SIZE);
+            int y0 = std::max(y, ty * TILE_SIZE);
+            int y1 = std::min(y + h, (ty + 1) * TILE_SIZE);
+            for (int row = y0; row < y1; ++row)
+                memcpy(&m_imageData[row * m_width + x0],
+                       data + (row - y) * stride + (x0 - x),
+                       (x1 - x0) * sizeof(vec3));
+
+            state.fetch_or(DIRTY, memory_order_release);
+            state.fetch_sub(WRITER, memory_order_release);
+        }
 }
 
 // --------------------------------------------------------------------------
 
-void ImageBuffer::Render()
+// Takes a dirty tile for copying, unless a writer is still inside it, in
+// which case it stays dirty for the next frame.
+bool ImageBuffer::ClaimTile(int tile)
 {
-    if (!m_framebufferObject) return;
+    uint32_t current = DIRTY;
+    return m_tileState[tile].compare_exchange_strong(current, READING,
+                                                     memory_order_acquire,
+                                                     memory_order_relaxed);
+}
 
-    // check for modifications to the image data and update texture as needed
-    if (m_modified)
+// Copies the dirty tiles into a pixel buffer object laid out like the image,
+// then asks for each run of adjacent tiles along a tile row to be transferred
+// to the texture from there. The transfers are queued with the rest of the
+// frame's commands rather than waited for, and the next frame stages into
+// the other buffer, invalidating its old contents, so the CPU never waits on
+// an upload still in flight.
+void ImageBuffer::UploadDirtyTiles()
+{
+    int tileCount = m_tilesX * m_tilesY;
+    int first = 0;
+    while (first < tileCount && !(m_tileState[first].load(memory_order_relaxed) & DIRTY))
+        ++first;
+    if (first == tileCount)
+        return;
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pixelBuffers[m_nextPixelBuffer]);
+    m_nextPixelBuffer ^= 1;
+    vec3* staging = static_cast<vec3*>(glMapBufferRange(
+        GL_PIXEL_UNPACK_BUFFER, 0, m_imageData.size() * sizeof(vec3),
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+    if (!staging)
     {
-        int sizeY = m_modifiedUpper - m_modifiedLower;
-        int index = m_modifiedLower * m_width;
+        // leave the tiles dirty and try again next frame
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return;
+    }
 
-        // bind texture and copy only the rows that have been changed
-        glBindTexture(GL_TEXTURE_RECTANGLE, m_textureName);
-        glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, 0, m_modifiedLower, m_width,
-                        sizeY, GL_RGB, GL_FLOAT, &m_imageData[index]);
-        glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+    m_uploads.clear();
+    for (int ty = first / m_tilesX; ty < m_tilesY; ++ty)
+    {
+        bool extending = false;
+        for (int tx = 0; tx < m_tilesX; ++tx)
+        {
+            int tile = ty * m_tilesX + tx;
+            if (!ClaimTile(tile))
+            {
+                extending = false;
+                continue;
+            }
+
+            int x0 = tx * TILE_SIZE, x1 = std::min(x0 + TILE_SIZE, m_width);
+            int y0 = ty * TILE_SIZE, y1 = std::min(y0 + TILE_SIZE, m_height);
+            for (int row = y0; row < y1; ++row)
+                memcpy(staging + row * m_width + x0, &m_imageData[row * m_width + x0],
+                       (x1 - x0) * sizeof(vec3));
+            m_tileState[tile].fetch_and(~uint32_t(READING), memory_order_release);
+
+            if (extending)
+                m_uploads.back().width += x1 - x0;
+            else
+            {
+                Upload upload = { x0, y0, x1 - x0, y1 - y0 };
+                m_uploads.push_back(upload);
+                extending = true;
+            }
+        }
+    }
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
 
-        // mark that we've updated the texture
-        ResetModified();
+    // with a pixel buffer bound, the data pointer is an offset into it
+    glBindTexture(GL_TEXTURE_RECTANGLE, m_textureName);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, m_width);
+    for (size_t i = 0; i < m_uploads.size(); ++i)
+    {
+        const Upload& upload = m_uploads[i];
+        size_t offset = (size_t(upload.y) * m_width + upload.x) * sizeof(vec3);
+        glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, upload.x, upload.y, upload.width,
+                        upload.height, GL_RGB, GL_FLOAT,
+                        reinterpret_cast<const void*>(offset));
     }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+void ImageBuffer::Render()
+{
+    if (!m_framebufferObject) return;
+
+    // send the tiles changed since the last frame on their way to the texture
+    UploadDirtyTiles();
 
     // bind the framebuffer object with our texture in it and copy to screen
     glBindFramebuffer(GL_READ_FRAMEBUFFER, m_framebufferObject);
@@ -13,8 +13,11 @@
 #ifndef IMAGEBUFFER_H
 #define IMAGEBUFFER_H
 
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <string>
+#include <stdint.h>
 #include <glm/vec3.hpp>
 
 // Specify that we want the OpenGL core profile before including GLFW headers
@@ -30,6 +33,12 @@
 // This class encapsulates functionality for setting pixel colours in an
 // image memory buffer, copying the buffer into an OpenGL window for display,
 // and saving the buffer to disk as an image file.
+//
+// The image is divided into TILE_SIZE x TILE_SIZE tiles, each with its own
+// dirty flag, so that many threads may write disjoint regions at once while
+// the OpenGL thread displays them. Render() gathers the tiles written since
+// the last frame into a pixel buffer object and has the driver copy them to
+// the texture from there, so neither side waits for the transfer.
 
 class ImageBuffer
 {
@@ -37,15 +46,24 @@ class ImageBuffer
     GLuint  m_textureName;
     GLuint  m_framebufferObject;
 
+    // pixel buffer objects that stage uploads, used alternately
+    GLuint  m_pixelBuffers[2];
+    int     m_nextPixelBuffer;
+
     // dimensions of our image, and the pixel colour data array
     int     m_width, m_height;
     std::vector<glm::vec3> m_imageData;
 
-    // state variables to keep track of modified region
-    bool    m_modified;
-    int     m_modifiedLower, m_modifiedUpper;
+    // state of each tile: DIRTY, READING, and the count of writers inside
+    int     m_tilesX, m_tilesY;
+    std::unique_ptr<std::atomic<uint32_t>[]> m_tileState;
+
+    // tiles gathered by the current Render(), as runs along each tile row
+    struct Upload { int x, y, width, height; };
+    std::vector<Upload> m_uploads;
 
-    void ResetModified();
+    bool ClaimTile(int tile);
+    void UploadDirtyTiles();
     bool destroyed;
 
 public:
@@ -61,15 +79,25 @@ public:
     bool Initialize();
     bool Destroy();
 
+    static const int TILE_SIZE = 32;
+
     // set a pixel in this image buffer to a specified colour:
     //  - (0,0) is the bottom-left pixel of the image
     //  - colour is RGB given as floating point numbers in the range [0,1]
     void SetPixel(int x, int y, glm::vec3 colour);
 
-    // call this in your render function to copy this image onto your screen
+    // Sets the w x h block whose bottom-left pixel is (x, y) from data, whose
+    // rows are stride colours apart (w if 0). Safe to call from any thread,
+    // provided no two threads write the same pixels at once; a writer only
+    // ever waits for Render() to finish copying a tile it overlaps.
+    void CommitTile(int x, int y, int w, int h, const glm::vec3 *data, int stride = 0);
+
+    // call this in your render function to copy this image onto your screen;
+    // only from the thread owning the OpenGL context
     void Render();
 
-    // call this at the end of your render to save the image to file
+    // call this at the end of your render to save the image to file, once
+    // nothing is writing to it any more
     bool SaveToFile(const std::string &imageFileName);
 };
 
@@ -0,0 +1,45 @@
+// ==========================================================================
+// Parallel Loops
+//
+// The builders' passes over every primitive are shared between threads by
+// splitting the primitives into one contiguous range per thread. A thread
+// can keep partial results of its own, found from the start of its range,
+// and merge them after the loop.
+// ==========================================================================
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// --------------------------------------------------------------------------
+
+// the number of threads to build on when asked for threads, one per core if 0
+inline int buildThreads(int threads)
+{
+	return threads > 0 ? threads : std::max(1, int(std::thread::hardware_concurrency()));
+}
+
+// the length of each thread's range when count items are shared between them
+inline size_t parallelChunk(int threads, size_t count)
+{
+	return (count + threads - 1) / threads;
+}
+
+// runs body(first, last) over count items split into contiguous ranges, one
+// per thread, with the calling thread taking the last
+template <typename Body>
+void parallelFor(int threads, size_t count, Body body)
+{
+	size_t chunk = parallelChunk(threads, count);
+	std::vector<std::thread> helpers;
+	for (int i = 0; i + 1 < threads && (i + 1) * chunk < count; i++)
+		helpers.push_back(std::thread(body, i * chunk, (i + 1) * chunk));
+	body(helpers.size() * chunk, count);
+	for (std::thread& helper : helpers)
+		helper.join();
+}
+
+// --------------------------------------------------------------------------
+#endif // PARALLEL_H
@@ -0,0 +1,329 @@
+// ==========================================================================
+// Monte Carlo Path Tracing
+// ==========================================================================
+
+#include "PathTracer.h"
+#include "Render.h"
+#include "FastMath.h"
+
+#include <math.h>
+#include <algorithm>
+#include <glm/gtc/constants.hpp>
+
+using namespace glm;
+using namespace std;
+
+// bounces followed before a path is cut off, and the bounce from which paths
+// are ended at random in proportion to how little they can still add
+static const int MAX_BOUNCES = 12;
+static const int ROULETTE_DEPTH = 3;
+
+// the exponent of the glossy lobe, that of the Whitted highlight, and the
+// glossy lobe's share of what the mirror does not reflect
+static const unsigned PHONG_EXPONENT = 256;
+static const float GLOSSY_SHARE = 0.2f;
+
+// The radiance of a uniform sky around the scene. A white Lambertian surface
+// open to it reflects as much as the ray tracer's ambient term, which it
+// stands in for; seen directly, it stays black as the ray tracer's is.
+static const float SKY = 0.2f;
+
+// --------------------------------------------------------------------------
+// The light
+
+float pathLightIntensity(const Scene& scene)
+{
+	uint32_t n = boundedPrimitiveCount(scene);
+	if (n == 0)
+		return 1.f;
+
+	vec3 lower(INFINITY), upper(-INFINITY);
+	for (uint32_t i = 0; i < n; i++) {
+		vec3 primLower, primUpper;
+		primitiveBounds(scene, i, primLower, primUpper);
+		lower = glm::min(lower, primLower);
+		upper = glm::max(upper, primUpper);
+	}
+
+	// a white Lambertian surface facing a point light I away at distance D
+	// reflects I / (pi D^2), where Whitted shading gives 1
+	vec3 toCentre(0.5f*(lower + upper) - scene.light.p);
+	return pi<float>() * std::max(dot(toCentre, toCentre), 1e-4f);
+}
+
+// the radiance leaving an area light of the given intensity, the same over
+// its surface and in every direction; rectangles shine from both faces
+static float lightRadiance(const Light& light, float intensity)
+{
+	if (light.shape == SPHERE_LIGHT)
+		return intensity / (pi<float>() * light.radius * light.radius);
+	if (light.shape == RECT_LIGHT)
+		return intensity / length(cross(light.u, light.v));
+	return 0.f;
+}
+
+// e1 and e2 complete an orthonormal basis with the unit vector w
+static void basis(const vec3& w, vec3& e1, vec3& e2)
+{
+	e1 = normalize(cross(fabs(w.x) > 0.9f ? vec3(0, 1, 0) : vec3(1, 0, 0), w));
+	e2 = cross(w, e1);
+}
+
+// Picks a point on the light as seen from x, by (s, t) uniform in the unit
+// square, and the density of the direction to it in solid angle. A point
+// light gives density 0, as it can only be reached this way. Returns false
+// if there is nothing to see from x.
+static bool sampleLight(const Light& light, const vec3& x, float s, float t, vec3& point, float& pdf)
+{
+	if (light.shape == POINT_LIGHT) {
+		point = light.p;
+		pdf = 0;
+		return true;
+	}
+
+	if (light.shape == RECT_LIGHT) {
+		point = light.p + (s - 0.5f)*light.u + (t - 0.5f)*light.v;
+		// the area is |n|, and the light's cosine toward x is |n.w| / (|n| |w|)
+		vec3 n(cross(light.u, light.v));
+		vec3 w(point - x);
+		float projected = fabs(dot(n, w));
+		if (projected <= 0)
+			return false;
+		float dist2 = dot(w, w);
+		pdf = dist2 * sqrt(dist2) / projected;
+		return true;
+	}
+
+	// directions in the cone the sphere fills, uniformly, then the near side
+	// of the sphere along the one chosen
+	vec3 w(light.p - x);
+	float dist2 = dot(w, w);
+	float r2 = light.radius * light.radius;
+	if (dist2 <= r2)
+		return false;
+	float cosMax = sqrt(1 - r2 / dist2);
+	float cosTheta = 1 - s*(1 - cosMax);
+	float sinTheta = sqrt(std::max(0.f, 1 - cosTheta*cosTheta));
+	float phi = two_pi<float>() * t;
+
+	vec3 e1, e2;
+	w /= sqrt(dist2);
+	basis(w, e1, e2);
+	vec3 d(cosTheta*w + sinTheta*(cos(phi)*e1 + sin(phi)*e2));
+	float along = dot(d, light.p - x);
+	point = x + (along - sqrt(std::max(0.f, r2 - (dist2 - along*along))))*d;
+	pdf = 1 / (two_pi<float>() * (1 - cosMax));
+	return true;
+}
+
+// the density with which sampleLight() picks the direction d from x to a
+// point dist away on the light
+static float lightPdf(const Light& light, const vec3& x, const vec3& d, float dist)
+{
+	if (light.shape == RECT_LIGHT) {
+		vec3 n(cross(light.u, light.v));
+		return dist * dist / std::max(fabs(dot(n, d)), 1e-12f);
+	}
+	vec3 w(light.p - x);
+	float cosMax = sqrt(std::max(0.f, 1 - light.radius * light.radius / dot(w, w)));
+	return 1 / (two_pi<float>() * (1 - cosMax));
+}
+
+// the distance along o + t*d to an area light, if the ray meets one
+static bool hitLight(const Light& light, const vec3& o, const vec3& d, float& t)
+{
+	if (light.shape == SPHERE_LIGHT) {
+		Sphere sp = {light.p, light.radius};
+		return intersectSphere(sp, o, d, t);
+	}
+	if (light.shape != RECT_LIGHT)
+		return false;
+
+	vec3 n(cross(light.u, light.v));
+	float facing = dot(d, n);
+	if (facing == 0)
+		return false;
+	t = dot(light.p - o, n) / facing;
+	if (t <= 1e-4f)
+		return false;
+
+	// coordinates of the hit in the light's edges, which need not be square
+	vec3 q(o + t*d - light.p);
+	float uu = dot(light.u, light.u), uv = dot(light.u, light.v), vv = dot(light.v, light.v);
+	float qu = dot(q, light.u), qv = dot(q, light.v);
+	float det = uu*vv - uv*uv;
+	float a = (qu*vv - qv*uv) / det;
+	float b = (qv*uu - qu*uv) / det;
+	return fabs(a) <= 0.5f && fabs(b) <= 0.5f;
+}
+
+static float powerHeuristic(float pdf, float otherPdf)
+{
+	return pdf*pdf / (pdf*pdf + otherPdf*otherPdf);
+}
+
+// --------------------------------------------------------------------------
+// Materials
+
+struct PathVertex {
+	vec3 p;
+	vec3 n;             // unit length, facing where the path came from
+	vec3 reflected;     // the mirror direction of the arriving path
+	vec3 colour;
+	float mirror;       // the share reflected by the mirror
+};
+
+// The Lambertian and glossy lobes for light arriving from direction wi, and
+// the density with which sampleMaterial() picks wi. The mirror is left out,
+// as no other direction than its own could ever be picked for it.
+static vec3 evalMaterial(const PathVertex& v, const vec3& wi, float& pdf)
+{
+	float cosN = dot(v.n, wi);
+	if (cosN <= 0 || v.mirror >= 1) {
+		pdf = 0;
+		return vec3(0);
+	}
+	float cosR = std::max(dot(v.reflected, wi), 0.f);
+	float lobe = specularPower(cosR, PHONG_EXPONENT);
+	float diffuse = (1 - v.mirror) * (1 - GLOSSY_SHARE);
+	float glossy = (1 - v.mirror) * GLOSSY_SHARE;
+	pdf = diffuse * cosN * one_over_pi<float>() + glossy * (PHONG_EXPONENT + 1) * lobe / two_pi<float>();
+	return v.colour * (diffuse * one_over_pi<float>() + glossy * (PHONG_EXPONENT + 2) * lobe / two_pi<float>());
+}
+
+// Chooses a lobe with choice, in proportion to what it reflects, and a
+// direction from it with (s, t). Returns the density of the direction for
+// the two lobes evalMaterial() knows, or 0 for the mirror.
+static vec3 sampleMaterial(const PathVertex& v, float choice, float s, float t, float& pdf)
+{
+	if (choice < v.mirror) {
+		pdf = 0;
+		return v.reflected;
+	}
+	choice = (choice - v.mirror) / (1 - v.mirror);
+
+	// a cosine-weighted direction about the normal, or a Phong-weighted one
+	// about the mirror direction
+	vec3 axis(choice < GLOSSY_SHARE ? v.reflected : v.n);
+	float cosTheta = choice < GLOSSY_SHARE ? pow(s, 1.f / (PHONG_EXPONENT + 1)) : sqrt(1 - s);
+	float sinTheta = sqrt(std::max(0.f, 1 - cosTheta*cosTheta));
+	float phi = two_pi<float>() * t;
+	vec3 e1, e2;
+	basis(axis, e1, e2);
+	vec3 wi(cosTheta*axis + sinTheta*(cos(phi)*e1 + sin(phi)*e2));
+	evalMaterial(v, wi, pdf);
+	return wi;
+}
+
+// --------------------------------------------------------------------------
+// Paths
+
+// Each bounce takes the same four dimensions from the sampler, whether it
+// uses them or not, so that a dimension has the same meaning in every
+// sample and is stratified across them.
+template <int PROFILING>
+vec3 tracePath(Scene& scene, Accelerator& accel, const vec3& o, const vec3& d, float lightIntensity,
+               PixelSampler& sampler, const BvhCut* cut)
+{
+	const Light& light = scene.light;
+	vec3 emitted(lightRadiance(light, lightIntensity));
+
+	vec3 radiance(0), throughput(1);
+	vec3 origin(o), dir(normalize(d));
+	float materialPdf = 0;      // how the path chose dir, or 0 from the camera or a mirror
+
+	for (int bounce = 0; ; bounce++) {
+		SurfaceHit hit;
+		bool found;
+		{
+			PhaseTimer<PROFILING> timer(bounce == 0 ? PHASE_PRIMARY : PHASE_SECONDARY);
+			countEvent<PROFILING>(bounce == 0 ? COUNT_PRIMARY_RAYS : COUNT_SECONDARY_RAYS);
+			found = closestHit(scene, accel, origin, dir, hit, bounce == 0 ? cut : 0);
+		}
+
+		// an area light in front of everything else; where the light was also
+		// sampled directly from the last surface, the two estimates share it
+		float tLight;
+		if (hitLight(light, origin, dir, tLight) && (!found || tLight < hit.dist)) {
+			float weight = materialPdf > 0 ? powerHeuristic(materialPdf, lightPdf(light, origin, dir, tLight)) : 1.f;
+			radiance += throughput * emitted * weight;
+			break;
+		}
+		if (!found) {
+			if (bounce > 0)
+				radiance += throughput * SKY;
+			break;
+		}
+		if (bounce == MAX_BOUNCES)
+			break;
+
+		PathVertex v;
+		v.p = hit.p;
+		v.n = normalize(hit.n);
+		if (dot(v.n, dir) > 0)
+			v.n = -v.n;
+		v.reflected = reflect(dir, v.n);
+		v.colour = hit.colour;
+		v.mirror = hit.reflectivity;
+
+		// next-event estimation
+		vec2 lightSample(sampler.Get2D());
+		{
+			PhaseTimer<PROFILING> timer(PHASE_SHADOWS);
+			vec3 point;
+			float pdf;
+			if (sampleLight(light, v.p, lightSample.x, lightSample.y, point, pdf)) {
+				vec3 wi(point - v.p);
+				float dist2 = dot(wi, wi);
+				wi /= sqrt(dist2);
+				float pdfMaterial;
+				vec3 f(evalMaterial(v, wi, pdfMaterial));
+				if (pdfMaterial > 0) {
+					countEvent<PROFILING>(COUNT_SHADOW_RAYS);
+					if (!occluded(scene, accel, v.p, point)) {
+						float cosN = dot(v.n, wi);
+						if (pdf == 0)
+							radiance += throughput * f * cosN * lightIntensity / dist2;
+						else
+							radiance += throughput * f * cosN * emitted * powerHeuristic(pdf, pdfMaterial) / pdf;
+					}
+				}
+			}
+		}
+
+		// the next direction, from the material
+		float choice = sampler.Get1D();
+		vec2 direction(sampler.Get2D());
+		{
+			PhaseTimer<PROFILING> timer(PHASE_SHADING);
+			float pdf;
+			vec3 wi(sampleMaterial(v, choice, direction.x, direction.y, pdf));
+			if (choice >= v.mirror) {
+				if (pdf <= 0)
+					break;
+				float unused;
+				throughput *= evalMaterial(v, wi, unused) * dot(v.n, wi) / pdf;
+			}
+			origin = v.p;
+			dir = wi;
+			materialPdf = pdf;
+		}
+
+		// Russian roulette
+		float survival = sampler.Get1D();
+		if (bounce + 1 >= ROULETTE_DEPTH) {
+			float keep = std::min(0.95f, std::max(throughput.x, std::max(throughput.y, throughput.z)));
+			if (survival >= keep)
+				break;
+			throughput /= keep;
+		}
+	}
+	return radiance;
+}
+
+template vec3 tracePath<PROFILE_NONE>(Scene& scene, Accelerator& accel, const vec3& o, const vec3& d,
+                                      float lightIntensity, PixelSampler& sampler, const BvhCut* cut);
+template vec3 tracePath<PROFILE_COUNTS>(Scene& scene, Accelerator& accel, const vec3& o, const vec3& d,
+                                        float lightIntensity, PixelSampler& sampler, const BvhCut* cut);
+template vec3 tracePath<PROFILE_TIMES>(Scene& scene, Accelerator& accel, const vec3& o, const vec3& d,
+                                       float lightIntensity, PixelSampler& sampler, const BvhCut* cut);
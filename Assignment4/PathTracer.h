@@ -0,0 +1,46 @@
+// ==========================================================================
+// Monte Carlo Path Tracing
+//
+// A physically based alternative to the Whitted-style traceRay(): paths
+// bounce diffusely as well as off mirrors, so surfaces are lit by each other
+// and not only by the light. A pixel's colour is the average of many paths
+// through it.
+//
+// Materials are read as a mix of three lobes: a perfect mirror, weighted by
+// the material's reflectivity, and for the rest a Lambertian lobe and a
+// normalised Phong lobe with the exponent of the Whitted highlight, both
+// tinted by the material's colour. At every bounce the light is sampled
+// directly (next-event estimation) and a new direction is sampled from the
+// material. Area lights can be reached both ways, so the two estimates are
+// combined with multiple importance sampling by the power heuristic; the
+// mirror and point lights can each only be reached one way, and are not.
+// A dim, uniform sky takes the place of the ray tracer's ambient light.
+// ==========================================================================
+#ifndef PATHTRACER_H
+#define PATHTRACER_H
+
+#include <glm/glm.hpp>
+#include "Scene.h"
+#include "Accelerator.h"
+#include "Profile.h"
+#include "Sampler.h"
+
+// --------------------------------------------------------------------------
+
+// The light's radiant intensity for path tracing. Scenes are set up for
+// Whitted shading, whose light does not fall off with distance, so the
+// intensity is chosen to light surfaces at the centre of the scene about as
+// brightly as the Whitted renderer does.
+float pathLightIntensity(const Scene& scene);
+
+// Returns the radiance arriving at o from direction -d, where accel has been
+// built over scene and the light has the given intensity, taking the path's
+// numbers from sampler, past any it has handed out already. If cut is given,
+// the first ray lies in the frustum it was culled to. PROFILING is as for
+// traceRay().
+template <int PROFILING = PROFILE_NONE>
+glm::vec3 tracePath(Scene& scene, Accelerator& accel, const glm::vec3& o, const glm::vec3& d,
+                    float lightIntensity, PixelSampler& sampler, const BvhCut* cut = 0);
+
+// --------------------------------------------------------------------------
+#endif // PATHTRACER_H
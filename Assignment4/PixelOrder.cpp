@@ -0,0 +1,93 @@
+// ==========================================================================
+// Pixel Traversal Orders
+// ==========================================================================
+
+#include "PixelOrder.h"
+
+#include <algorithm>
+
+using namespace std;
+
+static const char* const ORDER_NAMES[PIXEL_ORDER_COUNT] = { "scanline", "morton", "hilbert" };
+
+const char* pixelOrderName(PixelOrder order)
+{
+	return ORDER_NAMES[order];
+}
+
+bool parsePixelOrder(const string& name, PixelOrder& order)
+{
+	for (int i = 0; i < PIXEL_ORDER_COUNT; i++)
+		if (name == ORDER_NAMES[i]) {
+			order = PixelOrder(i);
+			return true;
+		}
+	return false;
+}
+
+// --------------------------------------------------------------------------
+// Curves over a power-of-two square
+
+// every other bit of v, packed together
+static int compactBits(unsigned v)
+{
+	v &= 0x55555555;
+	v = (v | (v >> 1)) & 0x33333333;
+	v = (v | (v >> 2)) & 0x0f0f0f0f;
+	v = (v | (v >> 4)) & 0x00ff00ff;
+	v = (v | (v >> 8)) & 0x0000ffff;
+	return int(v);
+}
+
+static GridPoint mortonPoint(unsigned d)
+{
+	GridPoint point = { compactBits(d), compactBits(d >> 1) };
+	return point;
+}
+
+// the d'th cell along the Hilbert curve through an n x n square
+static GridPoint hilbertPoint(int n, unsigned d)
+{
+	GridPoint point = { 0, 0 };
+	for (int s = 1; s < n; s *= 2, d /= 4) {
+		int rx = 1 & (d / 2);
+		int ry = 1 & (d ^ rx);
+		// rotate the quadrant so the sub-curve joins its neighbours
+		if (ry == 0) {
+			if (rx == 1) {
+				point.x = s - 1 - point.x;
+				point.y = s - 1 - point.y;
+			}
+			swap(point.x, point.y);
+		}
+		point.x += s * rx;
+		point.y += s * ry;
+	}
+	return point;
+}
+
+// --------------------------------------------------------------------------
+
+// Grids that are not power-of-two squares follow the curve through the
+// smallest square that covers them, skipping the cells outside.
+void gridOrder(PixelOrder order, int width, int height, vector<GridPoint>& points)
+{
+	points.clear();
+	if (order == SCANLINE_ORDER) {
+		for (int y = 0; y < height; y++)
+			for (int x = 0; x < width; x++) {
+				GridPoint point = { x, y };
+				points.push_back(point);
+			}
+		return;
+	}
+
+	int n = 1;
+	while (n < width || n < height)
+		n *= 2;
+	for (unsigned d = 0; d < unsigned(n) * n; d++) {
+		GridPoint point = (order == MORTON_ORDER) ? mortonPoint(d) : hilbertPoint(n, d);
+		if (point.x < width && point.y < height)
+			points.push_back(point);
+	}
+}
@@ -0,0 +1,44 @@
+// ==========================================================================
+// Pixel Traversal Orders
+//
+// The renderer visits the tiles of the image, and the samples within each
+// tile, along a space-filling curve rather than row by row. Successive rays
+// then stay close together on screen, so they pass through the same BVH
+// nodes and primitives and find them still in cache, and the tiles claimed
+// at the same moment by different threads cover neighbouring parts of the
+// scene. A Hilbert curve never jumps between cells that are not adjacent;
+// a Morton (Z-order) curve is cheaper to compute but jumps at the boundary
+// of every power-of-two block.
+// ==========================================================================
+#ifndef PIXELORDER_H
+#define PIXELORDER_H
+
+#include <string>
+#include <vector>
+
+// --------------------------------------------------------------------------
+
+enum PixelOrder
+{
+	SCANLINE_ORDER,     // row by row, bottom to top
+	MORTON_ORDER,
+	HILBERT_ORDER,
+	PIXEL_ORDER_COUNT
+};
+
+struct GridPoint
+{
+	int x, y;
+};
+
+// name of an order as given on the command line
+const char* pixelOrderName(PixelOrder order);
+
+// sets order to the one called name, returning false if there is none
+bool parsePixelOrder(const std::string& name, PixelOrder& order);
+
+// fills points with every cell of a width x height grid, in the given order
+void gridOrder(PixelOrder order, int width, int height, std::vector<GridPoint>& points);
+
+// --------------------------------------------------------------------------
+#endif // PIXELORDER_H
@@ -0,0 +1,174 @@
+// ==========================================================================
+// Render Profiling
+// ==========================================================================
+
+#include "Profile.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+
+const char* profilePhaseName(ProfilePhase phase)
+{
+	static const char* names[PHASE_COUNT] = { "primary hits", "reflected hits", "shadow rays", "shading" };
+	return names[phase];
+}
+
+const char* profileCounterName(ProfileCounter counter)
+{
+	static const char* names[COUNTER_COUNT] = { "primary rays", "relit pixels", "reflected rays", "shadow rays" };
+	return names[counter];
+}
+
+void ThreadProfile::Clear()
+{
+	for (int i = 0; i < PHASE_COUNT; i++)
+		phases[i] = 0;
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		counts[i] = 0;
+	samples = timedSamples = 0;
+	tiles.clear();
+}
+
+// --------------------------------------------------------------------------
+
+Profiler::Profiler()
+	: m_startTicks(0), m_endTicks(0)
+{
+}
+
+void Profiler::Clear()
+{
+	lock_guard<mutex> lock(m_lock);
+	m_threads.clear();
+}
+
+ThreadProfile* Profiler::AddThread()
+{
+	lock_guard<mutex> lock(m_lock);
+	m_threads.push_back(unique_ptr<ThreadProfile>(new ThreadProfile));
+	return m_threads.back().get();
+}
+
+void Profiler::Begin()
+{
+	lock_guard<mutex> lock(m_lock);
+	for (auto& thread : m_threads)
+		thread->Clear();
+	m_startTime = m_endTime = chrono::steady_clock::now();
+	m_startTicks = m_endTicks = profileClock();
+}
+
+void Profiler::End()
+{
+	m_endTime = chrono::steady_clock::now();
+	m_endTicks = profileClock();
+}
+
+double Profiler::TicksPerSecond() const
+{
+#ifdef PROFILE_TSC
+	double seconds = chrono::duration<double>(m_endTime - m_startTime).count();
+	return seconds > 0 ? (m_endTicks - m_startTicks) / seconds : 1e9;
+#else
+	return 1e9;
+#endif
+}
+
+// --------------------------------------------------------------------------
+// Output
+
+void Profiler::PrintSummary(ostream& out) const
+{
+	double toMs = 1000.0 / TicksPerSecond();
+	double wall = (m_endTicks - m_startTicks) * toMs;
+
+	// each thread's phase times are scaled up from the samples it timed
+	double phases[PHASE_COUNT] = {};
+	uint64_t counts[COUNTER_COUNT] = {};
+	uint64_t busy = 0;
+	for (auto& thread : m_threads) {
+		double scale = thread->timedSamples ? double(thread->samples) / thread->timedSamples : 0.0;
+		for (int i = 0; i < PHASE_COUNT; i++)
+			phases[i] += thread->phases[i] * scale;
+		for (int i = 0; i < COUNTER_COUNT; i++)
+			counts[i] += thread->counts[i];
+		for (const TileEvent& tile : thread->tiles)
+			busy += tile.end - tile.start;
+	}
+
+	ios::fmtflags flags(out.flags());
+	streamsize precision(out.precision());
+	out << fixed << setprecision(1);
+	out << "Render profile: " << wall << " ms, " << m_threads.size() << " threads busy for "
+	    << busy * toMs << " ms in all" << endl;
+
+	// the phases as shares of the time the workers spent on tiles
+	double timed = 0;
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		timed += phases[i];
+		out << "  " << setw(16) << left << profilePhaseName(ProfilePhase(i)) << right << setw(10)
+		    << phases[i] * toMs << " ms " << setw(5) << (busy ? 100.0 * phases[i] / busy : 0.0) << "%" << endl;
+	}
+	double other = std::max(busy - timed, 0.0);
+	out << "  " << setw(16) << left << "other" << right << setw(10) << other * toMs << " ms "
+	    << setw(5) << (busy ? 100.0 * other / busy : 0.0) << "%" << endl;
+
+	out << " ";
+	for (int i = 0; i < COUNTER_COUNT; i++)
+		out << " " << counts[i] << " " << profileCounterName(ProfileCounter(i)) << (i + 1 < COUNTER_COUNT ? "," : "");
+	out << endl;
+
+	for (size_t t = 0; t < m_threads.size(); t++) {
+		uint64_t threadBusy = 0;
+		for (const TileEvent& tile : m_threads[t]->tiles)
+			threadBusy += tile.end - tile.start;
+		out << "  worker " << t << ": " << m_threads[t]->tiles.size() << " tiles, "
+		    << threadBusy * toMs << " ms busy" << endl;
+	}
+	out.flags(flags);
+	out.precision(precision);
+}
+
+// Tiles become complete ("X") events on their worker's track, with what was
+// spent on them as arguments, the phase times estimated from the tile's
+// timed samples; the whole render is one more event on a track of its own.
+bool Profiler::WriteTrace(const string& filename) const
+{
+	ofstream out(filename.c_str());
+	if (!out)
+		return false;
+
+	double toUs = 1e6 / TicksPerSecond();
+	out << fixed << setprecision(3);
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"render\"}}";
+	out << ",\n{\"name\":\"render\",\"cat\":\"render\",\"ph\":\"X\",\"pid\":1,\"tid\":0,\"ts\":0,\"dur\":"
+	    << (m_endTicks - m_startTicks) * toUs << "}";
+
+	for (size_t t = 0; t < m_threads.size(); t++) {
+		int tid = int(t) + 1;
+		out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+		    << ",\"args\":{\"name\":\"worker " << t << "\"}}";
+		for (const TileEvent& tile : m_threads[t]->tiles) {
+			out << ",\n{\"name\":\"tile " << tile.tile << "\",\"cat\":\"pass " << tile.pass
+			    << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+			    << ",\"ts\":" << (tile.start - m_startTicks) * toUs
+			    << ",\"dur\":" << (tile.end - tile.start) * toUs << ",\"args\":{\"pass\":" << tile.pass;
+			for (int i = 0; i < PHASE_COUNT; i++)
+				out << ",\"" << profilePhaseName(ProfilePhase(i)) << " (us)\":"
+				    << tile.phases[i] * PROFILE_TIMING_INTERVAL * toUs;
+			for (int i = 0; i < COUNTER_COUNT; i++)
+				out << ",\"" << profileCounterName(ProfileCounter(i)) << "\":" << tile.counts[i];
+			if (tile.cancelled)
+				out << ",\"cancelled\":true";
+			out << "}}";
+		}
+	}
+	out << "\n]}\n";
+	return bool(out);
+}
@@ -0,0 +1,1017 @@
+// ==========================================================================
+// Ray Tracing Renderer
+//
+// Phong shading with hard or soft shadows and mirror reflection, traced
+// through a pinhole camera and written to the image progressively.
+// ==========================================================================
+
+#include "Render.h"
+#include "ClusterPager.h"
+#include "FastMath.h"
+#include "PathTracer.h"
+
+#include <math.h>
+#include <algorithm>
+
+using namespace glm;
+using namespace std;
+
+// ambient light level, also the brightness of surfaces in shadow
+static const float AMBIENT = 0.2f;
+
+// number of mirror bounces followed before giving up
+static const int MAX_DEPTH = 3;
+
+// Rec. 709 weights of each channel's contribution to brightness
+static const vec3 LUMINANCE(0.2126f, 0.7152f, 0.0722f);
+
+// --------------------------------------------------------------------------
+
+vec3 Camera::Forward() const
+{
+	return vec3(sin(yaw)*cos(pitch), sin(pitch), -cos(yaw)*cos(pitch));
+}
+
+vec3 Camera::Right() const
+{
+	return normalize(cross(Forward(), vec3(0, 1, 0)));
+}
+
+vec3 Camera::Up() const
+{
+	return cross(Right(), Forward());
+}
+
+vec3 Camera::RayDirection(float x, float y, int width, int height) const
+{
+	float px = -1*(width/2.f - 0.5f)+x;
+	float py = -1*(height/2.f - 0.5f)+y;
+	return px*Right() + py*Up() + focal*Forward();
+}
+
+Frustum Camera::Bundle(float x0, float y0, float x1, float y1, int width, int height) const
+{
+	vec3 corner[4] = {
+		RayDirection(x0, y0, width, height), RayDirection(x1, y0, width, height),
+		RayDirection(x1, y1, width, height), RayDirection(x0, y1, width, height)
+	};
+	vec3 centre(RayDirection(0.5f*(x0 + x1), 0.5f*(y0 + y1), width, height));
+
+	Frustum frustum;
+	frustum.apex = eye;
+	for (int i = 0; i < 4; i++) {
+		vec3 n(cross(corner[i], corner[(i + 1) % 4]));
+		frustum.normal[i] = dot(n, centre) < 0 ? -n : n;
+	}
+	return frustum;
+}
+
+// --------------------------------------------------------------------------
+// Ray tracing
+
+// the power the highlight's cosine is raised to
+static const unsigned SPECULAR_EXPONENT = 256;
+
+void shading(vec3& colour, vec3& n, Light& lightpoint, vec3& intersect, vec3& d) {
+	const unsigned p = SPECULAR_EXPONENT;
+	float cl = 1;
+	float ca = AMBIENT;
+	vec3 l(lightpoint.p - intersect);
+
+	vec3 d_hat(unitVector(d));
+	vec3 n_hat(unitVector(n));
+	vec3 l_hat(unitVector(l));
+	vec3 ref(reflect(l_hat, n_hat));
+	lightpoint.intensity = ca + cl*dot(n_hat, l_hat);
+
+	// the highlight is the same for every channel, so it is raised to p once
+	float facing = dot(d_hat, ref);
+	float specular = facing < 0 ? specularPower(facing, p) : 0.f;
+
+	vec3 cp(colour);
+	colour = cp*lightpoint.intensity + cl*cp*specular;
+}
+
+// the nearest plane along o + t*d, if any, with its distance in hit.dist,
+// which is infinite if there is none
+static const Plane* nearestPlane(Scene& scene, const vec3& o, const vec3& d, SurfaceHit& hit) {
+	hit.dist = INFINITY;
+
+	const Plane* plane = 0;
+	float t;
+	for (const Plane& pl : scene.planes) {
+		if (intersectPlane(pl, o, d, t) && t < hit.dist) {
+			hit.dist = t;
+			plane = &pl;
+		}
+	}
+	return plane;
+}
+
+// fills in hit once the accelerator has had its turn, returning whether
+// anything was hit: its primitive if it found one, else the plane
+static bool finishHit(Scene& scene, const Plane* plane, bool found, const vec3& o, const vec3& d, SurfaceHit& hit) {
+	if (found) {
+		completeHit(scene, o, d, hit);
+		return true;
+	}
+	if (!plane)
+		return false;
+
+	hit.prim = boundedPrimitiveCount(scene) + uint32_t(plane - scene.planes.begin());
+	hit.p = o + hit.dist*d;
+	hit.n = plane->n;
+	hit.colour = plane->colour;
+	hit.reflectivity = plane->reflectivity;
+	return true;
+}
+
+// Only the winner's material is read, once traversal is over.
+bool closestHit(Scene& scene, Accelerator& accel, const vec3& o, const vec3& d, SurfaceHit& hit, const BvhCut* cut) {
+	const Plane* plane = nearestPlane(scene, o, d, hit);
+	return finishHit(scene, plane, accel.ClosestHit(o, d, hit, cut), o, d, hit);
+}
+
+// The planes are found first, as for one ray, and the accelerator then
+// given all the rays together.
+void closestHits(Scene& scene, Accelerator& accel, const vec3* o, const vec3* d, SurfaceHit* hits, bool* found,
+                 int count, Arena& scratch, const BvhCut* cut) {
+	Arena::Marker mark(scratch.Mark());
+	const Plane** planes = scratch.Allocate<const Plane*>(count);
+	for (int i = 0; i < count; i++)
+		planes[i] = nearestPlane(scene, o[i], d[i], hits[i]);
+	accel.ClosestHits(o, d, hits, found, count, cut);
+	for (int i = 0; i < count; i++)
+		found[i] = finishHit(scene, planes[i], found[i], o[i], d[i], hits[i]);
+	scratch.Rewind(mark);
+}
+
+bool occluded(Scene& scene, Accelerator& accel, const vec3& p, const vec3& q) {
+	vec3 l(q - p);
+	float dist = length(l);
+	l /= dist;
+
+	float t;
+	for (const Plane& pl : scene.planes)
+		if (intersectPlane(pl, p, l, t) && t < dist)
+			return true;
+	return accel.Occluded(p, l, dist);
+}
+
+// Fraction of the light visible from p. Area lights are sampled on an n x n
+// grid of strata, n being the square root of the light's samples rounded
+// down, but at least 2, with the whole grid shifted by a per-pixel blue-noise
+// offset so the residual error is high-frequency. The four corner strata are
+// traced first; if they agree, p is taken to be fully lit or fully shadowed
+// and the rest of the grid is only traced in the penumbra, so soft shadows
+// cost four rays wherever the light is not partially hidden.
+template <int PROFILING>
+static float lightVisibility(Scene& scene, Accelerator& accel, vec3& p, const PixelSample& pixel, int depth) {
+	Light& light = scene.light;
+	if (light.shape == POINT_LIGHT || light.samples <= 1) {
+		countEvent<PROFILING>(COUNT_SHADOW_RAYS);
+		return occluded(scene, accel, p, light.p) ? 0.f : 1.f;
+	}
+
+	int n = std::max(2, int(sqrt(float(light.samples))));
+	vec2 shift(gradientNoise(pixel.x + 5.588238f*depth, pixel.y),
+	           gradientNoise(pixel.x, pixel.y + 5.588238f*(depth + 1)));
+
+	auto unoccluded = [&](int i, int j) {
+		float s = fract((i + 0.5f)/n + shift.x);
+		float t = fract((j + 0.5f)/n + shift.y);
+		countEvent<PROFILING>(COUNT_SHADOW_RAYS);
+		return !occluded(scene, accel, p, samplePointOnLight(light, s, t, p));
+	};
+
+	int visible = unoccluded(0, 0) + unoccluded(n-1, 0) + unoccluded(0, n-1) + unoccluded(n-1, n-1);
+	if (visible == 0 || visible == 4)
+		return visible / 4.f;
+
+	for (int j = 0; j < n; j++)
+		for (int i = 0; i < n; i++)
+			if ((i != 0 && i != n-1) || (j != 0 && j != n-1))
+				visible += unoccluded(i, j);
+	return float(visible) / (n*n);
+}
+
+// a ray waiting to be traced, and how much it contributes to the pixel
+struct RayRecord {
+	vec3 o;
+	vec3 d;
+	vec3 weight;
+	int depth;
+};
+
+// Rays are traced from an explicit stack rather than by recursion: each hit
+// adds its own shading, scaled by the ray's weight, and pushes any secondary
+// rays with the remaining weight.
+template <int PROFILING>
+vec3 traceRay(Scene& scene, Accelerator& accel, vec3 o, vec3 d, const PixelSample& pixel, Arena& scratch,
+              GBufferTexel* primary, const BvhCut* cut, const ShadingTerms* lighting) {
+	RayRecord* stack = scratch.Allocate<RayRecord>(MAX_DEPTH + 1);
+	int top = 0;
+	stack[top++] = {o, normalize(d), vec3(1, 1, 1), 0};
+
+	vec3 colour(0, 0, 0);
+	while (top > 0) {
+		RayRecord ray = stack[--top];
+		bool recording = primary && ray.depth == 0;
+
+		SurfaceHit hit;
+		if (recording && primary->prim != GBufferTexel::NOT_TRACED) {
+			// relighting: the camera has not moved, so neither has this surface
+			countEvent<PROFILING>(COUNT_RELIT_PIXELS);
+			if (primary->prim == GBufferTexel::NO_SURFACE)
+				continue;
+			Material m = primitiveMaterial(scene, primary->prim);
+			hit.p = primary->p;
+			hit.n = primary->n;
+			hit.colour = m.colour;
+			hit.reflectivity = m.reflectivity;
+		}
+		else {
+			bool found;
+			{
+				PhaseTimer<PROFILING> timer(ray.depth == 0 ? PHASE_PRIMARY : PHASE_SECONDARY);
+				countEvent<PROFILING>(ray.depth == 0 ? COUNT_PRIMARY_RAYS : COUNT_SECONDARY_RAYS);
+				found = closestHit(scene, accel, ray.o, ray.d, hit, ray.depth == 0 ? cut : 0);
+			}
+			if (!found) {
+				if (recording)
+					primary->prim = GBufferTexel::NO_SURFACE;
+				continue;
+			}
+
+			// face the normal toward the viewer so both sides of a surface shade
+			hit.n = normalize(hit.n);
+			if (dot(hit.n, ray.d) > 0)
+				hit.n = -hit.n;
+
+			if (recording)
+				*primary = {hit.p, hit.n, hit.prim};
+		}
+
+		// blend between ambient-only and fully lit by how much light is seen
+		vec3 local(hit.colour);
+		float visibility;
+		{
+			PhaseTimer<PROFILING> timer(PHASE_SHADOWS);
+			visibility = lightVisibility<PROFILING>(scene, accel, hit.p, pixel, ray.depth);
+		}
+		if (visibility > 0) {
+			PhaseTimer<PROFILING> timer(PHASE_SHADING);
+
+			// the terms found ahead give the colour shading() would:
+			// c*(ambient + n.l) + c*specular
+			vec3 lit(hit.colour);
+			if (lighting && ray.depth == 0)
+				lit *= AMBIENT + lighting->diffuse + lighting->specular;
+			else {
+				// shading() scribbles on the light, which other threads are reading
+				Light light(scene.light);
+				shading(lit, hit.n, light, hit.p, ray.d);
+			}
+			local = mix(local * AMBIENT, lit, visibility);
+		}
+		else
+			local *= AMBIENT;
+
+		float k = (ray.depth < MAX_DEPTH) ? hit.reflectivity : 0.f;
+		colour += ray.weight * (1 - k) * local;
+		if (k > 0)
+			stack[top++] = {hit.p, reflect(ray.d, hit.n), ray.weight * k, ray.depth + 1};
+	}
+	return colour;
+}
+
+template vec3 traceRay<PROFILE_NONE>(Scene& scene, Accelerator& accel, vec3 o, vec3 d, const PixelSample& pixel,
+                                    Arena& scratch, GBufferTexel* primary, const BvhCut* cut,
+                                    const ShadingTerms* lighting);
+template vec3 traceRay<PROFILE_COUNTS>(Scene& scene, Accelerator& accel, vec3 o, vec3 d, const PixelSample& pixel,
+                                      Arena& scratch, GBufferTexel* primary, const BvhCut* cut,
+                                      const ShadingTerms* lighting);
+template vec3 traceRay<PROFILE_TIMES>(Scene& scene, Accelerator& accel, vec3 o, vec3 d, const PixelSample& pixel,
+                                     Arena& scratch, GBufferTexel* primary, const BvhCut* cut,
+                                     const ShadingTerms* lighting);
+
+// --------------------------------------------------------------------------
+// Progressive rendering
+
+ProgressiveRenderer::ProgressiveRenderer()
+	: m_scene(0), m_accel(0), m_image(0), m_width(0), m_height(0), m_cropWindow(PixelRect{0, 0, 0, 0}), m_crop(PixelRect{0, 0, 0, 0}),
+	  m_order(HILBERT_ORDER),
+	  m_pathSamples(0), m_sampler(SOBOL_SAMPLER), m_lightIntensity(1), m_timeBudget(0), m_tileSeconds(0),
+	  m_checkpointInterval(0), m_sceneFingerprint(0), m_resumedSamples(0),
+	  m_jobCount(0), m_nextJob(0), m_jobsDone(0), m_busy(0),
+	  m_stopping(false), m_finished(true), m_cancel(false), m_profiling(false),
+	  m_interleaving(false)
+{
+}
+
+ProgressiveRenderer::~ProgressiveRenderer()
+{
+	Stop();
+}
+
+void ProgressiveRenderer::Start(Scene *scene, Accelerator *accel, ImageBuffer *image, const Camera &camera, int threads)
+{
+	Stop();
+	m_image = image;
+	Begin(scene, accel, camera, image->Width(), image->Height(), threads);
+}
+
+void ProgressiveRenderer::StartOffscreen(Scene *scene, Accelerator *accel, int width, int height,
+                                         const Camera &camera, int threads)
+{
+	Stop();
+	m_image = 0;
+	Begin(scene, accel, camera, width, height, threads);
+}
+
+void ProgressiveRenderer::Begin(Scene *scene, Accelerator *accel, const Camera &camera, int width, int height,
+                                int threads)
+{
+	m_scene = scene;
+	m_accel = accel;
+	m_camera = camera;
+	m_width = width;
+	m_height = height;
+
+	size_t pixels = size_t(width) * height;
+	m_gbuffer.assign(pixels, GBufferTexel());
+	m_pixels.assign(pixels, vec3(0, 0, 0));
+	if (m_pathSamples > 0) {
+		m_sums.assign(pixels, vec3(0, 0, 0));
+		m_moments.assign(pixels, vec2(0, 0));
+		m_lightIntensity = pathLightIntensity(*scene);
+	}
+	else {
+		m_sums.clear();
+		m_moments.clear();
+	}
+
+	m_sampleOrder.clear();
+	for (int step = COARSEST_STEP; step >= 1; step /= 2) {
+		m_sampleOrder.push_back(vector<GridPoint>());
+		gridOrder(m_order, TILE_SIZE / step, TILE_SIZE / step, m_sampleOrder.back());
+	}
+	PlanTiles();
+	m_profiler.Clear();
+	Resume();
+	m_resumedSamples = 0;
+	if (Checkpointed()) {
+		m_sceneFingerprint = sceneFingerprint(*scene);
+		ResumeFromCheckpoint();
+	}
+
+	if (threads <= 0)
+		threads = std::max(1u, thread::hardware_concurrency());
+	for (int i = 0; i < threads; i++)
+		m_workers.push_back(thread(&ProgressiveRenderer::Work, this));
+}
+
+void ProgressiveRenderer::Stop()
+{
+	{
+		lock_guard<mutex> lock(m_lock);
+		m_stopping = true;
+		m_cancel = true;
+	}
+	m_wake.notify_all();
+	m_idle.notify_all();
+	for (thread& worker : m_workers)
+		worker.join();
+	m_workers.clear();
+	m_stopping = false;
+	m_cancel = false;
+}
+
+// Lists the tiles overlapping the crop window, clipped to the image, or
+// every tile if there is none, and numbers the work of tracing them; m_lock
+// must be held
+void ProgressiveRenderer::PlanTiles()
+{
+	const PixelRect& window = m_cropWindow;
+	m_crop = PixelRect{0, 0, m_width, m_height};
+	if (!window.Empty())
+		m_crop = PixelRect{std::max(window.x0, 0), std::max(window.y0, 0),
+		                   std::min(window.x1, m_width), std::min(window.y1, m_height)};
+
+	vector<GridPoint> points;
+	int tilesX = (m_width + TILE_SIZE - 1) / TILE_SIZE;
+	int tilesY = (m_height + TILE_SIZE - 1) / TILE_SIZE;
+	gridOrder(m_order, tilesX, tilesY, points);
+	m_tileOrder.clear();
+	for (size_t i = 0; i < points.size(); i++) {
+		int tile = points[i].y * tilesX + points[i].x;
+		if (!TileRect(tile).Empty())
+			m_tileOrder.push_back(tile);
+	}
+
+	// path tracing adds a pass at the finest step for every sample after the first
+	int passes = int(m_sampleOrder.size()) + std::max(m_pathSamples - 1, 0);
+	m_jobCount = passes * int(m_tileOrder.size());
+}
+
+void ProgressiveRenderer::Crop(const PixelRect &crop)
+{
+	unique_lock<mutex> lock(m_lock);
+	m_cropWindow = crop;
+	if (m_workers.empty())
+		return;
+	Pause(lock);
+	PlanTiles();
+	Resume();
+}
+
+void ProgressiveRenderer::Restart(const Camera &camera)
+{
+	unique_lock<mutex> lock(m_lock);
+	Pause(lock);
+	m_camera = camera;
+	std::fill(m_gbuffer.begin(), m_gbuffer.end(), GBufferTexel());
+	Resume();
+}
+
+void ProgressiveRenderer::Relight(const Light &light)
+{
+	unique_lock<mutex> lock(m_lock);
+	Pause(lock);
+	m_scene->light = light;
+	if (Checkpointed())
+		m_sceneFingerprint = sceneFingerprint(*m_scene);
+	Resume();
+}
+
+void ProgressiveRenderer::EditScene(const function<bool()> &edit)
+{
+	unique_lock<mutex> lock(m_lock);
+	Pause(lock);
+	if (edit())
+		std::fill(m_gbuffer.begin(), m_gbuffer.end(), GBufferTexel());
+	if (Checkpointed())
+		m_sceneFingerprint = sceneFingerprint(*m_scene);
+	Resume();
+}
+
+// Cancels the tiles in flight and waits for their workers to give up, so that
+// the caller, holding lock, has the renderer's state to itself.
+void ProgressiveRenderer::Pause(unique_lock<mutex>& lock)
+{
+	m_cancel = true;
+	m_idle.wait(lock, [this] { return m_busy == 0; });
+	m_cancel = false;
+}
+
+// begins again from the first pass; m_lock must be held
+void ProgressiveRenderer::Resume()
+{
+	m_nextJob = 0;
+	m_jobsDone = 0;
+	int tiles = TileCount();
+	m_tileSamples.assign(tiles, 0);
+	m_tileErrors.assign(tiles, INFINITY);
+	m_tileBusy.assign(tiles, false);
+	m_tileSeconds = 0;
+	m_lastCheckpoint = chrono::steady_clock::now();
+	m_deadline = chrono::steady_clock::now()
+		+ chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(m_timeBudget));
+	if (m_profiling)
+		m_profiler.Begin();
+	m_finished = (m_jobCount == 0);
+	m_wake.notify_all();
+}
+
+// m_lock must be held
+void ProgressiveRenderer::Finish()
+{
+	if (m_profiling)
+		m_profiler.End();
+	m_finished = true;
+	m_wake.notify_all();
+	m_idle.notify_all();
+}
+
+void ProgressiveRenderer::SetCheckpoint(const string& filename, double seconds)
+{
+	m_checkpointFile = filename;
+	m_checkpointInterval = std::max(seconds, 0.0);
+	if (!filename.empty())
+		m_checkpoints.SetFile(filename);
+}
+
+// the render in flight, as a checkpoint of it would identify it
+Checkpoint ProgressiveRenderer::DescribeRender() const
+{
+	Checkpoint render;
+	render.scene = m_sceneFingerprint;
+	render.eye = m_camera.eye;
+	render.yaw = m_camera.yaw;
+	render.pitch = m_camera.pitch;
+	render.focal = m_camera.focal;
+	render.width = m_width;
+	render.height = m_height;
+	render.x0 = m_crop.x0;
+	render.y0 = m_crop.y0;
+	render.x1 = m_crop.x1;
+	render.y1 = m_crop.y1;
+	render.sampler = m_sampler;
+	return render;
+}
+
+// Hands a copy of the crop's sums, each of the given number of paths, to the
+// checkpoint writer. Called as a pass completes, so that no worker is
+// adding to them; m_lock must be held.
+void ProgressiveRenderer::TakeCheckpoint(int samples)
+{
+	unique_ptr<Checkpoint> checkpoint(new Checkpoint(DescribeRender()));
+	checkpoint->samples = samples;
+	if (!m_crop.Empty()) {
+		size_t pixels = size_t(m_crop.x1 - m_crop.x0) * (m_crop.y1 - m_crop.y0);
+		checkpoint->sums.reserve(pixels);
+		checkpoint->moments.reserve(pixels);
+		for (int y = m_crop.y0; y < m_crop.y1; y++) {
+			size_t row = size_t(y)*m_width;
+			checkpoint->sums.insert(checkpoint->sums.end(), &m_sums[row + m_crop.x0], &m_sums[row + m_crop.x1]);
+			checkpoint->moments.insert(checkpoint->moments.end(), &m_moments[row + m_crop.x0],
+			                           &m_moments[row + m_crop.x1]);
+		}
+	}
+	m_checkpoints.Submit(std::move(checkpoint));
+	m_lastCheckpoint = chrono::steady_clock::now();
+}
+
+// Restores the sums of a checkpoint taken of this render, and carries on
+// from the pass after the one it was taken at. Every pixel's mean is found
+// as Accumulate() found it, so the image carries on as it would have.
+// Called before the workers start.
+void ProgressiveRenderer::ResumeFromCheckpoint()
+{
+	Checkpoint saved;
+	if (!readCheckpoint(m_checkpointFile, saved) || !saved.SameRender(DescribeRender()) || saved.samples <= 0)
+		return;
+
+	int width = m_width;
+	size_t i = 0;
+	for (int y = m_crop.y0; y < m_crop.y1; y++)
+		for (int x = m_crop.x0; x < m_crop.x1; x++, i++) {
+			size_t pixel = size_t(y)*width + x;
+			m_sums[pixel] = saved.sums[i];
+			m_moments[pixel] = saved.moments[i];
+			m_pixels[pixel] = saved.sums[i] / float(saved.samples);
+		}
+	if (m_image && !m_crop.Empty())
+		m_image->CommitTile(m_crop.x0, m_crop.y0, m_crop.x1 - m_crop.x0, m_crop.y1 - m_crop.y0,
+		                    &m_pixels[size_t(m_crop.y0)*width + m_crop.x0], width);
+
+	for (int tile : m_tileOrder) {
+		m_tileSamples[tile] = saved.samples;
+		m_tileErrors[tile] = TileError(tile, saved.samples - 1);
+	}
+	int tiles = int(m_tileOrder.size());
+	int passes = int(m_sampleOrder.size()) - 1 + saved.samples;
+	m_nextJob = m_jobsDone = std::min(passes * tiles, m_jobCount);
+	m_resumedSamples = saved.samples;
+	if (m_jobsDone == m_jobCount && !Budgeted())
+		Finish();
+}
+
+// true once a tile begun now might not be done by the deadline, allowing
+// half as long again as tiles have been taking; m_lock must be held
+bool ProgressiveRenderer::OutOfTime() const
+{
+	return chrono::steady_clock::now() + chrono::duration<double>(1.5 * m_tileSeconds) >= m_deadline;
+}
+
+// the tile with the highest error that no worker is tracing, or -1 if there
+// is none; m_lock must be held
+int ProgressiveRenderer::NoisiestTile() const
+{
+	int noisiest = -1;
+	for (int tile : m_tileOrder)
+		if (!m_tileBusy[tile] && (noisiest < 0 || m_tileErrors[tile] > m_tileErrors[noisiest]))
+			noisiest = tile;
+	return noisiest;
+}
+
+void ProgressiveRenderer::Wait()
+{
+	unique_lock<mutex> lock(m_lock);
+	m_idle.wait(lock, [this] { return m_finished || m_workers.empty(); });
+}
+
+void ProgressiveRenderer::Display()
+{
+	if (m_image)
+		m_image->Render();
+}
+
+int ProgressiveRenderer::TileCount() const
+{
+	int tilesX = (m_width + TILE_SIZE - 1) / TILE_SIZE;
+	int tilesY = (m_height + TILE_SIZE - 1) / TILE_SIZE;
+	return tilesX * tilesY;
+}
+
+// the pixels of the tile that are traced, which may be none
+PixelRect ProgressiveRenderer::TileRect(int tile) const
+{
+	int tilesX = (m_width + TILE_SIZE - 1) / TILE_SIZE;
+	int x0 = (tile % tilesX) * TILE_SIZE;
+	int y0 = (tile / tilesX) * TILE_SIZE;
+	return PixelRect{std::max(x0, m_crop.x0), std::max(y0, m_crop.y0),
+	                 std::min(x0 + TILE_SIZE, m_crop.x1), std::min(y0 + TILE_SIZE, m_crop.y1)};
+}
+
+// Once the numbered work is done, a render to a deadline goes on with one
+// more path per pixel through whichever tile is noisiest, until a tile
+// could no longer be finished in time; the render then finishes with the
+// last of the tiles in flight.
+void ProgressiveRenderer::Work()
+{
+	currentThreadProfile() = m_profiling ? m_profiler.AddThread() : 0;
+
+	unique_lock<mutex> lock(m_lock);
+	while (!m_stopping) {
+		int tiles = int(m_tileOrder.size());
+		bool budgeted = Budgeted();
+		if (!m_cancel && !m_finished && budgeted && OutOfTime()) {
+			if (m_busy == 0)
+				Finish();
+			else
+				m_wake.wait(lock);
+			continue;
+		}
+
+		// wait for work, and for the previous pass to be complete
+		int tile = -1, pass = 0;
+		bool extra = false;
+		if (!m_cancel && !m_finished) {
+			if (m_nextJob < m_jobCount) {
+				if (m_jobsDone >= m_nextJob / tiles * tiles) {
+					int job = m_nextJob++;
+					tile = m_tileOrder[job % tiles];
+					pass = job / tiles;
+				}
+			}
+			else if (budgeted && m_jobsDone == m_jobCount && (tile = NoisiestTile()) >= 0) {
+				pass = int(m_sampleOrder.size()) - 1 + m_tileSamples[tile];
+				extra = true;
+			}
+		}
+		if (tile < 0) {
+			if (budgeted && !m_cancel && !m_finished)
+				m_wake.wait_until(lock, m_deadline);
+			else
+				m_wake.wait(lock);
+			continue;
+		}
+
+		m_busy++;
+		m_tileBusy[tile] = true;
+		lock.unlock();
+		chrono::steady_clock::time_point start(chrono::steady_clock::now());
+		bool complete = m_profiling ? RenderTile<true>(tile, pass) : RenderTile<false>(tile, pass);
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		// once a path tracing pass covers every pixel, each covers the tile
+		int sample = pass - int(m_sampleOrder.size()) + 1;
+		bool measured = complete && m_pathSamples > 0 && sample >= 0;
+		float error = measured ? TileError(tile, sample) : 0.f;
+
+		lock.lock();
+		m_busy--;
+		m_tileBusy[tile] = false;
+
+		// the estimate of a tile's time falls only slowly, so as not to be
+		// caught out by one slower than the last few
+		if (complete) {
+			m_tileSeconds = std::max(seconds, 0.9 * m_tileSeconds);
+			if (measured) {
+				m_tileSamples[tile] = sample + 1;
+				m_tileErrors[tile] = error;
+			}
+			if (extra)
+				m_wake.notify_all();
+			else if (++m_jobsDone % tiles == 0) {
+				if (Checkpointed() && sample >= 0 && (m_jobsDone == m_jobCount
+				    || chrono::steady_clock::now() - m_lastCheckpoint >= chrono::duration<double>(m_checkpointInterval)))
+					TakeCheckpoint(sample + 1);
+				if (m_jobsDone == m_jobCount && !budgeted)
+					Finish();
+				m_wake.notify_all();
+			}
+		}
+		if (m_busy == 0 || m_finished)
+			m_idle.notify_all();
+	}
+}
+
+// Traces one sample per step x step block of the tile, where step is the
+// block size of the given pass, and fills the block with it. Samples sit on
+// the block's bottom-left pixel, so every refining pass after the first
+// skips the quarter of its samples the previous pass already took. The
+// passes after those, when path tracing, trace another path through every
+// pixel. Returns false, leaving the image alone, if cancelled part way
+// through.
+//
+// With a streamed scene, samples whose rays reach clusters that are not in
+// memory are set aside, and traced again once all the clusters the tile
+// missed have been paged in as one batch.
+template <bool PROFILED>
+bool ProgressiveRenderer::RenderTile(int tile, int pass)
+{
+	ThreadProfile* profile = PROFILED ? currentThreadProfile() : 0;
+	TileEvent event;
+	if (PROFILED) {
+		event.tile = tile;
+		event.pass = pass;
+		event.start = profileClock();
+		std::copy(profile->phases, profile->phases + PHASE_COUNT, event.phases);
+		std::copy(profile->counts, profile->counts + COUNTER_COUNT, event.counts);
+	}
+
+	int width = m_width;
+	int height = m_height;
+	int refinePasses = int(m_sampleOrder.size());
+	int step = pass < refinePasses ? COARSEST_STEP >> pass : 1;
+	int sample = std::max(pass - refinePasses + 1, 0);
+	int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	int tileX = (tile % tilesX) * TILE_SIZE;
+	int tileY = (tile / tilesX) * TILE_SIZE;
+	PixelRect rect(TileRect(tile));
+	int x0 = rect.x0, y0 = rect.y0, x1 = rect.x1, y1 = rect.y1;
+	bool refining = pass > 0 && pass < refinePasses;
+
+	Arena& scratch = threadScratch();
+	scratch.Reset();
+
+	// primary rays all start from the BVH nodes that overlap the tile (if the
+	// accelerator is a BVH), padded by half a pixel so rays along its edges
+	// are not lost to rounding
+	BvhCut cut;
+	m_accel->Cull(m_camera.Bundle(x0 - 0.5f, y0 - 0.5f, x1 - 0.5f, y1 - 0.5f, width, height), cut);
+
+	ClusterPager* pager = m_accel->Pager();
+	vector<uint32_t>& missing = ClusterPager::Missing();
+	PixelSample* deferred = pager ? scratch.Allocate<PixelSample>(TILE_SIZE*TILE_SIZE) : 0;
+	int deferredCount = 0;
+	if (pager)
+		ClusterPager::SetDeferring(true);
+
+	// Check for cancellation about as often as a row of the tile is traced.
+	// Samples keep to the whole tile's grid, so that each pass still skips
+	// those the last took; where the crop window cuts a block, its pixels
+	// wait for a pass whose samples lie inside.
+	const vector<GridPoint>& order = m_sampleOrder[std::min(pass, refinePasses - 1)];
+	size_t checkInterval = TILE_SIZE / step;
+	auto skipped = [&](int x, int y) {
+		return x < x0 || y < y0 || x >= x1 || y >= y1 || (refining && x % (2*step) == 0 && y % (2*step) == 0);
+	};
+
+	// When interleaving, or with fast math, the primary rays of each row's
+	// worth of samples are traced first, together if interleaving, and the
+	// samples then shaded from them; with fast math the hits' lighting is
+	// found in batches in between.
+	bool ahead = !PROFILED && m_pathSamples == 0 && !pager && (m_interleaving || mathMode == FAST_MATH);
+	PixelSample* row = ahead ? scratch.Allocate<PixelSample>(checkInterval) : 0;
+	vec3* rowDirections = ahead ? scratch.Allocate<vec3>(checkInterval) : 0;
+	ShadingTerms* terms = ahead && mathMode == FAST_MATH ? scratch.Allocate<ShadingTerms>(checkInterval) : 0;
+	int rowNext = 0;
+
+	bool cancelled = false;
+	for (size_t i = 0; i < order.size() && !cancelled; i++) {
+		if (i % checkInterval == 0) {
+			cancelled = m_cancel.load(memory_order_relaxed);
+			if (ahead && !cancelled) {
+				int rowCount = 0;
+				for (size_t j = i; j < std::min(i + checkInterval, order.size()); j++) {
+					int x = tileX + order[j].x * step;
+					int y = tileY + order[j].y * step;
+					if (!skipped(x, y)) {
+						row[rowCount] = { x, y };
+						rowDirections[rowCount++] = m_camera.RayDirection(x, y, width, height);
+					}
+				}
+				TraceAhead(row, rowDirections, rowCount, cut, scratch);
+				if (terms)
+					LightAhead(row, rowDirections, rowCount, terms);
+				rowNext = 0;
+			}
+		}
+		int x = tileX + order[i].x * step;
+		int y = tileY + order[i].y * step;
+		if (skipped(x, y))
+			continue;
+
+		size_t missed = missing.size();
+		const vec3* direction = ahead ? &rowDirections[rowNext] : 0;
+		const ShadingTerms* lighting = terms ? &terms[rowNext] : 0;
+		rowNext++;
+		vec3 colour(TracePixel<PROFILED>(x, y, sample, cut, scratch, direction, lighting));
+		if (missing.size() > missed) {
+			deferred[deferredCount++] = { x, y };
+			m_gbuffer[size_t(y)*width + x] = GBufferTexel();
+			continue;
+		}
+		FillBlock(x, y, x1, y1, step, Accumulate(x, y, sample, colour));
+	}
+
+	if (pager) {
+		ClusterPager::SetDeferring(false);
+		if (deferredCount > 0 && !cancelled)
+			pager->PageIn(missing);
+		missing.clear();
+		for (int i = 0; i < deferredCount && !cancelled; i++) {
+			const PixelSample& pixel = deferred[i];
+			vec3 colour(TracePixel<PROFILED>(pixel.x, pixel.y, sample, cut, scratch));
+			FillBlock(pixel.x, pixel.y, x1, y1, step, Accumulate(pixel.x, pixel.y, sample, colour));
+			cancelled = m_cancel.load(memory_order_relaxed);
+		}
+	}
+
+	// the tile's event holds the growth of the thread's totals while tracing it
+	if (PROFILED) {
+		event.cancelled = cancelled;
+		event.end = profileClock();
+		for (int i = 0; i < PHASE_COUNT; i++)
+			event.phases[i] = profile->phases[i] - event.phases[i];
+		for (int i = 0; i < COUNTER_COUNT; i++)
+			event.counts[i] = profile->counts[i] - event.counts[i];
+		profile->tiles.push_back(event);
+	}
+	if (cancelled)
+		return false;
+
+	if (m_image)
+		m_image->CommitTile(x0, y0, x1 - x0, y1 - y0, &m_pixels[size_t(y0)*width + x0], width);
+	return true;
+}
+
+// Records the primary hits of those of the given pixels not yet traced in
+// the G-buffer, their rays along the matching directions, so that
+// TracePixel() only has to shade them; when interleaving, the rays are
+// traced together. The hits are exactly those traceRay() would have found.
+void ProgressiveRenderer::TraceAhead(const PixelSample* pixels, const vec3* directions, int count, const BvhCut& cut,
+                                     Arena& scratch)
+{
+	Arena::Marker mark(scratch.Mark());
+	GBufferTexel** texels = scratch.Allocate<GBufferTexel*>(count);
+	vec3* o = scratch.Allocate<vec3>(count);
+	vec3* d = scratch.Allocate<vec3>(count);
+	int traced = 0;
+	for (int i = 0; i < count; i++) {
+		GBufferTexel& primary = m_gbuffer[size_t(pixels[i].y)*m_width + pixels[i].x];
+		if (primary.prim != GBufferTexel::NOT_TRACED)
+			continue;
+		texels[traced] = &primary;
+		o[traced] = m_camera.eye;
+		d[traced] = normalize(directions[i]);
+		traced++;
+	}
+	if (traced == 0) {
+		scratch.Rewind(mark);
+		return;
+	}
+
+	SurfaceHit* hits = scratch.Allocate<SurfaceHit>(traced);
+	bool* found = scratch.Allocate<bool>(traced);
+	if (m_interleaving)
+		closestHits(*m_scene, *m_accel, o, d, hits, found, traced, scratch, &cut);
+	else {
+		for (int i = 0; i < traced; i++)
+			found[i] = closestHit(*m_scene, *m_accel, o[i], d[i], hits[i], &cut);
+	}
+
+	for (int i = 0; i < traced; i++) {
+		if (!found[i]) {
+			texels[i]->prim = GBufferTexel::NO_SURFACE;
+			continue;
+		}
+		vec3 n(normalize(hits[i].n));
+		if (dot(n, d[i]) > 0)
+			n = -n;
+		*texels[i] = GBufferTexel(hits[i].p, n, hits[i].prim);
+	}
+	scratch.Rewind(mark);
+}
+
+// Finds the lighting of the surfaces recorded for the given pixels, seen
+// along the matching directions, with phongBatch(), ShadeBatch::WIDTH at a
+// time, into the matching entries of terms. The entries of pixels that see
+// no surface are left alone.
+void ProgressiveRenderer::LightAhead(const PixelSample* pixels, const vec3* directions, int count,
+                                     ShadingTerms* terms)
+{
+	const int WIDTH = ShadeBatch::WIDTH;
+	vec3 light(m_scene->light.p);
+	ShadeBatch batch;
+	int lane[WIDTH];
+	int filled = 0;
+	for (int i = 0; i < count; i++) {
+		const GBufferTexel& primary = m_gbuffer[size_t(pixels[i].y)*m_width + pixels[i].x];
+		if (primary.prim != GBufferTexel::NO_SURFACE) {
+			vec3 l(light - primary.p);
+			const vec3& d = directions[i];
+			batch.nx[filled] = primary.n.x; batch.ny[filled] = primary.n.y; batch.nz[filled] = primary.n.z;
+			batch.lx[filled] = l.x; batch.ly[filled] = l.y; batch.lz[filled] = l.z;
+			batch.dx[filled] = d.x; batch.dy[filled] = d.y; batch.dz[filled] = d.z;
+			lane[filled++] = i;
+		}
+		if (filled == WIDTH || (i == count - 1 && filled > 0)) {
+			// the lanes of a short batch repeat its first hit
+			for (int k = filled; k < WIDTH; k++) {
+				batch.nx[k] = batch.nx[0]; batch.ny[k] = batch.ny[0]; batch.nz[k] = batch.nz[0];
+				batch.lx[k] = batch.lx[0]; batch.ly[k] = batch.ly[0]; batch.lz[k] = batch.lz[0];
+				batch.dx[k] = batch.dx[0]; batch.dy[k] = batch.dy[0]; batch.dz[k] = batch.dz[0];
+			}
+			phongBatch(batch, SPECULAR_EXPONENT);
+			for (int k = 0; k < filled; k++)
+				terms[lane[k]] = { batch.diffuse[k], batch.specular[k] };
+			filled = 0;
+		}
+	}
+}
+
+// Path traced samples are jittered across their pixel, which the tile's
+// cut allows for, by the sample's first two dimensions. Ray traced ones are
+// along direction, if given, saving working it out again, and lit with
+// lighting, if given, as traceRay() describes.
+template <bool PROFILED>
+vec3 ProgressiveRenderer::TracePixel(int x, int y, int sample, const BvhCut& cut, Arena& scratch,
+                                     const vec3* direction, const ShadingTerms* lighting)
+{
+	int width = m_width;
+	if (m_pathSamples > 0) {
+		PixelSampler sampler(m_sampler, x, y, sample);
+		vec2 jitter(sampler.Get2D() - 0.5f);
+		vec3 d(m_camera.RayDirection(x + jitter.x, y + jitter.y, width, m_height));
+		if (!PROFILED)
+			return tracePath<PROFILE_NONE>(*m_scene, *m_accel, m_camera.eye, d, m_lightIntensity, sampler, &cut);
+
+		ThreadProfile* profile = currentThreadProfile();
+		if (profile->samples++ % PROFILE_TIMING_INTERVAL != 0)
+			return tracePath<PROFILE_COUNTS>(*m_scene, *m_accel, m_camera.eye, d, m_lightIntensity, sampler, &cut);
+		profile->timedSamples++;
+		return tracePath<PROFILE_TIMES>(*m_scene, *m_accel, m_camera.eye, d, m_lightIntensity, sampler, &cut);
+	}
+
+	vec3 d(direction ? *direction : m_camera.RayDirection(x, y, width, m_height));
+	PixelSample pixel = { x, y };
+	GBufferTexel& primary = m_gbuffer[size_t(y)*width + x];
+	if (!PROFILED)
+		return traceRay<PROFILE_NONE>(*m_scene, *m_accel, m_camera.eye, d, pixel, scratch, &primary, &cut, lighting);
+
+	ThreadProfile* profile = currentThreadProfile();
+	if (profile->samples++ % PROFILE_TIMING_INTERVAL != 0)
+		return traceRay<PROFILE_COUNTS>(*m_scene, *m_accel, m_camera.eye, d, pixel, scratch, &primary, &cut);
+	profile->timedSamples++;
+	return traceRay<PROFILE_TIMES>(*m_scene, *m_accel, m_camera.eye, d, pixel, scratch, &primary, &cut);
+}
+
+// When path tracing, adds the given sample of pixel (x, y) to its sum and
+// returns their mean; otherwise returns colour as it is.
+vec3 ProgressiveRenderer::Accumulate(int x, int y, int sample, vec3 colour)
+{
+	if (m_pathSamples == 0)
+		return colour;
+	size_t pixel = size_t(y)*m_width + x;
+	vec3& sum = m_sums[pixel];
+	sum = sample == 0 ? colour : sum + colour;
+
+	// paths brighter than white look no different from it
+	float luminance = std::min(dot(colour, LUMINANCE), 1.f);
+	vec2 moments(luminance, luminance*luminance);
+	m_moments[pixel] = sample == 0 ? moments : m_moments[pixel] + moments;
+	return sum / float(sample + 1);
+}
+
+// The RMS error of the means of the tile's pixels once each has sample + 1
+// paths, estimated from the spread of their paths.
+float ProgressiveRenderer::TileError(int tile, int sample) const
+{
+	PixelRect rect(TileRect(tile));
+	float n = float(sample + 1);
+
+	if (sample == 0)
+		return INFINITY;
+	float squares = 0;
+	for (int y = rect.y0; y < rect.y1; y++)
+		for (int x = rect.x0; x < rect.x1; x++) {
+			vec2 moments(m_moments[size_t(y)*m_width + x]);
+			float variance = std::max(moments.y - moments.x*moments.x/n, 0.f) / (n - 1);
+			squares += variance / n;
+		}
+	return sqrt(squares / ((rect.x1 - rect.x0) * (rect.y1 - rect.y0)));
+}
+
+// sets the step x step block whose bottom-left pixel is (x, y), clipped to
+// the tile ending at (x1, y1)
+void ProgressiveRenderer::FillBlock(int x, int y, int x1, int y1, int step, vec3 colour)
+{
+	int width = m_width;
+	for (int by = y; by < std::min(y + step, y1); by++)
+		for (int bx = x; bx < std::min(x + step, x1); bx++)
+			m_pixels[size_t(by)*width + bx] = colour;
+}
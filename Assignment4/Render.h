@@ -0,0 +1,350 @@
+// ==========================================================================
+// Ray Tracing Renderer
+//
+// This module contains the camera model, the recursive ray tracing routine
+// that shades a single ray against a Scene, and a ProgressiveRenderer that
+// fills an ImageBuffer tile by tile. Rendering starts with coarse pixel
+// blocks and refines by halving the block size each pass, so a usable
+// preview appears almost immediately and restarting after a camera change
+// throws away at most one tile of work per thread. Primary hits are kept
+// between passes so that moving only the light reshades the image without
+// re-tracing them. When path tracing, the refined image is followed by
+// further passes that each add one more path through every pixel, and then,
+// when rendering to a deadline, by more paths through the tiles whose error
+// is highest. Path traced renders can be checkpointed at the end of those
+// passes, and resumed.
+// ==========================================================================
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include <glm/glm.hpp>
+#include "Arena.h"
+#include "Checkpoint.h"
+#include "Scene.h"
+#include "Accelerator.h"
+#include "ImageBuffer.h"
+#include "PixelOrder.h"
+#include "Profile.h"
+#include "Sampler.h"
+
+// --------------------------------------------------------------------------
+// A pinhole camera looking down -z when yaw and pitch are both zero.
+
+struct Camera
+{
+	glm::vec3 eye;
+	float yaw;      // rotation about the world y axis, in radians
+	float pitch;    // rotation above the horizon, in radians
+	float focal;    // distance to the image plane, in pixels
+
+	Camera() : eye(0, 0, 0), yaw(0), pitch(0), focal(500)
+	{}
+
+	glm::vec3 Forward() const;
+	glm::vec3 Right() const;
+	glm::vec3 Up() const;
+
+	// direction of the primary ray through pixel (x, y) of a width x height
+	// image, where (0,0) is the bottom-left pixel
+	glm::vec3 RayDirection(float x, float y, int width, int height) const;
+
+	// the frustum holding the primary rays through every pixel (x, y) with
+	// x0 <= x <= x1 and y0 <= y <= y1
+	Frustum Bundle(float x0, float y0, float x1, float y1, int width, int height) const;
+};
+
+// identifies the pixel a ray is traced for, so that the sample patterns of
+// neighbouring pixels can be decorrelated
+struct PixelSample
+{
+	int x, y;
+};
+
+// The first surface seen through a pixel, kept so that the image can be
+// relit without tracing its primary rays again.
+struct GBufferTexel
+{
+	static const uint32_t NOT_TRACED = 0xffffffff;
+	static const uint32_t NO_SURFACE = 0xfffffffe;
+
+	glm::vec3 p;
+	glm::vec3 n;        // unit length, facing the camera
+	uint32_t  prim;     // primitive id, or one of the values above
+
+	GBufferTexel() : p(0), n(0), prim(NOT_TRACED)
+	{}
+	GBufferTexel(glm::vec3 p, glm::vec3 n, uint32_t prim) : p(p), n(n), prim(prim)
+	{}
+};
+
+// finds the nearest surface along o + t*d, planes included, filling in hit
+// for shading; accel has been built over scene, and cut is as for traceRay()
+bool closestHit(Scene& scene, Accelerator& accel, const glm::vec3& o, const glm::vec3& d,
+                SurfaceHit& hit, const BvhCut* cut = 0);
+
+// closestHit() for count rays, the ith from o[i] along d[i] into hits[i],
+// setting found[i] to what it returns; the accelerator is given the rays
+// together, so it may trace them interleaved
+void closestHits(Scene& scene, Accelerator& accel, const glm::vec3* o, const glm::vec3* d, SurfaceHit* hits,
+                 bool* found, int count, Arena& scratch, const BvhCut* cut = 0);
+
+// the lighting of a primary hit, found ahead of shading it: the diffuse
+// cosine n.l and the specular term, as phongBatch() gives them
+struct ShadingTerms
+{
+	float diffuse, specular;
+};
+
+// true if any surface lies between p and q
+bool occluded(Scene& scene, Accelerator& accel, const glm::vec3& p, const glm::vec3& q);
+
+// returns the colour seen along the ray o + t*d for the given pixel, where accel
+// has been built over scene; secondary ray records are taken from scratch,
+// which the caller rewinds when convenient. If primary is given, a surface
+// already recorded there is shaded in place of tracing the first ray, and
+// otherwise the first ray's hit is recorded there. If cut is given, the
+// first ray lies in the frustum it was culled to and starts traversal there.
+// If lighting is given, the surface recorded in primary is lit with it in
+// place of shading(). traceRay<PROFILE_COUNTS> counts its work into the
+// calling thread's profile, and traceRay<PROFILE_TIMES> times it too.
+template <int PROFILING = PROFILE_NONE>
+glm::vec3 traceRay(Scene& scene, Accelerator& accel, glm::vec3 o, glm::vec3 d,
+                   const PixelSample& pixel, Arena& scratch, GBufferTexel* primary = 0,
+                   const BvhCut* cut = 0, const ShadingTerms* lighting = 0);
+
+// a rectangle of pixels, from (x0, y0) up to but not including (x1, y1)
+struct PixelRect
+{
+	int x0, y0, x1, y1;
+
+	bool Empty() const { return x1 <= x0 || y1 <= y0; }
+};
+
+// --------------------------------------------------------------------------
+
+// Tiles are traced on a pool of worker threads, which claim them one at a
+// time. A pass only begins once the pass before it is complete, so no two
+// workers ever touch the same pixels; finished tiles are copied into the
+// image for the caller's thread to display whenever it likes. Tiles are
+// handed out, and their samples taken, in the renderer's PixelOrder. Given a
+// crop window, only the tiles it overlaps are traced, and only the pixels
+// inside it, so that the rest of the image stays as it was.
+
+class ProgressiveRenderer
+{
+	Scene*       m_scene;
+	Accelerator* m_accel;
+	ImageBuffer* m_image;       // or null when rendering offscreen
+	Camera       m_camera;
+	int          m_width, m_height;
+
+	// the pixels to trace as asked for, empty for all of them, and as
+	// clipped to the image
+	PixelRect    m_cropWindow;
+	PixelRect    m_crop;
+
+	// tiles in the order they are handed out, and for each pass the samples
+	// of a tile, in steps of that pass's block size, in the order taken
+	PixelOrder   m_order;
+	std::vector<int> m_tileOrder;
+	std::vector<std::vector<GridPoint> > m_sampleOrder;
+
+	// primary hits of every pixel sampled since the camera last moved
+	std::vector<GBufferTexel> m_gbuffer;
+
+	// colour of every pixel, written by whichever worker is tracing its tile
+	std::vector<glm::vec3> m_pixels;
+
+	// paths traced per pixel, or 0 for Whitted ray tracing, the numbers they
+	// are drawn from, the light's intensity for them, and the sum of every
+	// pixel's paths so far
+	int     m_pathSamples;
+	SamplerType m_sampler;
+	float   m_lightIntensity;
+	std::vector<glm::vec3> m_sums;
+
+	// When rendering to a deadline: the time each render is given, the end
+	// of the one in flight and about how long a tile takes; every pixel's
+	// sum and sum of squares of its paths' luminance; and for every tile its
+	// paths per pixel, their estimated error, and whether it is being traced.
+	double  m_timeBudget;
+	std::chrono::steady_clock::time_point m_deadline;
+	double  m_tileSeconds;
+	std::vector<glm::vec2> m_moments;
+	std::vector<int>   m_tileSamples;
+	std::vector<float> m_tileErrors;
+	std::vector<char>  m_tileBusy;
+
+	// When checkpointing: the file, the least time between checkpoints, when
+	// the last was taken, the scene's hash, and the paths per pixel of the
+	// checkpoint the render resumed from, if any
+	std::string m_checkpointFile;
+	double  m_checkpointInterval;
+	std::chrono::steady_clock::time_point m_lastCheckpoint;
+	uint64_t m_sceneFingerprint;
+	int     m_resumedSamples;
+	CheckpointWriter m_checkpoints;
+
+	// work is numbered pass by pass, then tile by tile within a pass
+	int     m_jobCount;
+	int     m_nextJob;
+	int     m_jobsDone;
+	int     m_busy;         // workers inside RenderTile()
+	bool    m_stopping;
+	std::atomic<bool> m_finished;
+	std::atomic<bool> m_cancel;
+
+	std::vector<std::thread> m_workers;
+	std::mutex m_lock;
+	std::condition_variable m_wake;     // work is available, or stopping
+	std::condition_variable m_idle;     // no worker is busy, or finished
+
+	// the workers' timings of the latest render, when profiling
+	bool     m_profiling;
+	Profiler m_profiler;
+
+	// whether primary rays are traced a row's worth at a time
+	bool     m_interleaving;
+
+	int TileCount() const;
+	PixelRect TileRect(int tile) const;
+	void PlanTiles();
+	void Begin(Scene *scene, Accelerator *accel, const Camera &camera, int width, int height, int threads);
+	void Work();
+	void Pause(std::unique_lock<std::mutex>& lock);
+	void Resume();
+	void Finish();
+	bool Budgeted() const { return m_timeBudget > 0 && m_pathSamples > 0; }
+	bool Checkpointed() const { return !m_checkpointFile.empty() && m_pathSamples > 0; }
+	Checkpoint DescribeRender() const;
+	void TakeCheckpoint(int samples);
+	void ResumeFromCheckpoint();
+	bool OutOfTime() const;
+	int NoisiestTile() const;
+	float TileError(int tile, int sample) const;
+	template <bool PROFILED> bool RenderTile(int tile, int pass);
+	void TraceAhead(const PixelSample* pixels, const glm::vec3* directions, int count, const BvhCut& cut,
+	                Arena& scratch);
+	void LightAhead(const PixelSample* pixels, const glm::vec3* directions, int count, ShadingTerms* terms);
+	template <bool PROFILED> glm::vec3 TracePixel(int x, int y, int sample, const BvhCut& cut, Arena& scratch,
+	                                              const glm::vec3* direction = 0,
+	                                              const ShadingTerms* lighting = 0);
+	glm::vec3 Accumulate(int x, int y, int sample, glm::vec3 colour);
+	void FillBlock(int x, int y, int x1, int y1, int step, glm::vec3 colour);
+
+	ProgressiveRenderer(const ProgressiveRenderer&);
+	ProgressiveRenderer& operator=(const ProgressiveRenderer&);
+
+public:
+	static const int TILE_SIZE = 32;
+	static const int COARSEST_STEP = 8;
+
+	ProgressiveRenderer();
+	~ProgressiveRenderer();
+
+	// begin rendering scene, accelerated by accel, into image as seen from
+	// camera, on the given number of threads (0 for one per processor)
+	void Start(Scene *scene, Accelerator *accel, ImageBuffer *image, const Camera &camera, int threads = 0);
+
+	// like Start(), but renders a width x height image that is only kept in
+	// Pixels(), for benchmarking without a window
+	void StartOffscreen(Scene *scene, Accelerator *accel, int width, int height, const Camera &camera,
+	                    int threads = 0);
+
+	// order of tiles and samples used from the next Start() on
+	void SetOrder(PixelOrder order) { m_order = order; }
+
+	// From the next Start() on, path trace with the given number of samples
+	// per pixel, or ray trace in the Whitted style if it is 0. Relight()
+	// keeps the light's intensity, so moving it dims or brightens the scene.
+	void SetPathTracing(int samples) { m_pathSamples = std::max(samples, 0); }
+
+	// the sequence paths draw their numbers from, from the next Start() on
+	void SetSampler(SamplerType sampler) { m_sampler = sampler; }
+
+	// From the next Start() on, when path tracing, keeps adding paths to the
+	// tiles whose estimated error is highest once every pixel has its paths,
+	// until the given number of seconds from the start of the render, and
+	// stops in time for no tile to run past it; 0 renders the set number of
+	// paths and no more. Each restart is given the time afresh.
+	void SetTimeBudget(double seconds) { m_timeBudget = std::max(seconds, 0.0); }
+
+	// For each tile, row by row from the bottom, the paths traced through
+	// each of its pixels and the RMS standard error of their mean luminance,
+	// infinite below two paths; complete once Finished().
+	const std::vector<int>& TileSamples() const { return m_tileSamples; }
+	const std::vector<float>& TileErrors() const { return m_tileErrors; }
+
+	// From the next Start() on, when path tracing, resumes from the
+	// checkpoint in filename if it was taken of the same render, and writes
+	// one there at the end of every pass at least the given number of
+	// seconds after the last, and once every pixel has its paths. An empty
+	// filename stops checkpointing.
+	void SetCheckpoint(const std::string& filename, double seconds);
+
+	// the paths per pixel of the checkpoint the latest Start() resumed from,
+	// or 0 if it began afresh
+	int ResumedSamples() const { return m_resumedSamples; }
+
+	// blocks until every checkpoint taken has been written, returning false
+	// if the latest could not be
+	bool FlushCheckpoints() { return m_checkpoints.Flush(); }
+
+	// whether renders from the next Start() on are profiled
+	void SetProfiling(bool profiling) { m_profiling = profiling; }
+
+	// the profile of the latest render, complete once Finished()
+	const Profiler& Profile() const { return m_profiler; }
+
+	// Whether the primary rays of ray traced (not path traced) renders are
+	// handed to the accelerator in batches, which the BVH traces together to
+	// hide the time spent waiting on memory; the image is the same either
+	// way. Profiled renders trace each ray alone, so the time of each phase
+	// can be told apart.
+	void SetInterleaving(bool interleaving) { m_interleaving = interleaving; }
+
+	// From now on traces only the pixels in crop, leaving the rest of the
+	// image as it is, or the whole image if crop is empty. A render under
+	// way begins again at the coarsest resolution.
+	void Crop(const PixelRect &crop);
+
+	// abandon the pass in flight and begin again at the coarsest resolution
+	void Restart(const Camera &camera);
+
+	// like Restart(), for when only the scene's light has changed to light:
+	// pixels already traced are reshaded from their recorded primary hits
+	void Relight(const Light &light);
+
+	// Stops the workers while edit changes the scene or its BVH, then begins
+	// again at the coarsest resolution. edit returns true if it moved any
+	// surface, in which case the recorded primary hits are forgotten too.
+	void EditScene(const std::function<bool()> &edit);
+
+	// copies the tiles finished so far to the screen; call from the thread
+	// owning the OpenGL context
+	void Display();
+
+	// blocks until the image is fully refined
+	void Wait();
+
+	// cancels rendering and joins the workers
+	void Stop();
+
+	bool Finished() const { return m_finished; }
+
+	// the image rendered so far, row by row from the bottom
+	const std::vector<glm::vec3>& Pixels() const { return m_pixels; }
+};
+
+// --------------------------------------------------------------------------
+#endif // RENDER_H
@@ -0,0 +1,159 @@
+// ==========================================================================
+// Sample Sequences
+// ==========================================================================
+
+#include "Sampler.h"
+
+using namespace glm;
+using namespace std;
+
+static const char* const SAMPLER_NAMES[SAMPLER_TYPE_COUNT] = { "random", "sobol", "bluenoise" };
+
+// the columns of the generator matrix of the Sobol sequence's second
+// dimension, from the polynomial x + 1; the first is the bit-reversed index
+struct SobolMatrix
+{
+	uint32_t v[32];
+
+	SobolMatrix()
+	{
+		v[0] = 1u << 31;
+		for (int i = 1; i < 32; i++)
+			v[i] = v[i - 1] ^ (v[i - 1] >> 1);
+	}
+};
+
+static const SobolMatrix SOBOL;
+
+// --------------------------------------------------------------------------
+
+const char* samplerTypeName(SamplerType type)
+{
+	return SAMPLER_NAMES[type];
+}
+
+bool parseSamplerType(const string& name, SamplerType& type)
+{
+	for (int i = 0; i < SAMPLER_TYPE_COUNT; i++)
+		if (name == SAMPLER_NAMES[i]) {
+			type = SamplerType(i);
+			return true;
+		}
+	return false;
+}
+
+float gradientNoise(float x, float y)
+{
+	return fract(52.9829189f * fract(0.06711056f*x + 0.00583715f*y));
+}
+
+// --------------------------------------------------------------------------
+// Hashing and scrambling
+
+// Wellons' lowbias32, a bijection whose every input bit affects every output bit
+static uint32_t mix(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static uint32_t hashCombine(uint32_t seed, uint32_t value)
+{
+	return mix(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+static uint32_t pixelSeed(int x, int y)
+{
+	return hashCombine(mix(uint32_t(x)), uint32_t(y));
+}
+
+static uint32_t reverseBits(uint32_t x)
+{
+	x = (x << 16) | (x >> 16);
+	x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+	x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+	x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+	x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+	return x;
+}
+
+// Burley's variant of the Laine-Karras permutation: each bit is flipped
+// according to only the bits below it, so on reversed bits it is an Owen
+// scramble, each bit depending on those above it
+static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed)
+{
+	x = reverseBits(x);
+	x ^= x * 0x3d20adeau;
+	x += seed;
+	x *= (seed >> 16) | 1;
+	x ^= x * 0x05526c56u;
+	x ^= x * 0x53a22864u;
+	return reverseBits(x);
+}
+
+// Scrambled indices have random bits, so a branch on each would be
+// mispredicted half the time; the columns are masked in instead.
+static uint32_t sobol(uint32_t index, int dimension)
+{
+	if (dimension == 0)
+		return reverseBits(index);
+	uint32_t x = 0;
+	for (int bit = 0; bit < 32; bit++)
+		x ^= SOBOL.v[bit] & (0u - ((index >> bit) & 1));
+	return x;
+}
+
+// the top 24 bits, which a float holds exactly, so 1 is never reached
+static float toUnit(uint32_t x)
+{
+	return (x >> 8) * (1.f / 16777216.f);
+}
+
+// --------------------------------------------------------------------------
+// Samples
+
+// The seed of a dimension: of the pixel too unless every pixel shares one
+// sequence, as with blue noise. Shuffling the index by it keeps each power of
+// two run of samples stratified, but in an order of their own.
+static uint32_t dimensionSeed(SamplerType type, int x, int y, uint32_t dimension)
+{
+	return hashCombine(type == BLUE_NOISE_SAMPLER ? 0u : pixelSeed(x, y), dimension);
+}
+
+// the blue-noise shift of a dimension of pixel (x, y), varied between
+// dimensions by moving through the mask
+static float blueNoiseShift(int x, int y, uint32_t dimension, int axis)
+{
+	return gradientNoise(x + 5.588238f*dimension, y + 5.588238f*axis);
+}
+
+float sample1D(SamplerType type, int x, int y, uint32_t index, uint32_t dimension)
+{
+	uint32_t seed = dimensionSeed(type, x, y, dimension);
+	if (type == RANDOM_SAMPLER)
+		return toUnit(hashCombine(seed, index));
+
+	uint32_t shuffled = nestedUniformScramble(index, seed);
+	float u = toUnit(nestedUniformScramble(sobol(shuffled, 0), hashCombine(seed, 1)));
+	if (type == BLUE_NOISE_SAMPLER)
+		u = fract(u + blueNoiseShift(x, y, dimension, 0));
+	return u;
+}
+
+vec2 sample2D(SamplerType type, int x, int y, uint32_t index, uint32_t dimension)
+{
+	uint32_t seed = dimensionSeed(type, x, y, dimension);
+	if (type == RANDOM_SAMPLER)
+		return vec2(toUnit(hashCombine(seed, index)), toUnit(hashCombine(seed ^ 0x5bd1e995u, index)));
+
+	uint32_t shuffled = nestedUniformScramble(index, seed);
+	vec2 u(toUnit(nestedUniformScramble(sobol(shuffled, 0), hashCombine(seed, 1))),
+	       toUnit(nestedUniformScramble(sobol(shuffled, 1), hashCombine(seed, 2))));
+	if (type == BLUE_NOISE_SAMPLER)
+		u = fract(u + vec2(blueNoiseShift(x, y, dimension, 0), blueNoiseShift(x, y, dimension, 1)));
+	return u;
+}
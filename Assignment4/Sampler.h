@@ -0,0 +1,70 @@
+// ==========================================================================
+// Sample Sequences
+//
+// The numbers that stochastic rendering draws its samples from, given by
+// pixel, sample index and dimension, so any one can be found directly and a
+// render is the same however its pixels are split between threads.
+//
+// Random samples are hashes of the three, independent of each other. Sobol
+// samples follow Burley's hash-based Owen scrambling ("Practical Hash-based
+// Owen Scrambling", 2020): every dimension, or pair of dimensions, takes the
+// first two dimensions of the Sobol sequence, scrambled and shuffled by a
+// seed of its own and the pixel's. The first n samples of any pixel are then
+// stratified as well as n points can be, in each pair, so error falls
+// faster than with random samples. Blue-noise samples share one scrambled
+// sequence between all pixels, shifted in each pixel by a value from a
+// blue-noise mask, so that what error is left shows as fine grain rather
+// than blotches.
+// ==========================================================================
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <string>
+#include <stdint.h>
+#include <glm/glm.hpp>
+
+// --------------------------------------------------------------------------
+
+enum SamplerType
+{
+	RANDOM_SAMPLER,
+	SOBOL_SAMPLER,
+	BLUE_NOISE_SAMPLER,
+	SAMPLER_TYPE_COUNT
+};
+
+// name of a sampler as given on the command line
+const char* samplerTypeName(SamplerType type);
+
+// sets type to the one called name, returning false if there is none
+bool parseSamplerType(const std::string& name, SamplerType& type);
+
+// Jimenez's interleaved gradient noise: one value per pixel, distributed so
+// that neighbouring pixels differ like blue noise
+float gradientNoise(float x, float y);
+
+// The given dimension of the index'th sample of pixel (x, y), uniform in
+// [0, 1). sample2D() takes a pair of dimensions as one, stratified jointly,
+// where sample1D() would stratify each alone.
+float sample1D(SamplerType type, int x, int y, uint32_t index, uint32_t dimension);
+glm::vec2 sample2D(SamplerType type, int x, int y, uint32_t index, uint32_t dimension);
+
+// The values of one sample of a pixel, handed out a dimension at a time.
+class PixelSampler
+{
+	SamplerType m_type;
+	int         m_x, m_y;
+	uint32_t    m_index;
+	uint32_t    m_dimension;
+
+public:
+	PixelSampler(SamplerType type, int x, int y, uint32_t index)
+		: m_type(type), m_x(x), m_y(y), m_index(index), m_dimension(0)
+	{}
+
+	float Get1D() { return sample1D(m_type, m_x, m_y, m_index, m_dimension++); }
+	glm::vec2 Get2D() { return sample2D(m_type, m_x, m_y, m_index, m_dimension++); }
+};
+
+// --------------------------------------------------------------------------
+#endif // SAMPLER_H
@@ -0,0 +1,547 @@
+// ==========================================================================
+// Ray Tracing Scene Description
+//
+// Intersection routines for planes, spheres and triangles, the geometry of
+// the three assignment scenes, and the scene file reader.
+// ==========================================================================
+
+#include "Scene.h"
+
+#include <math.h>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <glm/gtc/constants.hpp>
+
+using namespace glm;
+using namespace std;
+
+// hits closer than this (in units of the ray parameter t) are ignored
+static const float EPSILON = 1e-4f;
+
+// --------------------------------------------------------------------------
+
+bool intersectSphere(const Sphere& sp, const vec3& o, const vec3& d, float& t) {
+	vec3 oc(o - sp.c);
+	float A = dot(d, d);
+	float B = 2*dot(d, oc);
+	float C = dot(oc, oc) - sp.r*sp.r;
+
+	float quad = B*B - 4*A*C;
+	if (quad < 0) {
+		return false;
+	}
+
+	// take the nearer root unless it lies behind the ray origin
+	t = (-B - sqrt(quad))/(2*A);
+	if (t <= EPSILON)
+		t = (-B + sqrt(quad))/(2*A);
+	return t > EPSILON;
+}
+
+bool intersectPlane(const Plane& pl, const vec3& o, const vec3& d, float& t) {
+	float t1 = dot((pl.p-o), pl.n);
+	float t2 = dot(d, pl.n);
+
+	if (t2 == 0)
+		return false;
+	t = t1/t2;
+	return t > EPSILON;
+}
+
+// Moller and Trumbore's test, which finds t and the barycentric coordinates
+// together without needing the triangle's plane
+bool intersectTriangle(const Triangle& tr, const vec3& o, const vec3& d, float& t) {
+	vec3 pvec(cross(d, tr.e2));
+	float det = dot(tr.e1, pvec);
+	if (det == 0)
+		return false;
+	float invDet = 1 / det;
+
+	vec3 tvec(o - tr.p0);
+	float u = dot(tvec, pvec) * invDet;
+	if (u < 0 || u > 1)
+		return false;
+
+	vec3 qvec(cross(tvec, tr.e1));
+	float v = dot(d, qvec) * invDet;
+	if (v < 0 || u + v > 1)
+		return false;
+
+	t = dot(tr.e2, qvec) * invDet;
+	return t > EPSILON;
+}
+
+vec3 samplePointOnLight(const Light& light, float s, float t, const vec3& x) {
+	if (light.shape == RECT_LIGHT)
+		return light.p + (s - 0.5f)*light.u + (t - 0.5f)*light.v;
+	if (light.shape == POINT_LIGHT)
+		return light.p;
+
+	// Shirley's concentric map from the square to the disc keeps strata
+	// compact, then the disc is turned to face x
+	float a = 2*s - 1;
+	float b = 2*t - 1;
+	float r, phi;
+	if (a == 0 && b == 0) {
+		r = 0;
+		phi = 0;
+	}
+	else if (a*a > b*b) {
+		r = a;
+		phi = quarter_pi<float>() * (b/a);
+	}
+	else {
+		r = b;
+		phi = half_pi<float>() - quarter_pi<float>() * (a/b);
+	}
+
+	vec3 w(normalize(x - light.p));
+	vec3 e1(normalize(cross(fabs(w.x) > 0.9f ? vec3(0, 1, 0) : vec3(1, 0, 0), w)));
+	vec3 e2(cross(w, e1));
+	return light.p + light.radius * r * (cos(phi)*e1 + sin(phi)*e2);
+}
+
+void primitiveBounds(const Scene& scene, uint32_t prim, vec3& lower, vec3& upper) {
+	if (prim < scene.spheres.size()) {
+		const Sphere& sp = scene.spheres[prim];
+		lower = sp.c - vec3(sp.r);
+		upper = sp.c + vec3(sp.r);
+	}
+	else {
+		const Triangle& tr = scene.triangles[prim - scene.spheres.size()];
+		vec3 p1(tr.p0 + tr.e1);
+		vec3 p2(tr.p0 + tr.e2);
+		lower = min(tr.p0, min(p1, p2));
+		upper = max(tr.p0, max(p1, p2));
+	}
+}
+
+bool intersectPrimitive(const Scene& scene, uint32_t prim, const vec3& o, const vec3& d, float& dist) {
+	float t;
+	bool hit;
+	if (prim < scene.spheres.size())
+		hit = intersectSphere(scene.spheres[prim], o, d, t);
+	else
+		hit = intersectTriangle(scene.triangles[prim - scene.spheres.size()], o, d, t);
+	if (!hit || t >= dist)
+		return false;
+	dist = t;
+	return true;
+}
+
+void completeHit(const Scene& scene, const vec3& o, const vec3& d, SurfaceHit& hit) {
+	hit.p = o + hit.dist*d;
+	if (hit.prim < scene.spheres.size()) {
+		hit.n = hit.p - scene.spheres[hit.prim].c;
+	}
+	else {
+		const Triangle& tr = scene.triangles[hit.prim - scene.spheres.size()];
+		hit.n = cross(tr.e1, tr.e2);
+	}
+	const Material& m = scene.materials[hit.prim];
+	hit.colour = m.colour;
+	hit.reflectivity = m.reflectivity;
+}
+
+Material primitiveMaterial(const Scene& scene, uint32_t prim) {
+	uint32_t bounded = boundedPrimitiveCount(scene);
+	if (prim < bounded)
+		return scene.materials[prim];
+	const Plane& pl = scene.planes[prim - bounded];
+	Material m = { pl.colour, pl.reflectivity };
+	return m;
+}
+
+// --------------------------------------------------------------------------
+// Scene construction. Primitives are gathered into vectors first and then
+// copied into one block of the scene's arena once their counts are known.
+
+struct SceneBuilder {
+	Light light;
+	vector<Plane> planes;
+	vector<Sphere> spheres;
+	vector<Triangle> triangles;
+
+	// kept apart until committed, when they are joined in primitive id order
+	vector<Material> sphereMaterials;
+	vector<Material> triangleMaterials;
+};
+
+void Scene::Clear() {
+	planes = ArenaArray<Plane>();
+	spheres = ArenaArray<Sphere>();
+	triangles = ArenaArray<Triangle>();
+	materials = ArenaArray<Material>();
+	arena.Release();
+}
+
+void Scene::Swap(Scene& other) {
+	std::swap(light, other.light);
+	std::swap(planes, other.planes);
+	std::swap(spheres, other.spheres);
+	std::swap(triangles, other.triangles);
+	std::swap(materials, other.materials);
+	arena.Swap(other.arena);
+}
+
+static void commitScene(SceneBuilder& builder, Scene& scene) {
+	scene.Clear();
+	scene.light = builder.light;
+	scene.arena.Reserve(builder.planes.size()*sizeof(Plane) + builder.spheres.size()*sizeof(Sphere)
+		+ builder.triangles.size()*sizeof(Triangle)
+		+ (builder.spheres.size() + builder.triangles.size())*sizeof(Material) + 4*alignof(std::max_align_t));
+	scene.planes = scene.arena.Copy(builder.planes);
+	scene.spheres = scene.arena.Copy(builder.spheres);
+	scene.triangles = scene.arena.Copy(builder.triangles);
+
+	vector<Material>& materials = builder.sphereMaterials;
+	materials.insert(materials.end(), builder.triangleMaterials.begin(), builder.triangleMaterials.end());
+	scene.materials = scene.arena.Copy(materials);
+}
+
+static void addPlane(SceneBuilder& scene, vec3 n, vec3 p, vec3 colour, float reflectivity = 0) {
+	Plane pl;
+	pl.n = n;
+	pl.p = p;
+	pl.colour = colour;
+	pl.reflectivity = reflectivity;
+	scene.planes.push_back(pl);
+}
+
+static void addSphere(SceneBuilder& scene, vec3 c, float r, vec3 colour, float reflectivity = 0) {
+	Sphere sp;
+	sp.c = c;
+	sp.r = r;
+	scene.spheres.push_back(sp);
+	scene.sphereMaterials.push_back({colour, reflectivity});
+}
+
+static void addTriangle(SceneBuilder& scene, vec3 p0, vec3 p1, vec3 p2, vec3 colour, float reflectivity = 0) {
+	Triangle tr;
+	tr.p0 = p0;
+	tr.e1 = p1 - p0;
+	tr.e2 = p2 - p0;
+	scene.triangles.push_back(tr);
+	scene.triangleMaterials.push_back({colour, reflectivity});
+}
+
+static void buildScene1(SceneBuilder& scene) {
+	scene.light.p = {0, 2.5, -7.75};
+
+	// Back wall
+	addPlane(scene, {0, 0, 1}, {0, 0, -10.5}, {0.5, 0.5, 0.5});
+
+	// Reflective grey sphere
+	addSphere(scene, {0.9, -1.925, -6.69}, 0.825, {0.5, 0.5, 0.5}, 0.5);
+
+	// Blue pyramid
+	vec3 blue(0, 0, 0.7);
+	addTriangle(scene, {-0.4, -2.75, -9.55}, {-0.93, 0.55, -8.51}, {0.11, -2.75, -7.98}, blue, 0.5);
+	addTriangle(scene, {0.11, -2.75, -7.98}, {-0.93, 0.55, -8.51}, {-1.46, -2.75, -7.47}, blue, 0.5);
+	addTriangle(scene, {-1.46, -2.75, -7.47}, {-0.93, 0.55, -8.51}, {-1.97, -2.75, -9.04}, blue, 0.5);
+	addTriangle(scene, {-1.97, -2.75, -9.04}, {-0.93, 0.55, -8.51}, {-0.4, -2.75, -9.55}, blue, 0.5);
+
+	// Ceiling
+	vec3 grey(0.3, 0.3, 0.3);
+	addTriangle(scene, {2.75, 2.75, -10.5}, {2.75, 2.75, -5}, {-2.75, 2.75, -5}, grey);
+	addTriangle(scene, {-2.75, 2.75, -10.5}, {2.75, 2.75, -10.5}, {-2.75, 2.75, -5}, grey);
+
+	// Green wall on right
+	vec3 green(0, 0.5, 0);
+	addTriangle(scene, {2.75, 2.75, -5}, {2.75, 2.75, -10.5}, {2.75, -2.75, -10.5}, green);
+	addTriangle(scene, {2.75, -2.75, -5}, {2.75, 2.75, -5}, {2.75, -2.75, -10.5}, green);
+
+	// Red wall on left
+	vec3 red(0.5, 0, 0);
+	addTriangle(scene, {-2.75, -2.75, -5}, {-2.75, -2.75, -10.5}, {-2.75, 2.75, -10.5}, red);
+	addTriangle(scene, {-2.75, 2.75, -5}, {-2.75, -2.75, -5}, {-2.75, 2.75, -10.5}, red);
+
+	// Floor
+	addTriangle(scene, {2.75, -2.75, -5}, {2.75, -2.75, -10.5}, {-2.75, -2.75, -10.5}, grey);
+	addTriangle(scene, {-2.75, -2.75, -5}, {2.75, -2.75, -5}, {-2.75, -2.75, -10.5}, grey);
+}
+
+static void buildScene2(SceneBuilder& scene) {
+	scene.light.p = {4, 6, 1};
+
+	// Floor and back wall
+	addPlane(scene, {0, 1, 0}, {0, -1, 0}, {0.5, 0.5, 0.5});
+	addPlane(scene, {0, 0, 1}, {0, 0, -12}, {0, 0.5, 0.5});
+
+	// Large yellow sphere, reflective grey sphere, metallic purple sphere
+	addSphere(scene, {1, -0.5, -3.5}, 0.5, {0.5, 0.5, 0});
+	addSphere(scene, {0, 1, -5}, 0.4, {0.5, 0.5, 0.5}, 0.5);
+	addSphere(scene, {-0.8, -0.75, -4}, 0.25, {0.5, 0, 0.5}, 0.5);
+
+	// Green cone
+	vec3 green(0, 0.7, 0);
+	vec3 apex(0, 0.6, -5);
+	addTriangle(scene, {0, -1, -5.8}, apex, {0.4, -1, -5.693}, green);
+	addTriangle(scene, {0.4, -1, -5.693}, apex, {0.6928, -1, -5.4}, green);
+	addTriangle(scene, {0.6928, -1, -5.4}, apex, {0.8, -1, -5}, green);
+	addTriangle(scene, {0.8, -1, -5}, apex, {0.6928, -1, -4.6}, green);
+	addTriangle(scene, {0.6928, -1, -4.6}, apex, {0.4, -1, -4.307}, green);
+	addTriangle(scene, {0.4, -1, -4.307}, apex, {0, -1, -4.2}, green);
+	addTriangle(scene, {0, -1, -4.2}, apex, {-0.4, -1, -4.307}, green);
+	addTriangle(scene, {-0.4, -1, -4.307}, apex, {-0.6928, -1, -4.6}, green);
+	addTriangle(scene, {-0.6928, -1, -4.6}, apex, {-0.8, -1, -5}, green);
+	addTriangle(scene, {-0.8, -1, -5}, apex, {-0.6928, -1, -5.4}, green);
+	addTriangle(scene, {-0.6928, -1, -5.4}, apex, {-0.4, -1, -5.693}, green);
+	addTriangle(scene, {-0.4, -1, -5.693}, apex, {0, -1, -5.8}, green);
+
+	// Shiny red icosahedron
+	vec3 red(0.7, 0, 0);
+	float shine = 0.5;
+	addTriangle(scene, {-2, -1, -7}, {-1.276, -0.4472, -6.474}, {-2.276, -0.4472, -6.149}, red, shine);
+	addTriangle(scene, {-1.276, -0.4472, -6.474}, {-2, -1, -7}, {-1.276, -0.4472, -7.526}, red, shine);
+	addTriangle(scene, {-2, -1, -7}, {-2.276, -0.4472, -6.149}, {-2.894, -0.4472, -7}, red, shine);
+	addTriangle(scene, {-2, -1, -7}, {-2.894, -0.4472, -7}, {-2.276, -0.4472, -7.851}, red, shine);
+	addTriangle(scene, {-2, -1, -7}, {-2.276, -0.4472, -7.851}, {-1.276, -0.4472, -7.526}, red, shine);
+	addTriangle(scene, {-1.276, -0.4472, -6.474}, {-1.276, -0.4472, -7.526}, {-1.106, 0.4472, -7}, red, shine);
+	addTriangle(scene, {-2.276, -0.4472, -6.149}, {-1.276, -0.4472, -6.474}, {-1.724, 0.4472, -6.149}, red, shine);
+	addTriangle(scene, {-2.894, -0.4472, -7}, {-2.276, -0.4472, -6.149}, {-2.724, 0.4472, -6.474}, red, shine);
+	addTriangle(scene, {-2.276, -0.4472, -7.851}, {-2.894, -0.4472, -7}, {-2.724, 0.4472, -7.526}, red, shine);
+	addTriangle(scene, {-1.276, -0.4472, -7.526}, {-2.276, -0.4472, -7.851}, {-1.724, 0.4472, -7.851}, red, shine);
+	addTriangle(scene, {-1.276, -0.4472, -6.474}, {-1.106, 0.4472, -7}, {-1.724, 0.4472, -6.149}, red, shine);
+	addTriangle(scene, {-2.276, -0.4472, -6.149}, {-1.724, 0.4472, -6.149}, {-2.724, 0.4472, -6.474}, red, shine);
+	addTriangle(scene, {-2.894, -0.4472, -7}, {-2.724, 0.4472, -6.474}, {-2.724, 0.4472, -7.526}, red, shine);
+	addTriangle(scene, {-2.276, -0.4472, -7.851}, {-2.724, 0.4472, -7.526}, {-1.724, 0.4472, -7.851}, red, shine);
+	addTriangle(scene, {-1.276, -0.4472, -7.526}, {-1.724, 0.4472, -7.851}, {-1.106, 0.4472, -7}, red, shine);
+	addTriangle(scene, {-1.724, 0.4472, -6.149}, {-1.106, 0.4472, -7}, {-2, 1, -7}, red, shine);
+	addTriangle(scene, {-2.724, 0.4472, -6.474}, {-1.724, 0.4472, -6.149}, {-2, 1, -7}, red, shine);
+	addTriangle(scene, {-2.724, 0.4472, -7.526}, {-2.724, 0.4472, -6.474}, {-2, 1, -7}, red, shine);
+	addTriangle(scene, {-1.724, 0.4472, -7.851}, {-2.724, 0.4472, -7.526}, {-2, 1, -7}, red, shine);
+	addTriangle(scene, {-1.106, 0.4472, -7}, {-1.724, 0.4472, -7.851}, {-2, 1, -7}, red, shine);
+}
+
+// a poorly drawn cookie monster
+static void buildScene3(SceneBuilder& scene) {
+	scene.light.p = {1, 1, -12};
+
+	addPlane(scene, {0, 0, 1}, {0, 0, -10.5}, {0.5, 0, 0.5});
+
+	vec3 blue(0, 0, 0.5);
+	vec3 white(0.5, 0.5, 0.5);
+	vec3 black(0, 0, 0);
+	addSphere(scene, {0.8, -0.8, -3.5}, 1, blue);		// head
+	addSphere(scene, {1.1, -3.5, -3.5}, 2, blue);		// body
+	addSphere(scene, {0.9, 0.1, -3.1}, 0.2, white);		// eyes
+	addSphere(scene, {0.5, 0.1, -3.1}, 0.2, white);
+	addSphere(scene, {0.78, 0.15, -2.8}, 0.08, black);	// pupils
+	addSphere(scene, {0.5, 0.05, -2.9}, 0.08, black);
+
+	// mouth
+	addTriangle(scene, {-0.2, -0.8, -3.1}, {1.8, -0.8, -3.1}, {0.7, -1.4, -3.1}, black);
+	addTriangle(scene, {-0.2, -0.8, -3.1}, {1.8, -0.8, -3.1}, {0.7, -0.4, -3.1}, black);
+}
+
+bool BuildScene(int number, Scene& scene) {
+	SceneBuilder builder;
+	if (number == 1)
+		buildScene1(builder);
+	else if (number == 2)
+		buildScene2(builder);
+	else if (number == 3)
+		buildScene3(builder);
+	else
+		return false;
+	commitScene(builder, scene);
+	return true;
+}
+
+// --------------------------------------------------------------------------
+// Edits
+
+// Primitives are compared field by field, so padding plays no part; a value
+// that parses the same compares equal.
+static bool sameLight(const Light& a, const Light& b) {
+	return a.p == b.p && a.shape == b.shape && a.radius == b.radius && a.u == b.u && a.v == b.v;
+}
+
+static bool samePlane(const Plane& a, const Plane& b) {
+	return a.p == b.p && a.n == b.n && a.colour == b.colour && a.reflectivity == b.reflectivity;
+}
+
+static bool sameSphere(const Sphere& a, const Sphere& b) {
+	return a.c == b.c && a.r == b.r;
+}
+
+static bool sameTriangle(const Triangle& a, const Triangle& b) {
+	return a.p0 == b.p0 && a.e1 == b.e1 && a.e2 == b.e2;
+}
+
+static bool sameMaterial(const Material& a, const Material& b) {
+	return a.colour == b.colour && a.reflectivity == b.reflectivity;
+}
+
+bool applySceneEdits(Scene& scene, const Scene& edited, SceneChanges& changes) {
+	if (edited.planes.size() != scene.planes.size() || edited.spheres.size() != scene.spheres.size()
+		|| edited.triangles.size() != scene.triangles.size())
+		return false;
+
+	if (!sameLight(scene.light, edited.light)) {
+		int samples = scene.light.samples;
+		scene.light = edited.light;
+		scene.light.samples = samples;
+		changes.light = true;
+	}
+	for (size_t i = 0; i < scene.planes.size(); i++)
+		if (!samePlane(scene.planes[i], edited.planes[i])) {
+			scene.planes[i] = edited.planes[i];
+			changes.planes = true;
+		}
+	for (uint32_t i = 0; i < scene.spheres.size(); i++)
+		if (!sameSphere(scene.spheres[i], edited.spheres[i])) {
+			scene.spheres[i] = edited.spheres[i];
+			changes.moved.push_back(i);
+		}
+	uint32_t firstTriangle = uint32_t(scene.spheres.size());
+	for (uint32_t i = 0; i < scene.triangles.size(); i++)
+		if (!sameTriangle(scene.triangles[i], edited.triangles[i])) {
+			scene.triangles[i] = edited.triangles[i];
+			changes.moved.push_back(firstTriangle + i);
+		}
+	for (size_t i = 0; i < scene.materials.size(); i++)
+		if (!sameMaterial(scene.materials[i], edited.materials[i])) {
+			scene.materials[i] = edited.materials[i];
+			changes.materials++;
+		}
+	return true;
+}
+
+// --------------------------------------------------------------------------
+// Scene file parsing
+
+// reads count numbers enclosed in braces into values
+static bool readBlock(ifstream& input, float* values, int count) {
+	string brace;
+	if (!(input >> brace) || brace != "{")
+		return false;
+	for (int i = 0; i < count; i++)
+		if (!(input >> values[i]))
+			return false;
+	return (input >> brace) && brace == "}";
+}
+
+bool readSceneFile(const string& filename, SceneFileSink& sink, Light& light) {
+	ifstream input(filename.c_str());
+	if (!input) {
+		cout << "ERROR: Could not load scene from file " << filename << endl;
+		return false;
+	}
+
+	Light parsed;
+	Material material = { vec3(0.5, 0.5, 0.5), 0 };
+
+	string keyword;
+	float v[9];
+	while (input >> keyword) {
+		bool ok = true;
+		if (keyword[0] == '#') {
+			getline(input, keyword);
+			continue;
+		}
+		else if (keyword == "light") {
+			ok = readBlock(input, v, 3);
+			parsed.p = vec3(v[0], v[1], v[2]);
+			parsed.shape = POINT_LIGHT;
+		}
+		else if (keyword == "sphere") {
+			ok = readBlock(input, v, 4);
+			Sphere sp;
+			sp.c = vec3(v[0], v[1], v[2]);
+			sp.r = v[3];
+			if (ok)
+				sink.AddSphere(sp, material);
+		}
+		else if (keyword == "plane") {
+			ok = readBlock(input, v, 6);
+			Plane pl;
+			pl.n = vec3(v[0], v[1], v[2]);
+			pl.p = vec3(v[3], v[4], v[5]);
+			pl.colour = material.colour;
+			pl.reflectivity = material.reflectivity;
+			if (ok)
+				sink.AddPlane(pl);
+		}
+		else if (keyword == "triangle") {
+			ok = readBlock(input, v, 9);
+			Triangle tr;
+			tr.p0 = vec3(v[0], v[1], v[2]);
+			tr.e1 = vec3(v[3], v[4], v[5]) - tr.p0;
+			tr.e2 = vec3(v[6], v[7], v[8]) - tr.p0;
+			if (ok)
+				sink.AddTriangle(tr, material);
+		}
+		else if (keyword == "spherelight") {
+			ok = readBlock(input, v, 4);
+			parsed.p = vec3(v[0], v[1], v[2]);
+			parsed.shape = SPHERE_LIGHT;
+			parsed.radius = v[3];
+		}
+		else if (keyword == "rectlight") {
+			ok = readBlock(input, v, 9);
+			parsed.p = vec3(v[0], v[1], v[2]);
+			parsed.shape = RECT_LIGHT;
+			parsed.u = vec3(v[3], v[4], v[5]);
+			parsed.v = vec3(v[6], v[7], v[8]);
+		}
+		else if (keyword == "material") {
+			ok = readBlock(input, v, 4);
+			material.colour = vec3(v[0], v[1], v[2]);
+			material.reflectivity = v[3];
+		}
+		else {
+			ok = false;
+		}
+
+		if (!ok) {
+			cout << "ERROR: Malformed " << keyword << " in scene file " << filename << endl;
+			return false;
+		}
+	}
+
+	light = parsed;
+	return true;
+}
+
+namespace {
+	// gathers a scene file's primitives into a SceneBuilder
+	class BuilderSink : public SceneFileSink
+	{
+		SceneBuilder& m_builder;
+
+	public:
+		explicit BuilderSink(SceneBuilder& builder) : m_builder(builder)
+		{}
+
+		void AddPlane(const Plane& plane) override
+		{
+			m_builder.planes.push_back(plane);
+		}
+
+		void AddSphere(const Sphere& sphere, const Material& material) override
+		{
+			m_builder.spheres.push_back(sphere);
+			m_builder.sphereMaterials.push_back(material);
+		}
+
+		void AddTriangle(const Triangle& triangle, const Material& material) override
+		{
+			m_builder.triangles.push_back(triangle);
+			m_builder.triangleMaterials.push_back(material);
+		}
+	};
+}
+
+bool LoadScene(const string& filename, Scene& scene) {
+	SceneBuilder builder;
+	BuilderSink sink(builder);
+	if (!readSceneFile(filename, sink, builder.light))
+		return false;
+
+	commitScene(builder, scene);
+	return true;
+}
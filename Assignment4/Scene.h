@@ -0,0 +1,184 @@
+// ==========================================================================
+// Ray Tracing Scene Description
+//
+// This module defines the primitives our ray tracer understands (planes,
+// spheres and triangles), the point light that illuminates them, and a
+// Scene container that holds one list of each. The assignment scenes are
+// built in code by BuildScene(), and other scenes are read from text files
+// (see Scenes/scene1.txt for the format) by LoadScene(). All objects are
+// expressed in world coordinates, which coincide with the initial camera
+// frame.
+// ==========================================================================
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <glm/glm.hpp>
+#include "Arena.h"
+
+// --------------------------------------------------------------------------
+// Primitives. Spheres and triangles hold only what intersection needs, so
+// that traversal touches as few cache lines as possible; their colour and
+// reflectivity live in a separate Material array indexed by primitive id
+// (see boundedPrimitiveCount below), read once for the nearest hit.
+
+struct Plane {
+	glm::vec3 p;
+	glm::vec3 n;
+	glm::vec3 colour;
+	float reflectivity;
+};
+
+enum LightShape { POINT_LIGHT, SPHERE_LIGHT, RECT_LIGHT };
+
+// A point light at p, or an area light centred there: a sphere of the given
+// radius, or the rectangle p + s*u + t*v for s, t in [-1/2, 1/2]. Area lights
+// cast up to `samples` shadow rays per shaded point, rounded down to a square
+// number, and at least 4.
+struct Light {
+	glm::vec3 p;
+	glm::vec3 r;
+	float intensity;
+
+	LightShape shape;
+	float radius;
+	glm::vec3 u;
+	glm::vec3 v;
+	int samples;
+
+	Light() : p(0), r(0), intensity(0), shape(POINT_LIGHT), radius(0), u(0), v(0), samples(16)
+	{}
+};
+
+// 16 bytes
+struct Sphere {
+	glm::vec3 c;
+	float r;
+};
+
+// 36 bytes: one corner and the two edges leaving it, counter-clockwise
+struct Triangle {
+	glm::vec3 p0;
+	glm::vec3 e1;
+	glm::vec3 e2;
+};
+
+struct Material {
+	glm::vec3 colour;
+	float reflectivity;
+};
+
+// everything the tracer needs to shade one image
+struct Scene {
+	Light light;
+	ArenaArray<Plane> planes;
+	ArenaArray<Sphere> spheres;
+	ArenaArray<Triangle> triangles;
+	ArenaArray<Material> materials;		// per bounded primitive id
+
+	// owns the primitive arrays and anything built over them, so tearing the
+	// scene down is a single release
+	Arena arena;
+
+	void Clear();
+
+	// exchanges the contents of the two scenes, arenas included
+	void Swap(Scene& other);
+};
+
+// --------------------------------------------------------------------------
+// Ray-primitive intersection. The ray is o + t*d; each routine returns true
+// and sets t if the ray hits beyond a small epsilon, so rays leaving a surface
+// do not hit it again.
+
+bool intersectSphere(const Sphere& sp, const glm::vec3& o, const glm::vec3& d, float& t);
+bool intersectPlane(const Plane& pl, const glm::vec3& o, const glm::vec3& d, float& t);
+bool intersectTriangle(const Triangle& tr, const glm::vec3& o, const glm::vec3& d, float& t);
+
+// maps s, t in [0,1) to a point on light, as seen from x; for sphere lights
+// this is the disc facing x
+glm::vec3 samplePointOnLight(const Light& light, float s, float t, const glm::vec3& x);
+
+// the nearest surface along a ray: its distance and primitive id, then, once
+// completeHit() has been called, what shading needs to know about it
+struct SurfaceHit {
+	float dist;
+	uint32_t prim;
+	glm::vec3 p;
+	glm::vec3 n;
+	glm::vec3 colour;
+	float reflectivity;
+};
+
+// Primitives with finite bounds are numbered spheres first, then triangles;
+// planes come after them, so that every primitive has an id.
+inline uint32_t boundedPrimitiveCount(const Scene& scene) {
+	return uint32_t(scene.spheres.size() + scene.triangles.size());
+}
+
+// the material of any primitive, planes included
+Material primitiveMaterial(const Scene& scene, uint32_t prim);
+void primitiveBounds(const Scene& scene, uint32_t prim, glm::vec3& lower, glm::vec3& upper);
+
+// tests bounded primitive prim, returning true and updating dist if it is hit
+// nearer than dist
+bool intersectPrimitive(const Scene& scene, uint32_t prim, const glm::vec3& o, const glm::vec3& d, float& dist);
+
+// fills in the position, normal and material of a hit on bounded primitive
+// hit.prim at hit.dist along o + t*d
+void completeHit(const Scene& scene, const glm::vec3& o, const glm::vec3& d, SurfaceHit& hit);
+
+// fills scene with assignment scene 1, 2 or 3; returns false for any other
+bool BuildScene(int number, Scene& scene);
+
+// fills scene from a scene file, returning false if it cannot be read. Besides
+// light, sphere, plane and triangle, files may contain
+//      material  { r g b  reflectivity }
+//      spherelight { x y z  radius }
+//      rectlight { x y z  ux uy uz  vx vy vz }
+// Materials apply to every object after them (the default is matte grey);
+// the area lights replace the point light, centred on x y z.
+bool LoadScene(const std::string& filename, Scene& scene);
+
+// receives the primitives of a scene file one at a time from readSceneFile()
+class SceneFileSink
+{
+public:
+	virtual ~SceneFileSink() {}
+	virtual void AddPlane(const Plane& plane) = 0;
+	virtual void AddSphere(const Sphere& sphere, const Material& material) = 0;
+	virtual void AddTriangle(const Triangle& triangle, const Material& material) = 0;
+};
+
+// Reads a scene file as LoadScene() does, but hands each primitive to sink
+// as soon as it is read, keeping none of them, and sets light once the whole
+// file has been read, so that files larger than memory can be processed.
+// Returns false if the file cannot be read.
+bool readSceneFile(const std::string& filename, SceneFileSink& sink, Light& light);
+
+// --------------------------------------------------------------------------
+// Edits
+
+// what applySceneEdits() changed
+struct SceneChanges {
+	bool light;
+	bool planes;                    // any plane, in shape or material
+	uint32_t materials;             // bounded primitives given a new material
+	std::vector<uint32_t> moved;    // bounded primitives whose shape changed
+
+	SceneChanges() : light(false), planes(false), materials(0)
+	{}
+};
+
+// Brings scene up to date with edited, a newer version of the same scene
+// holding as many planes, spheres and triangles, by copying over just the
+// light, primitives and materials that differ and recording them in changes.
+// Returns false, leaving scene alone, if the counts differ, in which case
+// edited must replace scene instead. The number of shadow samples is kept,
+// since it is not part of the scene file.
+bool applySceneEdits(Scene& scene, const Scene& edited, SceneChanges& changes);
+
+// --------------------------------------------------------------------------
+#endif // SCENE_H
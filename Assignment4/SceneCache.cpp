@@ -0,0 +1,919 @@
+// ==========================================================================
+// Scene Cache
+// ==========================================================================
+
+#include "SceneCache.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+// --------------------------------------------------------------------------
+
+MappedFile::MappedFile()
+	: m_data(0), m_size(0)
+#ifdef _WIN32
+	, m_file(INVALID_HANDLE_VALUE), m_mapping(0)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const string& filename)
+{
+	Close();
+	m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, 0,
+	                     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (m_file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) {
+		Close();
+		return false;
+	}
+	m_mapping = CreateFileMappingA(m_file, 0, PAGE_READONLY, 0, 0, 0);
+	if (m_mapping)
+		m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+	if (!m_data) {
+		Close();
+		return false;
+	}
+	m_size = size_t(size.QuadPart);
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (m_data)
+		UnmapViewOfFile(m_data);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+	m_data = 0;
+	m_size = 0;
+	m_mapping = 0;
+	m_file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+bool MappedFile::Open(const string& filename)
+{
+	Close();
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	void* data = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+
+	m_data = static_cast<const char*>(data);
+	m_size = size_t(info.st_size);
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (m_data)
+		munmap(const_cast<char*>(m_data), m_size);
+	m_data = 0;
+	m_size = 0;
+}
+
+#endif
+
+void MappedFile::Swap(MappedFile& other)
+{
+	std::swap(m_data, other.m_data);
+	std::swap(m_size, other.m_size);
+#ifdef _WIN32
+	std::swap(m_file, other.m_file);
+	std::swap(m_mapping, other.m_mapping);
+#endif
+}
+
+// --------------------------------------------------------------------------
+// File layout: a header, then each section at a cache-line aligned offset.
+
+enum Section { PLANES, SPHERES, TRIANGLES, MATERIALS, NODES, PRIMS, CLUSTERS, SECTION_COUNT };
+
+static const char MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+static const size_t SECTION_ALIGN = 64;
+
+// sizes of everything stored, so a cache written by a build with a different
+// structure layout is rejected rather than misread
+static const uint32_t ELEMENT_SIZE[SECTION_COUNT] = {
+	sizeof(Plane), sizeof(Sphere), sizeof(Triangle), sizeof(Material), sizeof(BvhNode), sizeof(uint32_t),
+	sizeof(ClusterInfo)
+};
+
+struct CacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t lightSize;
+	uint32_t elementSize[SECTION_COUNT];
+	uint64_t sourceHash;
+	Light light;
+	uint64_t offset[SECTION_COUNT];
+	uint64_t count[SECTION_COUNT];
+	uint64_t residentNodes;     // nodes above and at the roots of clusters
+};
+
+// FNV-1a hash of a file's contents, returning false if it cannot be read
+static bool hashFile(const string& filename, uint64_t& hash) {
+	ifstream input(filename.c_str(), ios::binary);
+	if (!input)
+		return false;
+
+	hash = 14695981039346656037ull;
+	char buffer[1 << 16];
+	while (input.read(buffer, sizeof(buffer)) || input.gcount() > 0) {
+		for (streamsize i = 0; i < input.gcount(); i++) {
+			hash ^= uint8_t(buffer[i]);
+			hash *= 1099511628211ull;
+		}
+	}
+	return true;
+}
+
+static void fillHeader(CacheHeader& header, uint64_t sourceHash) {
+	header = CacheHeader();
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = SceneCache::VERSION;
+	header.lightSize = sizeof(Light);
+	memcpy(header.elementSize, ELEMENT_SIZE, sizeof(ELEMENT_SIZE));
+	header.sourceHash = sourceHash;
+}
+
+// --------------------------------------------------------------------------
+// Clustering
+
+// the scene and hierarchy as they are written to the cache
+struct ClusterLayout {
+	vector<BvhNode> nodes;
+	vector<uint32_t> prims;
+	vector<Triangle> triangles;
+	vector<Material> materials;
+	vector<ClusterInfo> clusters;
+	uint32_t residentNodes;
+};
+
+// Renumbers the hierarchy so that its top levels come first, breadth first,
+// and the subtrees below them (the largest holding at most CLUSTER_SIZE
+// primitives) follow one after another, each depth first with its
+// primitive list entries, triangles and materials in the same order. Sibling
+// nodes stay adjacent and spheres keep their ids.
+static void clusterLayout(const Scene& scene, const Bvh& bvh, ClusterLayout& out) {
+	const BvhNode* nodes = bvh.Nodes();
+	const uint32_t* prims = bvh.Prims();
+	uint32_t nodeCount = bvh.NodeCount();
+	uint32_t primCount = boundedPrimitiveCount(scene);
+	uint32_t sphereCount = uint32_t(scene.spheres.size());
+
+	out.nodes.assign(nodes, nodes + nodeCount);
+	out.prims.assign(prims, prims + primCount);
+	out.triangles.assign(scene.triangles.begin(), scene.triangles.end());
+	out.materials.assign(scene.materials.begin(), scene.materials.end());
+	out.clusters.clear();
+	out.residentNodes = nodeCount;
+	if (primCount == 0)
+		return;
+
+	// every subtree's primitives are a contiguous run of the primitive list,
+	// and children always come after their parent
+	vector<uint32_t> lo(nodeCount), hi(nodeCount);
+	for (uint32_t i = nodeCount; i-- > 0; ) {
+		const BvhNode& node = nodes[i];
+		lo[i] = node.count > 0 ? node.first : lo[node.first];
+		hi[i] = node.count > 0 ? node.first + node.count : hi[node.first + 1];
+	}
+
+	struct Placed {
+		uint32_t old;
+		uint32_t index;
+	};
+
+	vector<Placed> top(1, Placed{ 0, 0 });
+	vector<Placed> roots;
+	uint32_t next = 1;
+	for (size_t i = 0; i < top.size(); i++) {
+		Placed p = top[i];
+		BvhNode node = nodes[p.old];
+		if (node.count > 0 || hi[p.old] - lo[p.old] <= ClusterPager::CLUSTER_SIZE) {
+			roots.push_back(p);
+			continue;
+		}
+		top.push_back(Placed{ node.first, next });
+		top.push_back(Placed{ node.first + 1, next + 1 });
+		node.first = next;
+		next += 2;
+		out.nodes[p.index] = node;
+	}
+	out.residentNodes = next;
+
+	uint32_t primNext = 0, triNext = 0;
+	vector<Placed> pending;
+	for (const Placed& root : roots) {
+		ClusterInfo info;
+		info.root = root.index;
+		info.nodeFirst = next;
+		info.primFirst = primNext;
+		info.triFirst = triNext;
+
+		for (uint32_t k = lo[root.old]; k < hi[root.old]; k++) {
+			uint32_t id = prims[k];
+			if (id >= sphereCount) {
+				out.triangles[triNext] = scene.triangles[id - sphereCount];
+				out.materials[sphereCount + triNext] = scene.materials[id];
+				id = sphereCount + triNext++;
+			}
+			out.prims[primNext++] = id;
+		}
+
+		pending.assign(1, root);
+		while (!pending.empty()) {
+			Placed p = pending.back();
+			pending.pop_back();
+			BvhNode node = nodes[p.old];
+			if (node.count > 0) {
+				node.first = node.first - lo[root.old] + info.primFirst;
+			}
+			else {
+				pending.push_back(Placed{ node.first + 1, next + 1 });
+				pending.push_back(Placed{ node.first, next });
+				node.first = next;
+				next += 2;
+			}
+			out.nodes[p.index] = node;
+		}
+
+		info.nodeCount = next - info.nodeFirst;
+		info.primCount = primNext - info.primFirst;
+		info.triCount = triNext - info.triFirst;
+		out.clusters.push_back(info);
+	}
+}
+
+// --------------------------------------------------------------------------
+
+SceneCache::SceneCache()
+	: m_clusters(0), m_clusterCount(0), m_residentNodes(0)
+{
+}
+
+string SceneCache::CachePath(const string& sceneFile)
+{
+	return sceneFile + ".cache";
+}
+
+bool SceneCache::Load(const string& sceneFile, Scene& scene, Bvh& bvh)
+{
+	// the cache is checked in a mapping of its own, so that the scene keeps
+	// the old one if it turns out to be stale
+	uint64_t hash;
+	MappedFile file;
+	if (!hashFile(sceneFile, hash) || !file.Open(CachePath(sceneFile)))
+		return false;
+
+	CacheHeader expected;
+	fillHeader(expected, hash);
+
+	const char* data = file.Data();
+	const CacheHeader* header = reinterpret_cast<const CacheHeader*>(data);
+	if (file.Size() < sizeof(CacheHeader)
+		|| memcmp(header, &expected, offsetof(CacheHeader, light)) != 0)
+		return false;
+	for (int s = 0; s < SECTION_COUNT; s++) {
+		if (header->offset[s] % SECTION_ALIGN != 0 || header->offset[s] > file.Size()
+			|| header->count[s] > (file.Size() - header->offset[s]) / ELEMENT_SIZE[s])
+			return false;
+	}
+	m_file.Swap(file);
+
+	scene.Clear();
+	scene.light = header->light;
+	scene.planes.data = (Plane*)(data + header->offset[PLANES]);
+	scene.planes.count = header->count[PLANES];
+	scene.spheres.data = (Sphere*)(data + header->offset[SPHERES]);
+	scene.spheres.count = header->count[SPHERES];
+	scene.triangles.data = (Triangle*)(data + header->offset[TRIANGLES]);
+	scene.triangles.count = header->count[TRIANGLES];
+	scene.materials.data = (Material*)(data + header->offset[MATERIALS]);
+	scene.materials.count = header->count[MATERIALS];
+
+	bvh.Attach(scene, (const BvhNode*)(data + header->offset[NODES]), uint32_t(header->count[NODES]),
+		(const uint32_t*)(data + header->offset[PRIMS]));
+	m_clusters = (const ClusterInfo*)(data + header->offset[CLUSTERS]);
+	m_clusterCount = uint32_t(header->count[CLUSTERS]);
+	m_residentNodes = uint32_t(std::min<uint64_t>(header->residentNodes, header->count[NODES]));
+	for (uint32_t c = 0; c < m_clusterCount; c++) {
+		if (m_clusters[c].root >= m_residentNodes) {
+			m_clusterCount = 0;
+			break;
+		}
+	}
+	return true;
+}
+
+void SceneCache::Stream(const Scene& scene, Bvh& bvh, size_t budget)
+{
+	m_pager.Attach(scene, bvh.Nodes(), bvh.Prims(), m_clusters, m_clusterCount, m_residentNodes, budget);
+	bvh.SetPager(&m_pager);
+}
+
+bool SceneCache::Save(const string& sceneFile, const Scene& scene, const Bvh& bvh)
+{
+	uint64_t hash;
+	if (bvh.Lazy() || !hashFile(sceneFile, hash))
+		return false;
+
+	ClusterLayout layout;
+	clusterLayout(scene, bvh, layout);
+
+	CacheHeader header;
+	fillHeader(header, hash);
+	header.light = scene.light;
+	header.residentNodes = layout.residentNodes;
+
+	const void* sections[SECTION_COUNT] = {
+		scene.planes.data, scene.spheres.data, layout.triangles.data(), layout.materials.data(),
+		layout.nodes.data(), layout.prims.data(), layout.clusters.data()
+	};
+	header.count[PLANES] = scene.planes.size();
+	header.count[SPHERES] = scene.spheres.size();
+	header.count[TRIANGLES] = layout.triangles.size();
+	header.count[MATERIALS] = layout.materials.size();
+	header.count[NODES] = layout.nodes.size();
+	header.count[PRIMS] = layout.prims.size();
+	header.count[CLUSTERS] = layout.clusters.size();
+
+	uint64_t offset = sizeof(CacheHeader);
+	for (int s = 0; s < SECTION_COUNT; s++) {
+		offset = (offset + SECTION_ALIGN - 1) & ~uint64_t(SECTION_ALIGN - 1);
+		header.offset[s] = offset;
+		offset += header.count[s] * ELEMENT_SIZE[s];
+	}
+
+	// write beside the cache and rename over it, so a reader never maps a
+	// partly written file
+	string path = CachePath(sceneFile);
+	string partial = path + ".partial";
+	{
+		ofstream output(partial.c_str(), ios::binary | ios::trunc);
+		output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		static const char padding[SECTION_ALIGN] = {};
+		uint64_t written = sizeof(header);
+		for (int s = 0; s < SECTION_COUNT && output; s++) {
+			output.write(padding, header.offset[s] - written);
+			output.write(static_cast<const char*>(sections[s]), header.count[s] * ELEMENT_SIZE[s]);
+			written = header.offset[s] + header.count[s] * ELEMENT_SIZE[s];
+		}
+		if (!output) {
+			output.close();
+			remove(partial.c_str());
+			return false;
+		}
+	}
+#ifdef _WIN32
+	remove(path.c_str());
+#endif
+	return rename(partial.c_str(), path.c_str()) == 0;
+}
+
+// --------------------------------------------------------------------------
+// Writing straight from the scene file
+
+// primitives read or written between scratch files at a time
+static const size_t STREAM_CHUNK = 1 << 14;
+
+namespace {
+	// a bounded primitive on its way through the scratch files: a sphere,
+	// by id, or a triangle and its material
+	struct StreamedPrim {
+		uint32_t sphere;        // NONE for a triangle
+		Triangle triangle;
+		Material material;
+
+		static const uint32_t NONE = 0xffffffff;
+	};
+
+	// Scratch files beside the cache, each removed once it has been read or
+	// when the cache is finished or abandoned.
+	class ScratchFiles
+	{
+		string m_base;
+		vector<string> m_names;
+		uint32_t m_next;
+
+	public:
+		explicit ScratchFiles(const string& base) : m_base(base), m_next(0)
+		{}
+
+		~ScratchFiles()
+		{
+			for (const string& name : m_names)
+				remove(name.c_str());
+		}
+
+		string Add()
+		{
+			m_names.push_back(m_base + "." + to_string(m_next++));
+			return m_names.back();
+		}
+
+		void Remove(const string& name)
+		{
+			remove(name.c_str());
+			m_names.erase(std::find(m_names.begin(), m_names.end(), name));
+		}
+	};
+
+	// some of the primitives, in a scratch file, and the bounds of their
+	// centroids
+	struct Part {
+		string file;
+		uint64_t count;
+		glm::vec3 lower, upper;
+
+		void Add(const glm::vec3& centroid)
+		{
+			count++;
+			lower = glm::min(lower, centroid);
+			upper = glm::max(upper, centroid);
+		}
+	};
+
+	// keeps the planes and spheres of a scene file, which are few, and
+	// writes its bounded primitives to a part
+	struct PartWriter : public SceneFileSink {
+		vector<Plane> planes;
+		vector<Sphere> spheres;
+		vector<Material> sphereMaterials;
+		Part part;
+		ofstream output;
+
+		void Write(const StreamedPrim& prim, const glm::vec3& centroid)
+		{
+			output.write(reinterpret_cast<const char*>(&prim), sizeof(prim));
+			part.Add(centroid);
+		}
+
+		void AddPlane(const Plane& plane) override
+		{
+			planes.push_back(plane);
+		}
+
+		void AddSphere(const Sphere& sphere, const Material& material) override
+		{
+			StreamedPrim prim = StreamedPrim();
+			prim.sphere = uint32_t(spheres.size());
+			prim.material = material;
+			spheres.push_back(sphere);
+			sphereMaterials.push_back(material);
+			Write(prim, sphere.c);
+		}
+
+		void AddTriangle(const Triangle& triangle, const Material& material) override
+		{
+			StreamedPrim prim = { StreamedPrim::NONE, triangle, material };
+			glm::vec3 p1(triangle.p0 + triangle.e1), p2(triangle.p0 + triangle.e2);
+			Write(prim, 0.5f * (glm::min(triangle.p0, glm::min(p1, p2)) + glm::max(triangle.p0, glm::max(p1, p2))));
+		}
+	};
+
+	// a resident node while the parts are being written: its children, or
+	// the cluster it is the root of
+	struct StagedNode {
+		BvhNode node;
+		uint32_t left, right;
+		uint32_t cluster;       // ClusterPager::NONE if not a cluster's root
+	};
+
+	// the cache's sections below the resident nodes as the parts are
+	// appended to them, with cluster nodes numbered from the first below the
+	// resident ones, and the resident nodes staged so far
+	struct WrittenSections {
+		ofstream triangles, materials, nodes, prims;
+		string triangleFile, materialFile, nodeFile, primFile;
+		uint32_t triangleCount, nodeCount, primCount;
+		vector<ClusterInfo> clusters;
+		vector<StagedNode> staged;
+	};
+}
+
+static glm::vec3 centroid(const StreamedPrim& prim, const vector<Sphere>& spheres) {
+	if (prim.sphere != StreamedPrim::NONE)
+		return spheres[prim.sphere].c;
+	const Triangle& tr = prim.triangle;
+	glm::vec3 p1(tr.p0 + tr.e1), p2(tr.p0 + tr.e2);
+	return 0.5f * (glm::min(tr.p0, glm::min(p1, p2)) + glm::max(tr.p0, glm::max(p1, p2)));
+}
+
+static Part emptyPart(const string& file) {
+	Part part = { file, 0, glm::vec3(INFINITY), glm::vec3(-INFINITY) };
+	return part;
+}
+
+// Appends part to parts if it is small enough to build in memory, and
+// otherwise splits it into the eighths of its centroids' bounds, in Morton
+// order, and those in turn. Where that puts every primitive on one side,
+// because their centroids are all (nearly) the same, the part is halved in
+// file order instead.
+static bool splitPart(const Part& part, bool byOrder, const vector<Sphere>& spheres, ScratchFiles& scratch,
+                      vector<Part>& parts) {
+	if (part.count <= SceneCache::PART_SIZE) {
+		parts.push_back(part);
+		return true;
+	}
+
+	const int CHILDREN = 8;
+	glm::vec3 mid(0.5f * (part.lower + part.upper));
+	Part children[CHILDREN];
+	ofstream outputs[CHILDREN];
+	for (int i = 0; i < CHILDREN; i++) {
+		children[i] = emptyPart(scratch.Add());
+		outputs[i].open(children[i].file.c_str(), ios::binary | ios::trunc);
+	}
+
+	ifstream input(part.file.c_str(), ios::binary);
+	vector<StreamedPrim> buffer(STREAM_CHUNK);
+	for (uint64_t done = 0; done < part.count; ) {
+		size_t count = size_t(std::min<uint64_t>(STREAM_CHUNK, part.count - done));
+		if (!input.read(reinterpret_cast<char*>(buffer.data()), count * sizeof(StreamedPrim)))
+			return false;
+		for (size_t i = 0; i < count; i++, done++) {
+			glm::vec3 c(centroid(buffer[i], spheres));
+			int child = byOrder ? int(done >= part.count / 2)
+			                    : int(c.x > mid.x) | int(c.y > mid.y) << 1 | int(c.z > mid.z) << 2;
+			outputs[child].write(reinterpret_cast<const char*>(&buffer[i]), sizeof(StreamedPrim));
+			children[child].Add(c);
+		}
+	}
+	input.close();
+	scratch.Remove(part.file);
+
+	for (int i = 0; i < CHILDREN; i++) {
+		outputs[i].close();
+		if (!outputs[i])
+			return false;
+	}
+	for (int i = 0; i < CHILDREN; i++) {
+		if (children[i].count == 0)
+			scratch.Remove(children[i].file);
+		else if (!splitPart(children[i], children[i].count == part.count, spheres, scratch, parts))
+			return false;
+	}
+	return true;
+}
+
+// Builds the BVH of part's primitives in memory, lays it out in clusters as
+// Save() does, and appends them to the sections. The part's resident nodes
+// are staged, its root first.
+static bool writePart(const Part& part, const PartWriter& scene, WrittenSections& out) {
+	vector<uint32_t> sphereIds;
+	vector<Sphere> spheres;
+	vector<Triangle> triangles;
+	vector<Material> materials, triangleMaterials;
+	{
+		vector<StreamedPrim> prims(size_t(part.count));
+		ifstream input(part.file.c_str(), ios::binary);
+		if (!input.read(reinterpret_cast<char*>(prims.data()), prims.size() * sizeof(StreamedPrim)))
+			return false;
+		for (const StreamedPrim& prim : prims) {
+			if (prim.sphere != StreamedPrim::NONE) {
+				sphereIds.push_back(prim.sphere);
+				spheres.push_back(scene.spheres[prim.sphere]);
+				materials.push_back(prim.material);
+			}
+			else {
+				triangles.push_back(prim.triangle);
+				triangleMaterials.push_back(prim.material);
+			}
+		}
+	}
+	materials.insert(materials.end(), triangleMaterials.begin(), triangleMaterials.end());
+
+	Scene partScene;
+	partScene.spheres = partScene.arena.Copy(spheres);
+	partScene.triangles = partScene.arena.Copy(triangles);
+	partScene.materials = partScene.arena.Copy(materials);
+	Bvh bvh;
+	bvh.Build(partScene, false);
+	ClusterLayout layout;
+	clusterLayout(partScene, bvh, layout);
+
+	// nodes below the resident ones go after those already written, and
+	// primitives are renumbered from part to scene
+	uint32_t partSpheres = uint32_t(sphereIds.size());
+	uint32_t sceneSpheres = uint32_t(scene.spheres.size());
+	uint32_t resident = layout.residentNodes;
+	auto place = [&](BvhNode& node) {
+		if (node.count > 0)
+			node.first += out.primCount;
+		else
+			node.first = node.first - resident + out.nodeCount;
+	};
+
+	vector<uint32_t> clusterAt(resident, ClusterPager::NONE);
+	for (size_t c = 0; c < layout.clusters.size(); c++)
+		clusterAt[layout.clusters[c].root] = uint32_t(out.clusters.size() + c);
+	uint32_t base = uint32_t(out.staged.size());
+	for (uint32_t i = 0; i < resident; i++) {
+		StagedNode staged = { layout.nodes[i], 0, 0, clusterAt[i] };
+		if (staged.cluster == ClusterPager::NONE) {
+			staged.left = base + staged.node.first;
+			staged.right = base + staged.node.first + 1;
+		}
+		else
+			place(staged.node);
+		out.staged.push_back(staged);
+	}
+	for (size_t i = resident; i < layout.nodes.size(); i++) {
+		BvhNode node = layout.nodes[i];
+		place(node);
+		out.nodes.write(reinterpret_cast<const char*>(&node), sizeof(node));
+	}
+
+	for (uint32_t& prim : layout.prims)
+		prim = prim < partSpheres ? sphereIds[prim] : sceneSpheres + out.triangleCount + (prim - partSpheres);
+	out.prims.write(reinterpret_cast<const char*>(layout.prims.data()), layout.prims.size() * sizeof(uint32_t));
+	out.triangles.write(reinterpret_cast<const char*>(layout.triangles.data()),
+		layout.triangles.size() * sizeof(Triangle));
+	out.materials.write(reinterpret_cast<const char*>(layout.materials.data() + partSpheres),
+		layout.triangles.size() * sizeof(Material));
+
+	for (ClusterInfo info : layout.clusters) {
+		info.root += base;
+		info.nodeFirst = info.nodeFirst - resident + out.nodeCount;
+		info.primFirst += out.primCount;
+		info.triFirst += out.triangleCount;
+		out.clusters.push_back(info);
+	}
+	out.nodeCount += uint32_t(layout.nodes.size() - resident);
+	out.primCount += uint32_t(layout.prims.size());
+	out.triangleCount += uint32_t(layout.triangles.size());
+	return bool(out.nodes) && bool(out.prims) && bool(out.triangles) && bool(out.materials);
+}
+
+static float surfaceArea(const glm::vec3& lower, const glm::vec3& upper) {
+	glm::vec3 e(glm::max(upper - lower, glm::vec3(0)));
+	return 2*(e.x*e.y + e.y*e.z + e.z*e.x);
+}
+
+// Stages the nodes joining the parts rooted at roots[first, last), which
+// lie in Morton order, splitting each range where the surface area
+// heuristic's cost is lowest, and returns the root of them all.
+static uint32_t joinParts(vector<StagedNode>& staged, const vector<uint32_t>& roots,
+                          const vector<uint64_t>& counts, size_t first, size_t last) {
+	if (last - first == 1)
+		return roots[first];
+
+	// the bounds of every range ending at last, then the best split found
+	// sweeping the ranges starting at first
+	size_t n = last - first;
+	vector<glm::vec3> suffixLower(n + 1, glm::vec3(INFINITY)), suffixUpper(n + 1, glm::vec3(-INFINITY));
+	vector<uint64_t> suffixCount(n + 1, 0);
+	for (size_t i = n; i-- > 0; ) {
+		const BvhNode& node = staged[roots[first + i]].node;
+		suffixLower[i] = glm::min(suffixLower[i + 1], node.lower);
+		suffixUpper[i] = glm::max(suffixUpper[i + 1], node.upper);
+		suffixCount[i] = suffixCount[i + 1] + counts[first + i];
+	}
+	glm::vec3 lower(INFINITY), upper(-INFINITY);
+	uint64_t count = 0;
+	size_t split = 1;
+	float best = INFINITY;
+	for (size_t i = 1; i < n; i++) {
+		const BvhNode& node = staged[roots[first + i - 1]].node;
+		lower = glm::min(lower, node.lower);
+		upper = glm::max(upper, node.upper);
+		count += counts[first + i - 1];
+		float cost = surfaceArea(lower, upper) * count + surfaceArea(suffixLower[i], suffixUpper[i]) * suffixCount[i];
+		if (cost < best) {
+			best = cost;
+			split = i;
+		}
+	}
+
+	uint32_t left = joinParts(staged, roots, counts, first, first + split);
+	uint32_t right = joinParts(staged, roots, counts, first + split, last);
+	StagedNode join;
+	join.node.lower = suffixLower[0];
+	join.node.upper = suffixUpper[0];
+	join.node.first = 0;
+	join.node.count = 0;
+	join.left = left;
+	join.right = right;
+	join.cluster = ClusterPager::NONE;
+	staged.push_back(join);
+	return uint32_t(staged.size() - 1);
+}
+
+// Numbers the staged nodes breadth first from root, siblings side by side,
+// as the resident nodes, and points the clusters at their roots.
+static vector<BvhNode> placeResident(const vector<StagedNode>& staged, uint32_t root, vector<ClusterInfo>& clusters) {
+	uint32_t resident = uint32_t(staged.size());
+	vector<BvhNode> nodes(resident);
+	vector<uint32_t> order(1, root);
+	uint32_t next = 1;
+	for (uint32_t i = 0; i < order.size(); i++) {
+		const StagedNode& s = staged[order[i]];
+		BvhNode node = s.node;
+		if (s.cluster != ClusterPager::NONE) {
+			clusters[s.cluster].root = i;
+			clusters[s.cluster].nodeFirst += resident;
+			if (node.count == 0)
+				node.first += resident;
+		}
+		else {
+			order.push_back(s.left);
+			order.push_back(s.right);
+			node.first = next;
+			next += 2;
+		}
+		nodes[i] = node;
+	}
+	return nodes;
+}
+
+// copies bytes from the start of the file name to output
+static bool copyFile(const string& name, ofstream& output, uint64_t bytes) {
+	ifstream input(name.c_str(), ios::binary);
+	vector<char> buffer(STREAM_CHUNK * sizeof(StreamedPrim));
+	while (bytes > 0 && input && output) {
+		size_t size = size_t(std::min<uint64_t>(buffer.size(), bytes));
+		input.read(buffer.data(), size);
+		output.write(buffer.data(), size);
+		bytes -= size;
+	}
+	return bool(input) && bool(output);
+}
+
+// copies count nodes from the file name to output, moving those that refer
+// to other nodes past the resident ones
+static bool copyNodes(const string& name, ofstream& output, uint64_t count, uint32_t resident) {
+	ifstream input(name.c_str(), ios::binary);
+	vector<BvhNode> buffer(STREAM_CHUNK);
+	while (count > 0 && input && output) {
+		size_t size = size_t(std::min<uint64_t>(buffer.size(), count));
+		input.read(reinterpret_cast<char*>(buffer.data()), size * sizeof(BvhNode));
+		for (size_t i = 0; i < size; i++)
+			if (buffer[i].count == 0)
+				buffer[i].first += resident;
+		output.write(reinterpret_cast<const char*>(buffer.data()), size * sizeof(BvhNode));
+		count -= size;
+	}
+	return bool(input) && bool(output);
+}
+
+bool SceneCache::Write(const string& sceneFile)
+{
+	uint64_t hash;
+	if (!hashFile(sceneFile, hash))
+		return false;
+	string path = CachePath(sceneFile);
+	string partial = path + ".partial";
+	ScratchFiles scratch(partial);
+
+	// read the file once, keeping only its planes and spheres
+	PartWriter scene;
+	scene.part = emptyPart(scratch.Add());
+	scene.output.open(scene.part.file.c_str(), ios::binary | ios::trunc);
+	Light light;
+	if (!readSceneFile(sceneFile, scene, light))
+		return false;
+	scene.output.close();
+	if (!scene.output)
+		return false;
+
+	vector<Part> parts;
+	if (scene.part.count > 0 && !splitPart(scene.part, false, scene.spheres, scratch, parts))
+		return false;
+
+	WrittenSections out;
+	out.triangleFile = scratch.Add();
+	out.materialFile = scratch.Add();
+	out.nodeFile = scratch.Add();
+	out.primFile = scratch.Add();
+	out.triangles.open(out.triangleFile.c_str(), ios::binary | ios::trunc);
+	out.materials.open(out.materialFile.c_str(), ios::binary | ios::trunc);
+	out.nodes.open(out.nodeFile.c_str(), ios::binary | ios::trunc);
+	out.prims.open(out.primFile.c_str(), ios::binary | ios::trunc);
+	out.triangleCount = out.nodeCount = out.primCount = 0;
+
+	vector<uint32_t> roots;
+	vector<uint64_t> counts;
+	for (const Part& part : parts) {
+		roots.push_back(uint32_t(out.staged.size()));
+		counts.push_back(part.count);
+		if (!writePart(part, scene, out))
+			return false;
+		scratch.Remove(part.file);
+	}
+	out.triangles.close();
+	out.materials.close();
+	out.nodes.close();
+	out.prims.close();
+
+	// a scene of planes alone has a hierarchy of one empty leaf, as when built
+	vector<BvhNode> resident;
+	if (roots.empty()) {
+		BvhNode empty;
+		empty.lower = glm::vec3(INFINITY);
+		empty.upper = glm::vec3(-INFINITY);
+		empty.first = 0;
+		empty.count = 0;
+		resident.push_back(empty);
+	}
+	else {
+		uint32_t root = joinParts(out.staged, roots, counts, 0, roots.size());
+		resident = placeResident(out.staged, root, out.clusters);
+	}
+
+	CacheHeader header;
+	fillHeader(header, hash);
+	header.light = light;
+	header.residentNodes = resident.size();
+	header.count[PLANES] = scene.planes.size();
+	header.count[SPHERES] = scene.spheres.size();
+	header.count[TRIANGLES] = out.triangleCount;
+	header.count[MATERIALS] = scene.spheres.size() + out.triangleCount;
+	header.count[NODES] = resident.size() + out.nodeCount;
+	header.count[PRIMS] = out.primCount;
+	header.count[CLUSTERS] = out.clusters.size();
+
+	uint64_t offset = sizeof(CacheHeader);
+	for (int s = 0; s < SECTION_COUNT; s++) {
+		offset = (offset + SECTION_ALIGN - 1) & ~uint64_t(SECTION_ALIGN - 1);
+		header.offset[s] = offset;
+		offset += header.count[s] * ELEMENT_SIZE[s];
+	}
+
+	// the sections go out in order, each from memory or its scratch file
+	{
+		ofstream output(partial.c_str(), ios::binary | ios::trunc);
+		output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		static const char padding[SECTION_ALIGN] = {};
+		uint64_t written = sizeof(header);
+		auto align = [&](int s) {
+			output.write(padding, header.offset[s] - written);
+			written = header.offset[s] + header.count[s] * ELEMENT_SIZE[s];
+		};
+		align(PLANES);
+		output.write(reinterpret_cast<const char*>(scene.planes.data()), scene.planes.size() * sizeof(Plane));
+		align(SPHERES);
+		output.write(reinterpret_cast<const char*>(scene.spheres.data()), scene.spheres.size() * sizeof(Sphere));
+		align(TRIANGLES);
+		bool copied = copyFile(out.triangleFile, output, uint64_t(out.triangleCount) * sizeof(Triangle));
+		align(MATERIALS);
+		output.write(reinterpret_cast<const char*>(scene.sphereMaterials.data()),
+			scene.sphereMaterials.size() * sizeof(Material));
+		copied = copied && copyFile(out.materialFile, output, uint64_t(out.triangleCount) * sizeof(Material));
+		align(NODES);
+		output.write(reinterpret_cast<const char*>(resident.data()), resident.size() * sizeof(BvhNode));
+		copied = copied && copyNodes(out.nodeFile, output, out.nodeCount, uint32_t(resident.size()));
+		align(PRIMS);
+		copied = copied && copyFile(out.primFile, output, uint64_t(out.primCount) * sizeof(uint32_t));
+		align(CLUSTERS);
+		output.write(reinterpret_cast<const char*>(out.clusters.data()), out.clusters.size() * sizeof(ClusterInfo));
+		output.flush();
+		if (!copied || !output) {
+			output.close();
+			remove(partial.c_str());
+			return false;
+		}
+	}
+#ifdef _WIN32
+	remove(path.c_str());
+#endif
+	return rename(partial.c_str(), path.c_str()) == 0;
+}
@@ -0,0 +1,115 @@
+// ==========================================================================
+// Scene Cache
+//
+// Parsing a large scene file and building its BVH is repeated on every run
+// even though the result only changes when the file does. The first run
+// therefore saves the parsed primitives and the finished hierarchy to a
+// binary file beside the scene (scene.txt -> scene.txt.cache), and later
+// runs map that file into memory and trace straight out of it.
+//
+// Primitives and nodes are stored grouped into the spatially coherent
+// clusters described in ClusterPager.h, which both keeps each part of the
+// scene together on disk and lets scenes larger than memory be streamed.
+//
+// A cache can be saved from a scene and BVH already in memory, or written
+// straight from the scene file without ever holding the whole scene, for
+// scenes larger than memory. The file is then read once, its primitives
+// going to a scratch file beside the cache; that file is split into eighths
+// of space, and those again, until each part is small enough to build in
+// memory. Each part in turn has its BVH built, cut into clusters and
+// appended to the cache's sections, and finally a few levels of nodes are
+// built over the parts' top levels to join them into one hierarchy.
+//
+// The cache begins with a header naming the format version, the sizes of the
+// stored structures and a hash of the scene file's contents; a cache whose
+// header does not match is ignored and rewritten. Every section is located
+// by its offset from the start of the file, and the BVH refers to nodes and
+// primitives by index, so the file is valid wherever it is mapped.
+// ==========================================================================
+#ifndef SCENECACHE_H
+#define SCENECACHE_H
+
+#include <string>
+#include <stdint.h>
+#include "Scene.h"
+#include "Bvh.h"
+#include "ClusterPager.h"
+
+// --------------------------------------------------------------------------
+// A read-only view of a whole file.
+
+class MappedFile
+{
+	const char* m_data;
+	size_t      m_size;
+#ifdef _WIN32
+	void*       m_file;
+	void*       m_mapping;
+#endif
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool Open(const std::string& filename);
+	void Close();
+
+	// exchanges the mappings of the two objects
+	void Swap(MappedFile& other);
+
+	const char* Data() const { return m_data; }
+	size_t Size() const { return m_size; }
+};
+
+// --------------------------------------------------------------------------
+
+class SceneCache
+{
+	MappedFile  m_file;
+	ClusterPager m_pager;
+
+	// where the clusters of the loaded cache are described
+	const ClusterInfo* m_clusters;
+	uint32_t    m_clusterCount;
+	uint32_t    m_residentNodes;
+
+public:
+	static const uint32_t VERSION = 2;
+
+	SceneCache();
+
+	// name of the cache kept for a scene file
+	static std::string CachePath(const std::string& sceneFile);
+
+	// Fills scene and bvh from the cache of sceneFile, returning false if
+	// there is no cache or it is stale, in which case scene and bvh are left
+	// alone. The primitive arrays and nodes point into the mapped file, so
+	// they are read-only and stay valid until the next successful Load() or
+	// until this object is destroyed.
+	bool Load(const std::string& sceneFile, Scene& scene, Bvh& bvh);
+
+	// true if the last Load() succeeded
+	bool Loaded() const { return m_file.Data() != 0; }
+
+	// From now on treat only the top levels of the loaded BVH as resident,
+	// paging its clusters in through bvh as rays reach them and keeping about
+	// budget bytes of them in memory.
+	void Stream(const Scene& scene, Bvh& bvh, size_t budget);
+
+	// writes the cache for sceneFile, which scene was loaded from and bvh fully
+	// built over, returning false if it could not be written
+	static bool Save(const std::string& sceneFile, const Scene& scene, const Bvh& bvh);
+
+	// Writes the cache for sceneFile from the file itself, building its BVH
+	// a part of the scene at a time so that at most about PART_SIZE
+	// primitives are in memory at once, whatever the size of the scene.
+	// Returns false if the file cannot be read or the cache written.
+	static const uint32_t PART_SIZE = 1 << 19;
+	static bool Write(const std::string& sceneFile);
+};
+
+// --------------------------------------------------------------------------
+#endif // SCENECACHE_H
@@ -0,0 +1,414 @@
+// ==========================================================================
+// Quantised 8-Wide Bounding Volume Hierarchy
+// ==========================================================================
+
+#include "WideBvh.h"
+
+#include <math.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define WIDEBVH_AVX2
+#endif
+
+// Traversal is written once and inlined into a version compiled for AVX2 and
+// one for any processor, so the vector child tests are inlined in turn.
+#ifdef __GNUC__
+#define TRAVERSAL_INLINE inline __attribute__((always_inline))
+#else
+#define TRAVERSAL_INLINE inline
+#endif
+
+using namespace glm;
+using namespace std;
+
+static const int WIDTH = WideBvhNode::WIDTH;
+static const int STEPS = 255;       // largest quantised offset
+
+static_assert(sizeof(WideBvhNode) == 64, "a node should fill one cache line");
+static_assert(Bvh::MAX_LEAF_SIZE < (1 << WideBvhNode::COUNT_BITS), "leaf counts must fit their bits");
+
+// --------------------------------------------------------------------------
+
+static float surfaceArea(const vec3& lower, const vec3& upper) {
+	vec3 e(glm::max(upper - lower, vec3(0)));
+	return 2*(e.x*e.y + e.y*e.z + e.z*e.x);
+}
+
+// 2^exponent, for exponents of normal floats
+static inline float power2(int exponent) {
+	uint32_t bits = uint32_t(exponent + 127) << 23;
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+static inline vec3 nodeSteps(const WideBvhNode& node) {
+	return vec3(power2(node.exponent[0]), power2(node.exponent[1]), power2(node.exponent[2]));
+}
+
+// The exponent of the smallest power of two, no smaller than the least
+// normal float, that reaches from lower to upper in STEPS steps. Multiples
+// of it up to STEPS are exact, so a bound is the same whether unpacked with
+// a fused multiply-add or not.
+static int quantisationExponent(float lower, float upper) {
+	int exponent;
+	frexpf((upper - lower) / STEPS, &exponent);
+	exponent = std::max(exponent, -126);
+	while (lower + STEPS * power2(exponent) < upper)
+		exponent++;
+	return exponent;
+}
+
+// the lower corner of child i of a node whose corner is origin, which is
+// also the corner of the child's node if it has one
+static inline vec3 childOrigin(const WideBvhNode& node, const vec3& origin, const vec3& step, int i) {
+	return vec3(origin.x + float(node.lower[0][i]) * step.x,
+	            origin.y + float(node.lower[1][i]) * step.y,
+	            origin.z + float(node.lower[2][i]) * step.z);
+}
+
+// Fills node, whose corner is origin, with the given binary nodes as its
+// children, rounding their boxes outwards onto the node's steps. Where the
+// children's nodes and primitives are is left for the caller.
+static void packNode(WideBvhNode& node, const vec3& origin, const BvhNode* nodes, const uint32_t* children,
+                     int count) {
+	node = WideBvhNode();
+	vec3 upper(-INFINITY);
+	for (int i = 0; i < count; i++)
+		upper = glm::max(upper, nodes[children[i]].upper);
+	for (int axis = 0; axis < 3; axis++)
+		node.exponent[axis] = int8_t(quantisationExponent(origin[axis], upper[axis]));
+	vec3 step(nodeSteps(node));
+
+	for (int i = 0; i < count; i++) {
+		const BvhNode& child = nodes[children[i]];
+		for (int axis = 0; axis < 3; axis++) {
+			int lo = std::min(std::max(int(floorf((child.lower[axis] - origin[axis]) / step[axis])), 0), STEPS);
+			int hi = std::min(std::max(int(ceilf((child.upper[axis] - origin[axis]) / step[axis])), 0), STEPS);
+			while (lo > 0 && origin[axis] + float(lo) * step[axis] > child.lower[axis])
+				lo--;
+			while (hi < STEPS && origin[axis] + float(hi) * step[axis] < child.upper[axis])
+				hi++;
+			node.lower[axis][i] = uint8_t(lo);
+			node.upper[axis][i] = uint8_t(hi);
+		}
+		node.leafCounts |= child.count << (WideBvhNode::COUNT_BITS * i);
+	}
+	node.childCount = uint8_t(count);
+}
+
+// --------------------------------------------------------------------------
+
+WideBvh::WideBvh()
+	: m_scene(0), m_nodes(0), m_nodeCount(0), m_capacity(0), m_origin(0), m_avx2(false)
+{
+#ifdef WIDEBVH_AVX2
+	// may run before the runtime has looked at the processor itself
+	__builtin_cpu_init();
+	m_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+
+// Each wide node starts from the two children of a binary interior node and
+// opens whichever interior child has the largest surface area in its place,
+// until it has WIDTH children or only leaves. Nodes are laid out depth first.
+void WideBvh::Build(Scene& scene, const Bvh& bvh)
+{
+	m_scene = &scene;
+	m_nodeCount = 0;
+	m_prims.clear();
+	const BvhNode* nodes = bvh.Nodes();
+	const uint32_t* prims = bvh.Prims();
+	if (!nodes || bvh.NodeCount() == 0 || nodes[0].lower.x > nodes[0].upper.x)
+		return;
+
+	// every wide node stands in for a different binary interior node, or
+	// the root when it is a leaf
+	uint32_t capacity = std::max(bvh.NodeCount() / 2, 1u);
+	if (capacity > m_capacity) {
+		m_storage.assign(size_t(capacity) * sizeof(WideBvhNode) + alignof(WideBvhNode), 0);
+		m_capacity = capacity;
+	}
+	uintptr_t base = reinterpret_cast<uintptr_t>(m_storage.data());
+	m_nodes = reinterpret_cast<WideBvhNode*>((base + alignof(WideBvhNode) - 1) & ~uintptr_t(alignof(WideBvhNode) - 1));
+	m_prims.reserve(boundedPrimitiveCount(scene));
+	m_origin = nodes[0].lower;
+
+	struct Pending
+	{
+		uint32_t binary, wide;
+		vec3 origin;
+	};
+	vector<Pending> pending(1, Pending{ 0, 0, m_origin });
+	m_nodeCount = 1;
+	while (!pending.empty()) {
+		Pending next = pending.back();
+		pending.pop_back();
+
+		uint32_t children[WIDTH];
+		int count = 0;
+		const BvhNode& parent = nodes[next.binary];
+		if (parent.count > 0)
+			children[count++] = next.binary;
+		else {
+			children[count++] = parent.first;
+			children[count++] = parent.first + 1;
+		}
+		while (count < WIDTH) {
+			int widest = -1;
+			float widestArea = -1;
+			for (int i = 0; i < count; i++) {
+				const BvhNode& child = nodes[children[i]];
+				float area = surfaceArea(child.lower, child.upper);
+				if (child.count == 0 && area > widestArea) {
+					widest = i;
+					widestArea = area;
+				}
+			}
+			if (widest < 0)
+				break;
+			uint32_t opened = children[widest];
+			children[widest] = nodes[opened].first;
+			children[count++] = nodes[opened].first + 1;
+		}
+
+		WideBvhNode& node = m_nodes[next.wide];
+		packNode(node, next.origin, nodes, children, count);
+		node.firstChild = m_nodeCount;
+		node.firstPrim = uint32_t(m_prims.size());
+		vec3 step(nodeSteps(node));
+		for (int i = 0; i < count; i++) {
+			const BvhNode& child = nodes[children[i]];
+			if (child.count > 0)
+				m_prims.insert(m_prims.end(), prims + child.first, prims + child.first + child.count);
+			else
+				pending.push_back(Pending{ children[i], m_nodeCount++, childOrigin(node, next.origin, step, i) });
+		}
+	}
+}
+
+void WideBvh::Cull(const Frustum&, BvhCut& cut)
+{
+	cut.count = 0;
+}
+
+// --------------------------------------------------------------------------
+// Child tests
+//
+// Both set tNear[i] to where o + t*d enters child i of a node whose corner is
+// origin, and return a bit for each child it meets for t in [0, tMax]. Their
+// arithmetic is the same, the minima and maxima taken in the same order, so
+// they agree to the bit.
+
+static inline uint32_t hitChildren(const WideBvhNode& node, const vec3& origin, const vec3& step, const vec3& o,
+                                   const vec3& invD, float tMax, float tNear[WIDTH]) {
+	uint32_t mask = 0;
+	for (int i = 0; i < node.childCount; i++) {
+		float t0 = 0, t1 = tMax;
+		for (int axis = 0; axis < 3; axis++) {
+			float lo = origin[axis] + float(node.lower[axis][i]) * step[axis];
+			float hi = origin[axis] + float(node.upper[axis][i]) * step[axis];
+			float a = (lo - o[axis]) * invD[axis];
+			float b = (hi - o[axis]) * invD[axis];
+			t0 = std::max(t0, std::min(a, b));
+			t1 = std::min(t1, std::max(a, b));
+		}
+		tNear[i] = t0;
+		mask |= uint32_t(t0 <= t1) << i;
+	}
+	return mask;
+}
+
+#ifdef WIDEBVH_AVX2
+// _mm256_min_ps(b, a) picks as std::min(a, b) does, and likewise for max
+__attribute__((target("avx2,fma")))
+static inline uint32_t hitChildrenAvx2(const WideBvhNode& node, const vec3& origin, const vec3& step,
+                                       const vec3& o, const vec3& invD, float tMax, float tNear[WIDTH]) {
+	__m256 t0 = _mm256_setzero_ps();
+	__m256 t1 = _mm256_set1_ps(tMax);
+	for (int axis = 0; axis < 3; axis++) {
+		__m256 corner = _mm256_set1_ps(origin[axis]);
+		__m256 size = _mm256_set1_ps(step[axis]);
+		__m256 lower = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+			_mm_loadl_epi64(reinterpret_cast<const __m128i*>(node.lower[axis]))));
+		__m256 upper = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+			_mm_loadl_epi64(reinterpret_cast<const __m128i*>(node.upper[axis]))));
+		__m256 rayOrigin = _mm256_set1_ps(o[axis]);
+		__m256 rayInvD = _mm256_set1_ps(invD[axis]);
+		__m256 a = _mm256_mul_ps(_mm256_sub_ps(_mm256_fmadd_ps(lower, size, corner), rayOrigin), rayInvD);
+		__m256 b = _mm256_mul_ps(_mm256_sub_ps(_mm256_fmadd_ps(upper, size, corner), rayOrigin), rayInvD);
+		t0 = _mm256_max_ps(_mm256_min_ps(b, a), t0);
+		t1 = _mm256_min_ps(_mm256_max_ps(b, a), t1);
+	}
+	_mm256_storeu_ps(tNear, t0);
+	uint32_t mask = uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)));
+	return mask & ((1u << node.childCount) - 1);
+}
+#endif
+
+template <bool AVX2>
+static TRAVERSAL_INLINE uint32_t testChildren(const WideBvhNode& node, const vec3& origin, const vec3& step,
+                                              const vec3& o, const vec3& invD, float tMax, float tNear[WIDTH]) {
+#ifdef WIDEBVH_AVX2
+	if (AVX2)
+		return hitChildrenAvx2(node, origin, step, o, invD, tMax, tNear);
+#endif
+	return hitChildren(node, origin, step, o, invD, tMax, tNear);
+}
+
+// --------------------------------------------------------------------------
+// Traversal
+
+namespace {
+	struct StackEntry {
+		uint32_t node;
+		float tNear;
+		vec3 origin;
+	};
+
+	// what traversal reads, passed to the free functions each processor's
+	// version is made from
+	struct WideBvhView {
+		Scene* scene;
+		const WideBvhNode* nodes;
+		const uint32_t* prims;
+		vec3 origin;
+	};
+}
+
+// The children a ray meets are put in order of entry; leaves are tested
+// straight away, nearest first, shortening the ray before the interior
+// children are pushed, farthest first so the nearest is visited next.
+template <bool AVX2>
+static TRAVERSAL_INLINE bool closestHit(const WideBvhView& bvh, const vec3& o, const vec3& d, SurfaceHit& hit) {
+	vec3 invD(1.f / d);
+	StackEntry stack[WideBvh::STACK_SIZE];
+	int top = 0;
+	bool found = false;
+	stack[top++] = { 0, 0.f, bvh.origin };
+
+	while (top > 0) {
+		StackEntry entry = stack[--top];
+		if (entry.tNear > hit.dist)
+			continue;
+
+		const WideBvhNode& node = bvh.nodes[entry.node];
+		vec3 step(nodeSteps(node));
+		float tNear[WIDTH];
+		uint32_t mask = testChildren<AVX2>(node, entry.origin, step, o, invD, hit.dist, tNear);
+
+		// where each child's node or primitives are, and those hit in order
+		uint32_t first[WIDTH];
+		int order[WIDTH];
+		int hits = 0;
+		uint32_t nextChild = node.firstChild, nextPrim = node.firstPrim;
+		for (int i = 0; i < node.childCount; i++) {
+			int count = node.LeafCount(i);
+			first[i] = count > 0 ? nextPrim : nextChild;
+			if (count > 0)
+				nextPrim += count;
+			else
+				nextChild++;
+			if (!(mask & (1u << i)))
+				continue;
+			int j = hits++;
+			for (; j > 0 && tNear[order[j-1]] > tNear[i]; j--)
+				order[j] = order[j-1];
+			order[j] = i;
+		}
+
+		for (int k = 0; k < hits; k++) {
+			int i = order[k];
+			int count = node.LeafCount(i);
+			if (count == 0 || tNear[i] > hit.dist)
+				continue;
+			for (uint32_t p = first[i]; p < first[i] + count; p++) {
+				if (intersectPrimitive(*bvh.scene, bvh.prims[p], o, d, hit.dist)) {
+					hit.prim = bvh.prims[p];
+					found = true;
+				}
+			}
+		}
+		for (int k = hits - 1; k >= 0; k--) {
+			int i = order[k];
+			if (node.LeafCount(i) == 0 && tNear[i] <= hit.dist)
+				stack[top++] = { first[i], tNear[i], childOrigin(node, entry.origin, step, i) };
+		}
+	}
+	return found;
+}
+
+template <bool AVX2>
+static TRAVERSAL_INLINE bool occluded(const WideBvhView& bvh, const vec3& o, const vec3& d, float maxDist) {
+	vec3 invD(1.f / d);
+	StackEntry stack[WideBvh::STACK_SIZE];
+	int top = 0;
+	stack[top++] = { 0, 0.f, bvh.origin };
+
+	while (top > 0) {
+		StackEntry entry = stack[--top];
+		const WideBvhNode& node = bvh.nodes[entry.node];
+		vec3 step(nodeSteps(node));
+		float tNear[WIDTH];
+		uint32_t mask = testChildren<AVX2>(node, entry.origin, step, o, invD, maxDist, tNear);
+
+		uint32_t nextChild = node.firstChild, nextPrim = node.firstPrim;
+		for (int i = 0; i < node.childCount; i++) {
+			int count = node.LeafCount(i);
+			bool hitChild = (mask & (1u << i)) != 0;
+			if (count == 0) {
+				if (hitChild)
+					stack[top++] = { nextChild, tNear[i], childOrigin(node, entry.origin, step, i) };
+				nextChild++;
+				continue;
+			}
+			for (uint32_t p = nextPrim; p < nextPrim + count && hitChild; p++) {
+				float dist = maxDist;
+				if (intersectPrimitive(*bvh.scene, bvh.prims[p], o, d, dist))
+					return true;
+			}
+			nextPrim += count;
+		}
+	}
+	return false;
+}
+
+#ifdef WIDEBVH_AVX2
+__attribute__((target("avx2,fma")))
+static bool closestHitAvx2(const WideBvhView& bvh, const vec3& o, const vec3& d, SurfaceHit& hit) {
+	return closestHit<true>(bvh, o, d, hit);
+}
+
+__attribute__((target("avx2,fma")))
+static bool occludedAvx2(const WideBvhView& bvh, const vec3& o, const vec3& d, float maxDist) {
+	return occluded<true>(bvh, o, d, maxDist);
+}
+#endif
+
+bool WideBvh::ClosestHit(const vec3& o, const vec3& d, SurfaceHit& hit, const BvhCut*)
+{
+	if (m_nodeCount == 0)
+		return false;
+	WideBvhView view = { m_scene, m_nodes, m_prims.data(), m_origin };
+#ifdef WIDEBVH_AVX2
+	if (m_avx2)
+		return closestHitAvx2(view, o, d, hit);
+#endif
+	return closestHit<false>(view, o, d, hit);
+}
+
+bool WideBvh::Occluded(const vec3& o, const vec3& d, float maxDist)
+{
+	if (m_nodeCount == 0)
+		return false;
+	WideBvhView view = { m_scene, m_nodes, m_prims.data(), m_origin };
+#ifdef WIDEBVH_AVX2
+	if (m_avx2)
+		return occludedAvx2(view, o, d, maxDist);
+#endif
+	return occluded<false>(view, o, d, maxDist);
+}
@@ -0,0 +1,97 @@
+// ==========================================================================
+// Quantised 8-Wide Bounding Volume Hierarchy
+//
+// For large scenes the binary BVH's nodes are much of the memory every ray
+// reads. This hierarchy is made from a finished binary one by collapsing it
+// into nodes of up to eight children, each repeatedly opening whichever
+// child has the largest surface area, so that a ray visits far fewer nodes.
+// Each node fills one 64-byte cache line, and the whole hierarchy takes about
+// a third of the binary one's memory:
+//
+//  - The children's boxes are 8-bit offsets within the node's box, rounded
+//    outwards so they only ever grow. The node's box starts where its
+//    parent's offsets put it, so only the root's corner is stored, and is
+//    measured in steps of a power of two along each axis, so that every
+//    bound comes out exactly the same however it is unpacked.
+//  - A node's interior children are consecutive nodes, and the primitives
+//    of its leaves consecutive entries in the hierarchy's primitive list, so
+//    one index locates each, and a leaf is only its count of primitives.
+//
+// Where the processor has AVX2, all eight of a node's children are unpacked
+// and tested against a ray at once; elsewhere they are tested one by one.
+// Unpacking costs more than the node reads it saves while the binary
+// hierarchy fits in cache, so until then this one renders more slowly.
+//
+// The hierarchy is not lazy, refitted or streamed, and has no nodes to cull
+// to, so rays start from the root; it is built again from the binary one
+// whenever that changes, reusing its storage.
+// ==========================================================================
+#ifndef WIDEBVH_H
+#define WIDEBVH_H
+
+#include <vector>
+#include <stdint.h>
+#include <glm/glm.hpp>
+#include "Scene.h"
+#include "Accelerator.h"
+#include "Bvh.h"
+
+// --------------------------------------------------------------------------
+
+// 64 bytes, aligned to a cache line. Along each axis child i's box runs from
+// lower[axis][i] to upper[axis][i] steps of 2^exponent[axis] from the
+// node's corner; the first childCount slots are in use.
+struct alignas(64) WideBvhNode
+{
+	static const int WIDTH = 8;
+	static const int COUNT_BITS = 3;
+
+	uint8_t   lower[3][WIDTH];
+	uint8_t   upper[3][WIDTH];
+	uint32_t  firstChild;       // node index of the first interior child
+	uint32_t  firstPrim;        // primitive list entry of the first leaf's first primitive
+	uint32_t  leafCounts;       // COUNT_BITS per slot: primitives of a leaf, 0 for an interior node
+	int8_t    exponent[3];
+	uint8_t   childCount;
+
+	int LeafCount(int i) const { return (leafCounts >> (COUNT_BITS * i)) & ((1 << COUNT_BITS) - 1); }
+};
+
+class WideBvh : public Accelerator
+{
+	Scene*      m_scene;
+	std::vector<char> m_storage;    // holds the nodes, from its first cache line boundary
+	WideBvhNode* m_nodes;
+	uint32_t    m_nodeCount;
+	uint32_t    m_capacity;         // nodes allocated
+	std::vector<uint32_t> m_prims;  // primitive ids, grouped by node and then by leaf
+	glm::vec3   m_origin;           // the root's lower corner
+	bool        m_avx2;             // whether the processor can run the AVX2 tests
+
+	WideBvh(const WideBvh&);
+	WideBvh& operator=(const WideBvh&);
+
+public:
+	static const int STACK_SIZE = 64 * (WideBvhNode::WIDTH - 1) + 1;
+
+	WideBvh();
+
+	// collapses bvh, a finished (not lazy) hierarchy over scene, into this one
+	void Build(Scene& scene, const Bvh& bvh);
+
+	// the Accelerator queries; cuts are left empty and ignored
+	bool ClosestHit(const glm::vec3& o, const glm::vec3& d, SurfaceHit& hit, const BvhCut* cut = 0) override;
+	void Cull(const Frustum& frustum, BvhCut& cut) override;
+	bool Occluded(const glm::vec3& o, const glm::vec3& d, float maxDist) override;
+
+	uint32_t NodeCount() const { return m_nodeCount; }
+
+	// bytes taken by the nodes
+	size_t NodeBytes() const { return size_t(m_nodeCount) * sizeof(WideBvhNode); }
+
+	// whether the children are tested with AVX2
+	bool Vectorised() const { return m_avx2; }
+};
+
+// --------------------------------------------------------------------------
+#endif // WIDEBVH_H
@@ -15,9 +15,19 @@
 #include <algorithm>
 #include <string>
 #include <iterator>
+#include <iomanip>
 #include <math.h>
 #include <glm/glm.hpp>
 #include "ImageBuffer.h"
+#include "Scene.h"
+#include "Render.h"
+#include "Bvh.h"
+#include "Grid.h"
+#include "WideBvh.h"
+#include "Parallel.h"
+#include "SceneCache.h"
+#include "FastMath.h"
+#include "FileWatcher.h"
 
 // Specify that we want the OpenGL core profile before including GLFW headers
 #ifndef LAB_LINUX
@@ -37,6 +47,35 @@ void QueryGLVersion();
 bool CheckGLErrors();
 ImageBuffer img;
 
+// the scene being traced, the structures that can accelerate tracing it and
+// the one chosen, the camera viewing it, and the renderer tracing it
+Scene scene;
+Bvh bvh;
+Grid grid;
+WideBvh wideBvh;
+Accelerator* accelerator = &bvh;
+SceneCache sceneCache;
+Camera camera;
+ProgressiveRenderer renderer;
+
+// the image pixel where a drag with the left mouse button began, if one is
+// under way
+ivec2 dragStart;
+bool dragging = false;
+
+// how scene files are loaded, as chosen on the command line
+bool lazyBuild = false;
+bool useCache = true;
+size_t streamBudget = 0;
+
+// seconds between showing the tiles finished so far while rendering, and
+// between checks of the scene file for changes once rendering is done
+const double DISPLAY_INTERVAL = 1.0 / 30.0;
+const double WATCH_INTERVAL = 0.1;
+
+// time set aside for saving an image rendered to a deadline, per pixel
+const double SAVE_SECONDS_PER_PIXEL = 1e-6;
+
 string LoadSource(const string &filename);
 GLuint CompileShader(GLenum shaderType, const string &source);
 GLuint LinkProgram(GLuint vertexShader, GLuint fragmentShader);
@@ -56,12 +95,6 @@ struct MyShader
 	{}
 };
 
-struct coord3D {
-	float x;
-	float y;
-	float z;
-};
-
 // load, compile, and link shaders, returning true if successful
 bool InitializeShaders(MyShader *shader)
 {
@@ -195,998 +228,549 @@ void RenderScene(MyGeometry *geometry, MyShader *shader)
 }
 
 // --------------------------------------------------------------------------
-// GLFW callback functions
+// Benchmarking
 
-// reports GLFW errors
-void ErrorCallback(int error, const char* description)
+// Renders the scene offscreen at width x height with each pixel order, taking
+// the best of a few runs, and reports the times. The camera's focal length is
+// scaled with the image so every size shows the same view.
+void BenchmarkOrders(int width, int height, int threads)
 {
-	cout << "GLFW ERROR " << error << ":" << endl;
-	cout << description << endl;
+	const int RUNS = 3;
+	Camera view(camera);
+	view.focal *= float(width) / img.Width();
+
+	vector<vec3> reference;
+	for (int i = 0; i < PIXEL_ORDER_COUNT; i++) {
+		PixelOrder order = PixelOrder(i);
+		renderer.SetOrder(order);
+		double best = 0;
+		for (int run = 0; run < RUNS; run++) {
+			double start = glfwGetTime();
+			renderer.StartOffscreen(&scene, accelerator, width, height, view, threads);
+			renderer.Wait();
+			double seconds = glfwGetTime() - start;
+			best = (run == 0) ? seconds : std::min(best, seconds);
+		}
+		cout << pixelOrderName(order) << ": " << best * 1000.0 << " ms, "
+		     << width * height / best * 1e-6 << " Mpixels/s" << endl;
+
+		// the order changes only the speed, never the picture
+		if (reference.empty())
+			reference = renderer.Pixels();
+		else if (renderer.Pixels() != reference)
+			cout << "  image differs from " << pixelOrderName(SCANLINE_ORDER) << " order!" << endl;
+	}
+	renderer.Stop();
 }
 
-// handles keyboard input events
-void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+// Checks the fast math routines against the library functions, then renders
+// the scene at width x height in both math modes and reports the times and
+// the largest difference between the two images.
+void BenchmarkMath(int width, int height, int threads, PixelOrder order)
 {
-	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
-		glfwSetWindowShouldClose(window, GL_TRUE);
-}
-
-struct Plane {
-	vec3 p;
-	vec3 n;
-	vec3 colour;
-
-	vec3 intersect;
-	float intmag;
-};
-
-struct Light {
-	vec3 p;
-	vec3 r;
-	float intensity;
-};
-
-struct Sphere {
-	vec3 c;
-	float r;
-	vec3 colour;
-
-	vec3 n;
-	vec3 intersect;
-	float intmag;
-};
-
-struct Triangle {
-	Plane pl;
-	vec3 p0;
-	vec3 p1;
-	vec3 p2;
-	vec3 px;
-	vec3 colour;
-
-	float a;
-	float a0;
-	float a1;
-	float a2;
-
-	float u;
-	float v;
-	float w;
-
-	vec3 intersect;
-	float intmag;
-};
-
-bool intersectSphere(Sphere& cr, vec3& d, vec3& o) {
-	float A = dot(d, d);
-	float B = 2*dot(d, (o-cr.c));
-	float C = (dot((o-cr.c), (o-cr.c))-pow(cr.r,2));
-	
-	float quad = pow(B,2)-(4*A*C);
-	if (quad < 0) {
-		return false;
+	FastMathErrors error = measureFastMathErrors(1 << 20);
+	FastMathErrors tolerance = fastMathTolerances();
+	bool passed = error.rsqrt <= tolerance.rsqrt && error.normalize <= tolerance.normalize
+		&& error.power <= tolerance.power && error.diffuse <= tolerance.diffuse
+		&& error.specular <= tolerance.specular;
+	cout << "fast math error: rsqrt " << error.rsqrt << ", normalize " << error.normalize
+	     << ", pow " << error.power << ", batch diffuse " << error.diffuse
+	     << ", batch specular " << error.specular << (passed ? " (ok)" : " (TOO LARGE)") << endl;
+
+	// the lighting kernel alone, over the same batch many times
+	const int KERNEL_RUNS = 1 << 18;
+	ShadeBatch batch;
+	for (int k = 0; k < ShadeBatch::WIDTH; k++) {
+		batch.nx[k] = 0.1f * k; batch.ny[k] = 1; batch.nz[k] = 0.2f;
+		batch.lx[k] = 1; batch.ly[k] = 2; batch.lz[k] = -0.5f * k;
+		batch.dx[k] = -0.3f; batch.dy[k] = -1; batch.dz[k] = 0.1f * k;
 	}
-	float t = (-B + sqrt(quad))/(2*A);
-
-	cr.intersect = o + t*d;
-	cr.n = cr.intersect - cr.c;
-	cr.intmag = length(cr.intersect);
-	
-	return true;
-}
-
-void initializeTrianglePlane(Triangle& t) {
-	vec3 u(t.p1 - t.p0);
-	vec3 v(t.p2 - t.p0);
+	float sink = 0;
+	double start = glfwGetTime();
+	for (int run = 0; run < KERNEL_RUNS; run++) {
+		batch.nx[run % ShadeBatch::WIDTH] += 1e-6f;
+		phongBatchExact(batch, 256);
+		sink += batch.specular[0];
+	}
+	double exactSeconds = glfwGetTime() - start;
+	start = glfwGetTime();
+	for (int run = 0; run < KERNEL_RUNS; run++) {
+		batch.nx[run % ShadeBatch::WIDTH] += 1e-6f;
+		phongBatch(batch, 256);
+		sink += batch.specular[0];
+	}
+	double fastSeconds = glfwGetTime() - start;
+	double hits = double(KERNEL_RUNS) * ShadeBatch::WIDTH;
+	cout << "lighting kernel: exact " << exactSeconds / hits * 1e9 << " ns/hit, batched fast "
+	     << fastSeconds / hits * 1e9 << " ns/hit" << (sink == 12345 ? " " : "") << endl;
+
+	Camera view(camera);
+	view.focal *= float(width) / img.Width();
+	renderer.SetOrder(order);
+
+	MathMode previous = mathMode;
+	vector<vec3> images[2];
+	const MathMode modes[2] = { EXACT_MATH, FAST_MATH };
+	const char* names[2] = { "exact math", "fast math" };
+	for (int i = 0; i < 2; i++) {
+		mathMode = modes[i];
+		double best = 0;
+		for (int run = 0; run < 3; run++) {
+			double start = glfwGetTime();
+			renderer.StartOffscreen(&scene, accelerator, width, height, view, threads);
+			renderer.Wait();
+			double seconds = glfwGetTime() - start;
+			best = (run == 0) ? seconds : std::min(best, seconds);
+		}
+		images[i] = renderer.Pixels();
+		cout << names[i] << ": " << best * 1000.0 << " ms" << endl;
+	}
+	mathMode = previous;
+	renderer.Stop();
 
-	t.pl.n.x = dot(u.y, v.z)-dot(u.z, v.y);
-	t.pl.n.y = dot(u.z, v.x)-dot(u.x, v.z);
-	t.pl.n.z = dot(u.x, v.y)-dot(u.y, v.x);
-	t.pl.p = t.p0;
+	float difference = 0;
+	for (size_t i = 0; i < images[0].size(); i++) {
+		vec3 delta(abs(images[0][i] - images[1][i]));
+		difference = std::max(difference, std::max(delta.x, std::max(delta.y, delta.z)));
+	}
+	cout << "  largest channel difference between them: " << difference << endl;
 }
 
-float intersectPlane(Plane& pl, vec3& d, vec3& o) {
-	float t1 = dot((pl.p-o), pl.n);
-	float t2 = dot(d, pl.n);
-
-	if (t2 == 0)
-		return 0;
-
-	pl.intersect = o + (t1/t2)*d;
-	pl.intmag = length(pl.intersect);
-	return t1/t2;
+// Builds a BVH, a grid and a wide BVH over the scene afresh, and BVHs split
+// by the linear builders, then renders it at width x height through each,
+// and through the BVH again with its primary rays interleaved, and reports
+// the times, and the memory taken by the hierarchies' nodes, so the fastest
+// can be chosen for the scene with --accel, --build and --interleave.
+void BenchmarkAccelerators(int width, int height, int threads, PixelOrder order)
+{
+	const int ACCELERATORS = 6;
+	const int INTERLEAVED = 5;
+	Camera view(camera);
+	view.focal *= float(width) / img.Width();
+	renderer.SetOrder(order);
+
+	// the wide BVH is collapsed from the binary one, so its build counts both
+	Bvh benchBvh, benchLinear, benchTreelet;
+	Grid benchGrid;
+	WideBvh benchWide;
+	double start = glfwGetTime();
+	benchBvh.Build(scene, false, threads);
+	double builds[ACCELERATORS] = { glfwGetTime() - start, 0, 0, 0, 0, 0 };
+	start = glfwGetTime();
+	benchGrid.Build(scene, threads);
+	builds[1] = glfwGetTime() - start;
+	start = glfwGetTime();
+	benchWide.Build(scene, benchBvh);
+	builds[2] = builds[0] + glfwGetTime() - start;
+	benchLinear.SetBuilder(LINEAR_BUILDER);
+	start = glfwGetTime();
+	benchLinear.Build(scene, false, threads);
+	builds[3] = glfwGetTime() - start;
+	benchTreelet.SetBuilder(TREELET_BUILDER);
+	start = glfwGetTime();
+	benchTreelet.Build(scene, false, threads);
+	builds[4] = glfwGetTime() - start;
+	builds[INTERLEAVED] = builds[0];
+
+	Accelerator* accelerators[ACCELERATORS] = {
+		&benchBvh, &benchGrid, &benchWide, &benchLinear, &benchTreelet, &benchBvh
+	};
+	const char* names[ACCELERATORS] = { "bvh", "grid", "wide", "linear", "treelet", "interleaved" };
+	double totals[ACCELERATORS];
+	vector<vec3> images[ACCELERATORS];
+	for (int i = 0; i < ACCELERATORS; i++) {
+		double best = 0;
+		renderer.SetInterleaving(i == INTERLEAVED);
+		for (int run = 0; run < 3; run++) {
+			double start = glfwGetTime();
+			renderer.StartOffscreen(&scene, accelerators[i], width, height, view, threads);
+			renderer.Wait();
+			double seconds = glfwGetTime() - start;
+			best = (run == 0) ? seconds : std::min(best, seconds);
+		}
+		images[i] = renderer.Pixels();
+		totals[i] = builds[i] + best;
+		cout << names[i] << ": build " << builds[i] * 1000.0 << " ms, render " << best * 1000.0 << " ms";
+		if (i == 0)
+			cout << " (" << benchBvh.NodeCount() << " nodes, "
+			     << benchBvh.NodeCount() * sizeof(BvhNode) / 1024.0 << " KB, built on "
+			     << buildThreads(threads) << " threads)";
+		if (accelerators[i] == &benchGrid) {
+			ivec3 resolution(benchGrid.Resolution());
+			uint32_t prims = std::max(boundedPrimitiveCount(scene), 1u);
+			cout << " (" << resolution.x << "x" << resolution.y << "x" << resolution.z << " cells, "
+			     << float(benchGrid.ReferenceCount()) / prims << " references per primitive)";
+		}
+		if (accelerators[i] == &benchWide)
+			cout << " (" << benchWide.NodeCount() << " nodes, " << benchWide.NodeBytes() / 1024.0 << " KB, "
+			     << (benchWide.Vectorised() ? "AVX2" : "scalar") << " box tests)";
+		cout << endl;
+	}
+	renderer.Stop();
+	renderer.SetInterleaving(false);
+
+	// the others may settle ties between equally near primitives differently
+	// from the BVH
+	int fastest = 0;
+	for (int i = 1; i < ACCELERATORS; i++) {
+		size_t differing = 0;
+		for (size_t p = 0; p < images[0].size(); p++)
+			differing += images[0][p] != images[i][p];
+		cout << "  " << names[i] << ": " << differing << " pixels differ from bvh" << endl;
+		if (totals[i] < totals[fastest])
+			fastest = i;
+	}
+	cout << "  fastest to build and render: " << names[fastest] << endl;
 }
 
-void initializeTriangle(Triangle& t) {
-	vec3 p01(t.p1-t.p0);
-	vec3 p02(t.p2-t.p0);
-	vec3 p0x(t.px-t.p0);
-	vec3 p12(t.p2-t.p1);
-	vec3 p1x(t.px-t.p1);
-	vec3 p20(t.p0-t.p2);
-	vec3 p2x(t.px-t.p2);
-	
-	vec3 tmp(cross(p01, p02));
-	t.a = tmp.x+tmp.y+tmp.z;
-
-	vec3 tmp2(cross(p12, p1x));
-	t.a0 = tmp2.x+tmp2.y+tmp2.z;
-
-	vec3 tmp3(cross(p20, p2x));
-	t.a1 = tmp3.x+tmp3.y+tmp3.z;
-
-	vec3 tmp4(cross(p01, p0x));
-	t.a2 = tmp4.x+tmp4.y+tmp4.z;
-
-	t.v = t.a2/t.a;
-	t.u = t.a1/t.a;
-	t.w = t.a0/t.a;
+// Path traces a reference image with many samples per pixel, then the
+// scene at width x height with samples per pixel from each sampler, and
+// reports the time and the RMS error of each against the reference. The
+// reference begins with the samples of the image from the same sampler, so
+// it takes enough more that those hardly count.
+void BenchmarkSamplers(int width, int height, int threads, PixelOrder order, int samples)
+{
+	const int REFERENCE_FACTOR = 64;
+	Camera view(camera);
+	view.focal *= float(width) / img.Width();
+	renderer.SetOrder(order);
+
+	renderer.SetSampler(SOBOL_SAMPLER);
+	renderer.SetPathTracing(samples * REFERENCE_FACTOR);
+	renderer.StartOffscreen(&scene, accelerator, width, height, view, threads);
+	renderer.Wait();
+	vector<vec3> reference(renderer.Pixels());
+
+	renderer.SetPathTracing(samples);
+	for (int i = 0; i < SAMPLER_TYPE_COUNT; i++) {
+		renderer.SetSampler(SamplerType(i));
+		double start = glfwGetTime();
+		renderer.StartOffscreen(&scene, accelerator, width, height, view, threads);
+		renderer.Wait();
+		double seconds = glfwGetTime() - start;
+
+		double squares = 0;
+		const vector<vec3>& pixels = renderer.Pixels();
+		for (size_t p = 0; p < pixels.size(); p++) {
+			vec3 error(glm::min(pixels[p], vec3(1)) - glm::min(reference[p], vec3(1)));
+			squares += dot(error, error) / 3;
+		}
+		cout << samplerTypeName(SamplerType(i)) << " sampler: " << seconds * 1000.0 << " ms, RMS error "
+		     << sqrt(squares / pixels.size()) << " at " << samples << " samples per pixel" << endl;
+	}
+	renderer.Stop();
 }
 
+// --------------------------------------------------------------------------
+// Rendering to a deadline
 
-bool intersectTriangle(Triangle& tr, vec3& d, vec3& o) {
-	initializeTrianglePlane(tr);
-	float t = intersectPlane(tr.pl, d, o);
-	if (t == 0)
-		return false;
-	tr.px = {(o.x + t*d.x), (o.y + t*d.y), (o.z + t*d.z)};
-	initializeTriangle(tr);
-	if (tr.u*tr.v < 0 || tr.u*tr.w < 0 || tr.v*tr.w < 0)
-		return false;
-
-	tr.intersect = o + t*d; 
-	tr.intmag = length(tr.intersect);
-	return true;
-}
-
-// print a vec3
-void printVec3(const char* prefix, const vec3& v)
+// says so if the render just started carries on from a checkpoint
+void ReportResumed()
 {
-    cout << prefix << " (" << v.x << ", " << v.y << ", " << v.z << ")" << endl;
+	if (renderer.ResumedSamples() > 0)
+		cout << "Resumed from a checkpoint of " << renderer.ResumedSamples() << " paths per pixel" << endl;
 }
 
-void shading(vec3& colour, vec3& n, Light& lightpoint, vec3& intersect, vec3& d) {
-	float p = 256;
-	float cl = 1;
-	float ca = 0.2;
-	vec3 l(lightpoint.p - intersect);
-	vec3 origin(0, 0, 0);
-	lightpoint.intensity = ca + cl*dot(normalize(n), (normalize(l)));
-
-	vec3 d_hat(normalize(d));
-	vec3 n_hat(normalize(n));
-	vec3 l_hat(normalize(l));
-	vec3 ref(reflect(l_hat, n_hat));
-	/* printVec3("h", h); */
-	
-	vec3 cp(colour);
-	colour.x *= lightpoint.intensity;  
-	if(dot(d_hat, ref) < 0) {
-		colour.x += cl*cp.x*pow(dot(d_hat,ref), p);
-	}
-	colour.y *= lightpoint.intensity;
-	if(dot(d_hat, ref) < 0) {
-		colour.y += cl*cp.y*pow(dot(d_hat,ref), p);
+// Path traces the scene into the window's image, then saves it to file and
+// reports the paths and estimated error of every tile, all within budget
+// seconds of launched, the GLFW time the program started, so that loading
+// the scene counts too.
+void RenderToDeadline(double launched, double budget, const string& file, int threads)
+{
+	double start = glfwGetTime();
+	double saving = SAVE_SECONDS_PER_PIXEL * img.Width() * img.Height();
+	renderer.SetTimeBudget(std::max(launched + budget - saving - start, 1e-3));
+	renderer.Start(&scene, accelerator, &img, camera, threads);
+	ReportResumed();
+	renderer.Wait();
+	double rendered = glfwGetTime();
+	renderer.Stop();
+	img.SaveToFile(file);
+
+	const vector<int>& samples = renderer.TileSamples();
+	const vector<float>& errors = renderer.TileErrors();
+	int least = samples.empty() ? 0 : *min_element(samples.begin(), samples.end());
+	int most = samples.empty() ? 0 : *max_element(samples.begin(), samples.end());
+	double meanSamples = 0, meanError = 0, worstError = 0;
+	for (size_t i = 0; i < samples.size(); i++) {
+		meanSamples += samples[i];
+		meanError += errors[i];
+		worstError = std::max(worstError, double(errors[i]));
 	}
-	colour.z *= lightpoint.intensity;
-	if(dot(d_hat, ref) < 0) {
-		colour.z += cl*cp.z*pow(dot(d_hat,ref), p);
+	meanSamples /= std::max(samples.size(), size_t(1));
+	meanError /= std::max(samples.size(), size_t(1));
+	cout << "Rendered for " << (rendered - start) * 1000.0 << " ms, done " << (glfwGetTime() - launched) * 1000.0
+	     << " ms after starting of " << budget * 1000.0 << " ms allowed" << endl;
+	cout << "Paths per pixel: " << least << " to " << most << ", " << meanSamples << " on average; "
+	     << "RMS error per tile " << meanError << " on average, " << worstError << " at worst" << endl;
+
+	// a map of the tiles, top row first, with their errors in thousandths of
+	// white, or - where a tile has too few paths to tell
+	cout << "Error by tile (x 1000):" << endl;
+	int tilesX = (img.Width() + ProgressiveRenderer::TILE_SIZE - 1) / ProgressiveRenderer::TILE_SIZE;
+	for (int row = int(errors.size()) / tilesX - 1; row >= 0; row--) {
+		for (int column = 0; column < tilesX; column++) {
+			float error = errors[row * tilesX + column];
+			if (isinf(error))
+				cout << setw(5) << "-";
+			else
+				cout << setw(5) << int(error * 1000 + 0.5f);
+		}
+		cout << endl;
 	}
 }
 
-void checkShadow1(vec3& intercept, vec3& colours, Light& lightpoint, Triangle bluepyramid[], Sphere& sphere) {
-	vec3 l(lightpoint.p - intercept);
-
-	for (uint i = 0; i <= 4; i++) {
-		if (intersectTriangle(bluepyramid[i], l, intercept)) {
-			colours.x = 0.1;
-			colours.y = 0.1;
-			colours.z = 0.1;
-		}
-	}	
+// --------------------------------------------------------------------------
+// Scene loading
 
-	if (intersectSphere(sphere, l, intercept)) {
-		colours.x = 0.1;
-		colours.y = 0.1;
-		colours.z = 0.1;
+// builds the chosen acceleration structure over the scene
+void BuildAccelerator()
+{
+	if (accelerator == &grid) {
+		grid.Build(scene);
+		return;
 	}
+	bvh.SetPager(0);
+	bvh.Build(scene, lazyBuild);
+	if (accelerator == &wideBvh)
+		wideBvh.Build(scene, bvh);
 }
 
-void checkShadow2(vec3& intercept, vec3& colours, Light& lightpoint, Triangle greencone[], Triangle rediso[], Sphere& yellow_sp, Sphere& grey_sp,
-		Sphere& purp_sp) {
-	vec3 l(lightpoint.p - intercept);
-
-	for (uint i = 0; i <= 12; i++) {
-		if (intersectTriangle(greencone[i], l, intercept)) {
-			colours.x = 0.1;
-			colours.y = 0.1;
-			colours.z = 0.1;
-		}
-	}	
-
-	for (uint i = 0; i <= 20; i++) {
-		if (intersectTriangle(rediso[i], l, intercept)) {
-			colours.x = 0.1;
-			colours.y = 0.1;
-			colours.z = 0.1;
-		}
-	}	
+// Builds the acceleration structure over a scene just parsed from file,
+// saving a BVH and the scene to the file's cache.
+void BuildParsedScene(const string& file)
+{
+	BuildAccelerator();
+	if (useCache && !lazyBuild && !SceneCache::Save(file, scene, bvh))
+		cout << "Could not write " << SceneCache::CachePath(file) << endl;
+}
 
-	if (intersectSphere(grey_sp, l, intercept)) {
-		colours.x = 0.1;
-		colours.y = 0.1;
-		colours.z = 0.1;
-	}
-	if (intersectSphere(yellow_sp, l, intercept)) {
-		colours.x = 0.1;
-		colours.y = 0.1;
-		colours.z = 0.1;
-	}
-	if (intersectSphere(purp_sp, l, intercept)) {
-		colours.x = 0.1;
-		colours.y = 0.1;
-		colours.z = 0.1;
-	}
+// Whether scene files are streamed from their caches. A streamed scene may
+// not fit in memory, so it is never parsed whole: its cache is written
+// straight from the file, a part of the scene at a time.
+bool StreamingScenes()
+{
+	return streamBudget > 0 && useCache && !lazyBuild;
 }
 
-void scene_reflect1(int obj, vec3& d, vec3& n, vec3& intersect, vec3& colour, Sphere& cr, Plane& pl, Triangle bluepyramid[], Triangle ceiling[],
-		Triangle redwall[], Triangle greenwall[], Triangle floor[]) {
-	vec3 r(reflect(d, n));	
-	for (uint i = 0; i <= 2; i++) {
-		if (intersectTriangle(greenwall[i], r, intersect)) {
-			colour.x = greenwall[i].colour.x;
-			colour.y = greenwall[i].colour.y;
-			colour.z = greenwall[i].colour.z;
-		}
-	}	
-	for (uint i = 0; i <= 2; i++) {
-		if (intersectTriangle(redwall[i], r, intersect)) {
-			colour.x = redwall[i].colour.x;
-			colour.y = redwall[i].colour.y;
-			colour.z = redwall[i].colour.z;
-		}
-	}	
-	for (uint i = 0; i <= 2; i++) {
-		if (intersectTriangle(floor[i], r, intersect)) {
-			colour.x = floor[i].colour.x;
-			colour.y = floor[i].colour.y;
-			colour.z = floor[i].colour.z;
-		}
-	}	
-	
-	if(obj == 2) {
-		for (uint i = 0; i <= 4; i++) {
-			if (intersectTriangle(bluepyramid[i], r, intersect)) {
-				colour.x = bluepyramid[i].colour.x;
-				colour.y = bluepyramid[i].colour.y;
-				colour.z = bluepyramid[i].colour.z;
+// Reads the scene file again after it has changed. Edits that keep the
+// number of each kind of primitive are applied in place, with the BVH
+// refitted around whatever moved or the grid built again; anything else,
+// and any scene mapped from its cache, is built again from scratch. A
+// streamed scene has its cache written again and streams from that. A file
+// that does not parse, perhaps because it is still being written, leaves
+// the old scene in place.
+void ReloadScene(const string& file)
+{
+	double start = glfwGetTime();
+	if (StreamingScenes()) {
+		// the old scene is traced until the new cache is ready to replace it
+		if (!SceneCache::Write(file))
+			return;
+		renderer.EditScene([&]() {
+			int samples = scene.light.samples;
+			if (sceneCache.Load(file, scene, bvh)) {
+				scene.light.samples = samples;
+				sceneCache.Stream(scene, bvh, streamBudget);
 			}
-		}	
+			return true;
+		});
+		cout << "Scene reloaded in " << (glfwGetTime() - start) * 1000.0 << " ms, streamed from a new cache" << endl;
+		return;
 	}
 
-	if (obj == 1) {
-		if (intersectSphere(cr, r, intersect)) {
-			colour.x = cr.colour.x;
-			colour.y = cr.colour.y;
-			colour.z = cr.colour.z;
+	Scene edited;
+	if (!LoadScene(file, edited))
+		return;
+
+	SceneChanges changes;
+	bool incremental = false;
+	uint32_t rebuilt = 0;
+	renderer.EditScene([&]() {
+		bool inPlace = (accelerator == &grid) || bvh.Updatable();
+		if (inPlace && applySceneEdits(scene, edited, changes)) {
+			incremental = true;
+			if (accelerator != &grid) {
+				rebuilt = bvh.Update(changes.moved);
+				if (accelerator == &wideBvh && !changes.moved.empty())
+					wideBvh.Build(scene, bvh);
+			}
+			else if (!changes.moved.empty()) {
+				grid.Build(scene);
+				rebuilt = 1;
+			}
+			return changes.planes || !changes.moved.empty();
 		}
-	}
+
+		edited.light.samples = scene.light.samples;
+		scene.Swap(edited);
+		BuildParsedScene(file);
+		return true;
+	});
+
+	cout << "Scene reloaded in " << (glfwGetTime() - start) * 1000.0 << " ms";
+	if (incremental)
+		cout << ": " << changes.moved.size() << " primitives moved, " << rebuilt
+		     << (accelerator == &grid ? " grids" : " BVH subtrees") << " rebuilt, " << changes.materials << " materials changed"
+		     << (changes.light ? ", light changed" : "") << (changes.planes ? ", planes changed" : "");
+	else
+		cout << ", rebuilt from scratch";
+	cout << endl;
 }
 
-void scene_reflect2(int obj, vec3& d, vec3& n, vec3& intersect, vec3& colour, Sphere& yellow_sp, Sphere& purple_sp, Sphere& grey_sp, Triangle greencone[], Triangle rediso[]) {
-	vec3 r(reflect(d, n));	
+// --------------------------------------------------------------------------
+// GLFW callback functions
 
-	for (uint i = 0; i <= 12; i++) {
-		if (intersectTriangle(greencone[i], r, intersect)) {
-			colour.x = greencone[i].colour.x;
-			colour.y = greencone[i].colour.y;
-			colour.z = greencone[i].colour.z;
-		}
-	}	
+// reports GLFW errors
+void ErrorCallback(int error, const char* description)
+{
+	cout << "GLFW ERROR " << error << ":" << endl;
+	cout << description << endl;
+}
 
-	if (intersectSphere(yellow_sp, r, intersect)) {
-		colour.x = yellow_sp.colour.x;
-		colour.y = yellow_sp.colour.y;
-		colour.z = yellow_sp.colour.z;
-	}
+// handles keyboard input events
+//  - W/S move forward/back, A/D strafe, R/F move up/down
+//  - arrow keys turn the camera
+//  - I/K, J/L and U/O move the light along z, x and y
+void KeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
+		glfwSetWindowShouldClose(window, GL_TRUE);
+	if (action == GLFW_RELEASE)
+		return;
 
-	if (intersectSphere(yellow_sp, r, intersect)) {
-		colour.x = yellow_sp.colour.x;
-		colour.y = yellow_sp.colour.y;
-		colour.z = yellow_sp.colour.z;
-	}
+	const float move = 0.25f;
+	const float turn = radians(3.f);
+	Camera previous = camera;
 
-	if (obj != 1) {
-		if (intersectSphere(purple_sp, r, intersect)) {
-			colour.x = purple_sp.colour.x;
-			colour.y = purple_sp.colour.y;
-			colour.z = purple_sp.colour.z;
-		}
+	// go back to tracing the whole image after cropping it
+	if (key == GLFW_KEY_C) {
+		renderer.Crop(PixelRect{0, 0, 0, 0});
+		return;
 	}
-	if (obj != 2) {
-		if (intersectSphere(grey_sp, r, intersect)) {
-			colour.x = grey_sp.colour.x;
-			colour.y = grey_sp.colour.y;
-			colour.z = grey_sp.colour.z;
-		}
+
+	// moving only the light keeps every primary hit, so just reshade
+	vec3 light(0, 0, 0);
+	switch (key) {
+	case GLFW_KEY_I: light.z = -move; break;
+	case GLFW_KEY_K: light.z = move; break;
+	case GLFW_KEY_J: light.x = -move; break;
+	case GLFW_KEY_L: light.x = move; break;
+	case GLFW_KEY_U: light.y = move; break;
+	case GLFW_KEY_O: light.y = -move; break;
 	}
-	if(obj != 3) {
-		for (uint i = 0; i <= 20; i++) {
-			if (intersectTriangle(rediso[i], r, intersect)) {
-				colour.x = rediso[i].colour.x;
-				colour.y = rediso[i].colour.y;
-				colour.z = rediso[i].colour.z;
-			}
-		}	
+	if (light != vec3(0, 0, 0)) {
+		Light moved(scene.light);
+		moved.p += light;
+		renderer.Relight(moved);
+		return;
 	}
-}
-
-void renderShapes() {
-	coord3D ray;
-	vec3 origin(0, 0, 0);
-
-	Sphere cr;
-	cr.c = {0.9, -1.925, -6.69};
-	cr.r = 0.825;
-	cr.colour = {0.5, 0.5, 0.5};
-
-	// Light 
-	Light l;
-	l.p = {0, 2.5, -7.75};
-
-	// Plane 
-	Plane pl;
-	pl.p = {0, 0, -10.5};
-	pl.n = {0, 0, 1};
-	pl.colour = {0.5, 0.5, 0.5};
-
-	// Blue triangle
-	Triangle bt1;
-	bt1.p0 = {-0.4, -2.75, -9.55};
-	bt1.p1 = {-0.93, 0.55, -8.51};
-	bt1.p2 = {0.11, -2.75, -7.98};
-	bt1.colour = {0, 0, 0.7};
-
-	Triangle bt2;
-	bt2.p0 = { 0.11, -2.75, -7.98};
-	bt2.p1 = {-0.93, 0.55, -8.51};
-	bt2.p2 = {-1.46, -2.75, -7.47};
-	bt2.colour = {0, 0, 0.7};
-
-	Triangle bt3;
-	bt3.p0 = {-1.46, -2.75, -7.47};
-	bt3.p1 = {-0.93, 0.55, -8.51};
-	bt3.p2 = {-1.97, -2.75, -9.04};
-	bt3.colour = {0, 0, 0.7};
-
-	Triangle bt4;
-	bt4.p0 = {-1.97, -2.75, -9.04};
-	bt4.p1 = {-0.93, 0.55, -8.51};
-	bt4.p2 = {-0.4, -2.75, -9.55};
-	bt4.colour = {0, 0, 0.7};
-	Triangle bluepyramid[4] = {bt1, bt2, bt3, bt4};
-
-	// Ceiling
-	Triangle c1;
-	c1.p0 = { 2.75, 2.75, -10.5};
-	c1.p1 = { 2.75, 2.75, -5};
-	c1.p2 = { -2.75, 2.75, -5};
-	c1.colour = {0.3, 0.3, 0.3};
-
-	Triangle c2;
-	c2.p0 = { -2.75, 2.75, -10.5};
-	c2.p1 = { 2.75, 2.75, -10.5};
-	c2.p2 = { -2.75, 2.75, -5};
-	c2.colour = {0.3, 0.3, 0.3};
-	Triangle ceiling[2] = {c1, c2};
-
-	/* Green wall on right */ 
-	Triangle gw1;
-	gw1.p0 = {2.75, 2.75, -5};
-	gw1.p1 = {2.75, 2.75, -10.5};
-	gw1.p2 = {2.75, -2.75, -10.5};
-	gw1.colour = {0, 0.5, 0};
-
-	Triangle gw2;
-	gw2.p0 = {2.75, -2.75, -5};
-	gw2.p1 = {2.75, 2.75, -5};
-	gw2.p2 = {2.75, -2.75, -10.5};
-	gw2.colour = {0, 0.5, 0};
-	Triangle greenwall[2] = {gw1, gw2};
-
-	/* Red wall on left */
-	Triangle rw1;
-	rw1.p0 = {-2.75, -2.75, -5};
-	rw1.p1 = {-2.75, -2.75, -10.5};
-	rw1.p2 = {-2.75, 2.75, -10.5};
-	rw1.colour = {0.5, 0, 0};
-
-	Triangle rw2;
-	rw2.p0 = {-2.75, 2.75, -5};
-	rw2.p1 = {-2.75, -2.75, -5};
-	rw2.p2 = {-2.75, 2.75, -10.5};
-	rw2.colour = {0.5, 0, 0};
-	Triangle redwall[2] = {rw1, rw2};
-
-	/* Floor */
-	Triangle f1;
-	f1.p0 = {2.75, -2.75, -5};
-	f1.p1 = {2.75, -2.75, -10.5};
-	f1.p2 = {-2.75, -2.75, -10.5};
-	f1.colour = {0.3, 0.3, 0.3};
-
-	Triangle f2;
-	f2.p0 = {-2.75, -2.75, -5};
-	f2.p1 = {2.75, -2.75, -5};
-	f2.p2 = {-2.75, -2.75, -10.5};
-	f2.colour = {0.3, 0.3, 0.3};
-
-	Triangle floor[2] = {f1, f2};
-	ray.z = -500;
-
-	for (int x = 0; x < img.Width(); x++) {
-		for (int y = 0; y < img.Height(); y++) {
-			float closest_mag = 200;
-			ray.x = -1*(img.Width()/2.f - 0.5f)+x;
-			ray.y = -1*(img.Height()/2.f - 0.5f)+y;
-			vec3 colour(0, 0, 0);
-			vec3 d(ray.x, ray.y, ray.z);
-
-			if (intersectPlane(pl, d, origin) != 0.f) {
-				if(pl.intmag < closest_mag) {
-					closest_mag = pl.intmag;
-					colour.x = 0.5;
-					colour.y = 0.5;
-					colour.z = 0.5;
-					shading(colour, pl.n, l, pl.intersect, d);
-				}
-			}
-			for (uint i = 0; i < sizeof(bluepyramid)/sizeof(Triangle); i++) {
-				if (intersectTriangle(bluepyramid[i], d, origin)) {
-					if(bluepyramid[i].intmag < closest_mag) {
-						closest_mag = bluepyramid[i].intmag;
-						colour.x = 0;
-						colour.y = 0;
-						colour.z = 0.7;
-						scene_reflect1(1, d, bluepyramid[i].pl.n, bluepyramid[i].intersect, colour, cr, pl, bluepyramid, ceiling, redwall, greenwall, floor);
-						shading(colour, bluepyramid[i].pl.n, l, bluepyramid[i].intersect, d);
-					}
-				}
-			}
-			for (uint i = 0; i < sizeof(floor)/sizeof(Triangle); i++) {
-				if (intersectTriangle(floor[i], d, origin)) {
-					if(floor[i].intmag < closest_mag) {
-						closest_mag = floor[i].intmag;
-						colour.x = 0.3;
-						colour.y = 0.3;
-						colour.z = 0.3;
-						shading(colour, floor[i].pl.n, l, floor[i].intersect, d);
-						checkShadow1(floor[i].intersect, colour, l, bluepyramid, cr);
-					}
-				}
-			}
 
-			for (uint i = 0; i < sizeof(ceiling)/sizeof(Triangle); i++) {
-				if (intersectTriangle(ceiling[i], d, origin)) {
-					if(ceiling[i].intmag < closest_mag) {
-						closest_mag = ceiling[i].intmag;
-						colour.x = 0.3;
-						colour.y = 0.3;
-						colour.z = 0.3;
-						shading(colour, ceiling[i].pl.n, l, ceiling[i].intersect, d);
-					}
-				}
-			}
-
-			for (uint i = 0; i < sizeof(greenwall)/sizeof(Triangle); i++) {
-				if (intersectTriangle(greenwall[i], d, origin)) {
-					if(greenwall[i].intmag < closest_mag) {
-						closest_mag = greenwall[i].intmag;
-						colour.x = 0;
-						colour.y = 0.5;
-						colour.z = 0;
-						shading(colour, greenwall[i].pl.n, l, greenwall[i].intersect, d);
-					}
-				}
-			}
-
-			for (uint i = 0; i < sizeof(redwall)/sizeof(Triangle); i++) {
-				if (intersectTriangle(redwall[i], d, origin)) {
-					if(redwall[i].intmag < closest_mag) {
-						closest_mag = redwall[i].intmag;
-						colour.x = 0.5;
-						colour.y = 0;
-						colour.z = 0;
-						shading(colour, redwall[i].pl.n, l, redwall[i].intersect, d);
-					}
-				}
-			}
-			if (intersectSphere(cr, d, origin)) {
-				if(cr.intmag < closest_mag) {
-					closest_mag = cr.intmag;
-					colour.x = 0.5;
-					colour.y = 0.5;
-					colour.z = 0.5;
-					scene_reflect1(2, d, cr.n, cr.intersect, colour, cr, pl, bluepyramid, ceiling, redwall, greenwall, floor);
-					shading(colour, cr.n, l, cr.intersect, d);
-				}
-			}
-			img.SetPixel(x, y, colour);
-		}
+	switch (key) {
+	case GLFW_KEY_W:     camera.eye += move*camera.Forward(); break;
+	case GLFW_KEY_S:     camera.eye -= move*camera.Forward(); break;
+	case GLFW_KEY_D:     camera.eye += move*camera.Right(); break;
+	case GLFW_KEY_A:     camera.eye -= move*camera.Right(); break;
+	case GLFW_KEY_R:     camera.eye += move*camera.Up(); break;
+	case GLFW_KEY_F:     camera.eye -= move*camera.Up(); break;
+	case GLFW_KEY_LEFT:  camera.yaw -= turn; break;
+	case GLFW_KEY_RIGHT: camera.yaw += turn; break;
+	case GLFW_KEY_UP:    camera.pitch = std::min(camera.pitch + turn, radians(89.f)); break;
+	case GLFW_KEY_DOWN:  camera.pitch = std::max(camera.pitch - turn, radians(-89.f)); break;
+	default: return;
 	}
+
+	// drop whatever is being traced and start over from a coarse preview
+	if (camera.eye != previous.eye || camera.yaw != previous.yaw || camera.pitch != previous.pitch)
+		renderer.Restart(camera);
 }
 
-void renderShapes2() {
-	coord3D ray;
-	ray.z = -500;
-	vec3 origin(0, 0, 0);
-
-	Light l;
-	l.p = {4, 6, 1};
-
-	Plane pl;
-	pl.p = {0, -1, 0};
-	pl.n = {0, 1, 0};
-	pl.colour = {0.5, 0.5, 0.5};
-
-	Plane pl2;
-	pl2.p = {0, 0, -12};
-	pl2.n = {0, 0, 1};
-	pl2.colour = {0.5, 0.3, 0};
-
-	/* # Large yellow sphere */
-	Sphere yellow_sp;
-	yellow_sp.c = {1, -0.5, -3.5};
-	yellow_sp.r = 0.5;
-	yellow_sp.colour = {0.5, 0.5, 0};
-
-	/* # Reflective grey sphere */
-	Sphere grey_sp;
-	grey_sp.c = {0, 1, -5};
-	grey_sp.r = 0.4;
-	grey_sp.colour = {0.5, 0.5, 0.5};
-
-	/* # Metallic purple sphere */
-	Sphere purp_sp;
-	purp_sp.c = {-0.8, -0.75, -4};
-	purp_sp.r = 0.25;
-	purp_sp.colour = {0.5, 0, 0.5};
-
-	/* # Green cone */
-	Triangle gc1;
-	gc1.p0 = {0, -1, -5.8};
-	gc1.p1 = {0, 0.6, -5};
-	gc1.p2 = {0.4, -1, -5.693};
-	gc1.colour = {0, 0.7, 0};
-
-	Triangle gc2;
-	gc2.p0 = {0.4, -1, -5.693};
-	gc2.p1 = {0, 0.6, -5};
-	gc2.p2 = {0.6928, -1, -5.4};
-	gc2.colour = {0, 0.7, 0};
-
-	Triangle gc3;
-	gc3.p0 = {0.6928, -1, -5.4};
-	gc3.p1 = {0, 0.6, -5};
-	gc3.p2 = {0.8, -1, -5};
-	gc3.colour = {0, 0.7, 0};
-
-	Triangle gc4;
-	gc4.p0 = {0.8, -1, -5};
-	gc4.p1 = {0, 0.6, -5};
-	gc4.p2 = {0.6928, -1, -4.6};
-	gc3.colour = {0, 0.7, 0};
-
-	Triangle gc5;
-	gc5.p0 = {0.6928, -1, -4.6};
-	gc5.p1 = {0, 0.6, -5};
-	gc5.p2 = {0.4, -1, -4.307};
-	gc5.colour = {0, 0.7, 0};
-
-	Triangle gc6;
-	gc6.p0 = {0.4, -1, -4.307};
-	gc6.p1 = {0, 0.6, -5};
-	gc6.p2 = {0, -1, -4.2};
-	gc6.colour = {0, 0.7, 0};
-
-	Triangle gc7;
-	gc7.p0 = {0, -1, -4.2};
-	gc7.p1 = {0, 0.6, -5};
-	gc7.p2 = {-0.4, -1, -4.307};
-	gc7.colour = {0, 0.7, 0};
-
-	Triangle gc8;
-	gc8.p0 = {-0.4, -1, -4.307};
-	gc8.p1 = {0, 0.6, -5};
-	gc8.p2 = {-0.6928, -1, -4.6};
-	gc8.colour = {0, 0.7, 0};
-
-	Triangle gc9;
-	gc9.p0 = {-0.6928, -1, -4.6};
-	gc9.p1 = {0, 0.6, -5};
-	gc9.p2 = {-0.8, -1, -5};
-	gc9.colour = {0, 0.7, 0};
-
-	Triangle gc10;
-	gc10.p0 = {-0.8, -1, -5};
-	gc10.p1 = {0, 0.6, -5};
-	gc10.p2 = {-0.6928, -1, -5.4};
-	gc10.colour = {0, 0.7, 0};
-
-	Triangle gc11;
-	gc11.p0 = {-0.6928, -1, -5.4};
-	gc11.p1 = {0, 0.6, -5};
-	gc11.p2 = {-0.4, -1, -5.693};
-	gc11.colour = {0, 0.7, 0};
-
-	Triangle gc12;
-	gc12.p0 = {-0.4, -1, -5.693};
-	gc12.p1 = {0, 0.6, -5};
-	gc12.p2 = {0, -1, -5.8}; 
-	gc12.colour = {0, 0.7, 0};
-
-	/* Shiny red icosahedron */
-	Triangle ri1;	
-	ri1.p0 = {-2, -1, -7};
-	ri1.p1 = {-1.276, -0.4472, -6.474};
-	ri1.p2 = {-2.276, -0.4472, -6.149};
-	ri1.colour = {0.7, 0, 0};
-
-	Triangle ri2;
-	ri2.p0 = {-1.276, -0.4472, -6.474};
-	ri2.p1 = {-2, -1, -7};
-	ri2.p2 = {-1.276, -0.4472, -7.526};
-	ri2.colour = {0.7, 0, 0};
-
-	Triangle ri3;
-	ri3.p0 = {-2, -1, -7};
-	ri3.p1 = {-2.276, -0.4472, -6.149};
-	ri3.p2 = {-2.894, -0.4472, -7};
-	ri3.colour = {0.7, 0, 0};
-
-	Triangle ri4;
-	ri4.p0 = {-2, -1, -7};
-	ri4.p1 = {-2.894, -0.4472, -7};
-	ri4.p2 = {-2.276, -0.4472, -7.851};
-	ri4.colour = {0.7, 0, 0};
-
-	Triangle ri5;
-	ri5.p0 = {-2, -1, -7};
-	ri5.p1 = {-2.276, -0.4472, -7.851};
-	ri5.p2 = {-1.276, -0.4472, -7.526};
-	ri5.colour = {0.7, 0, 0};
-
-	Triangle ri6;
-	ri6.p0 = {-1.276, -0.4472, -6.474};
-	ri6.p1 = {-1.276, -0.4472, -7.526};
-	ri6.p2 = {-1.106, 0.4472, -7};
-	ri6.colour = {0.7, 0, 0};
-
-	Triangle ri7;
-	ri7.p0 = {-2.276, -0.4472, -6.149};
-	ri7.p1 = {-1.276, -0.4472, -6.474};
-	ri7.p2 = {-1.724, 0.4472, -6.149};
-	ri7.colour = {0.7, 0, 0};
-
-	Triangle ri8;
-	ri8.p0 = {-2.894, -0.4472, -7};
-	ri8.p1 = {-2.276, -0.4472, -6.149};
-	ri8.p2 = {-2.724, 0.4472, -6.474};
-	ri8.colour = {0.7, 0, 0};
-
-	Triangle ri9;
-	ri9.p0 = {-2.276, -0.4472, -7.851};
-	ri9.p1 = {-2.894, -0.4472, -7};
-	ri9.p2 = {-2.724, 0.4472, -7.526};
-	ri9.colour = {0.7, 0, 0};
-
-	Triangle ri10;
-	ri10.p0 = {-1.276, -0.4472, -7.526};
-	ri10.p1 = {-2.276, -0.4472, -7.851};
-	ri10.p2 = {-1.724, 0.4472, -7.851};
-	ri10.colour = {0.7, 0, 0};
-
-	Triangle ri11;
-	ri11.p0 = {-1.276, -0.4472, -6.474};
-	ri11.p1 = {-1.106, 0.4472, -7};
-	ri11.p2 = {-1.724, 0.4472, -6.149};
-	ri11.colour = {0.7, 0, 0};
-
-	Triangle ri12;
-	ri12.p0 = {-2.276, -0.4472, -6.149};
-	ri12.p1 = {-1.724, 0.4472, -6.149};
-	ri12.p2 = {-2.724, 0.4472, -6.474};
-	ri12.colour = {0.7, 0, 0};
-
-	Triangle ri13;
-	ri13.p0 = {-2.894, -0.4472, -7};
-	ri13.p1 = {-2.724, 0.4472, -6.474};
-	ri13.p2 = {-2.724, 0.4472, -7.526};
-	ri13.colour = {0.7, 0, 0};
-
-	Triangle ri14;
-	ri14.p0 = {-2.276, -0.4472, -7.851};
-	ri14.p1 = {-2.724, 0.4472, -7.526};
-	ri14.p2 = {-1.724, 0.4472, -7.851};
-	ri14.colour = {0.7, 0, 0};
-
-	Triangle ri15;
-	ri15.p0 = {-1.276, -0.4472, -7.526};
-	ri15.p1 = {-1.724, 0.4472, -7.851};
-	ri15.p2 = {-1.106, 0.4472, -7};
-	ri15.colour = {0.7, 0, 0};
-
-	Triangle ri16;
-	ri16.p0 = {-1.724, 0.4472, -6.149};
-	ri16.p1 = {-1.106, 0.4472, -7};
-	ri16.p2 = {-2, 1, -7};
-	ri16.colour = {0.7, 0, 0};
-
-	Triangle ri17;
-	ri17.p0 = {-2.724, 0.4472, -6.474};
-	ri17.p1 = {-1.724, 0.4472, -6.149};
-	ri17.p2 = {-2, 1, -7};
-	ri17.colour = {0.7, 0, 0};
-
-	Triangle ri18;
-	ri18.p0 = {-2.724, 0.4472, -7.526};
-	ri18.p1 = {-2.724, 0.4472, -6.474};
-	ri18.p2 = {-2, 1, -7};
-	ri18.colour = {0.7, 0, 0};
-
-	Triangle ri19;
-	ri19.p0 = {-1.724, 0.4472, -7.851};
-	ri19.p1 = {-2.724, 0.4472, -7.526};
-	ri19.p2 = {-2, 1, -7};
-	ri19.colour = {0.7, 0, 0};
-
-	Triangle ri20;
-	ri20.p0 = {-1.106, 0.4472, -7};
-	ri20.p1 = {-1.724, 0.4472, -7.851};
-	ri20.p2 = {-2, 1, -7};
-	ri20.colour = {0.7, 0, 0};
-
-	Triangle gc[12] = {gc1, gc2, gc3, gc4, gc5, gc6, gc7, gc8, gc9, gc10, gc11, gc12};
-	Triangle ri[20] = {ri1, ri2, ri3, ri4, ri5, ri6, ri7, ri8, ri9, ri10, ri11, ri12,
-		ri13, ri14, ri15, ri16, ri17, ri18, ri19, ri20};
-
-	for (int x = 0; x < img.Width(); x++) {
-		for (int y = 0; y < img.Height(); y++) {
-			float closest_mag = 200;
-			ray.x = -1*(img.Width()/2.f - 0.5f)+x;
-			ray.y = -1*(img.Height()/2.f - 0.5f)+y;
-			vec3 colour(0, 0, 0);
-			vec3 d(ray.x, ray.y, ray.z);
-			
-			// Floor
-			if (intersectPlane(pl, d, origin) != 0.f) {
-				if(pl.intmag < closest_mag && y < img.Height()/2) {
-					closest_mag = pl.intmag;
-					colour.x = 0.5;
-					colour.y = 0.5;
-					colour.z = 0.5;
-					shading(colour, pl.n, l, pl.intersect, d);
-					checkShadow2(pl.intersect, colour, l, gc, ri, yellow_sp, grey_sp, purp_sp);
-				}
-			}
-			// Wall
-			if (intersectPlane(pl2, d, origin) != 0.f) {
-				if(pl2.intmag < closest_mag) {
-					closest_mag = pl2.intmag;
-					colour.x = 0;
-					colour.y = 0.5;
-					colour.z = 0.5;
-					shading(colour, pl2.n, l, pl2.intersect, d);
-				}
-			}
-			for (uint i = 0; i < sizeof(gc)/sizeof(Triangle); i++) {
-				if (intersectTriangle(gc[i], d, origin)) {
-					if(gc[i].intmag < closest_mag) {
-						closest_mag = gc[i].intmag;
-						colour.x = 0;
-						colour.y = 0.7;
-						colour.z = 0;
-						shading(colour, gc[i].pl.n, l, gc[i].intersect, d);
-					}
-				}
-			}
-			for (uint i = 0; i < sizeof(ri)/sizeof(Triangle); i++) {
-				if (intersectTriangle(ri[i], d, origin)) {
-					if(ri[i].intmag < closest_mag) {
-						closest_mag = ri[i].intmag;
-						colour.x = 0.7;
-						colour.y = 0;
-						colour.z = 0;
-						scene_reflect2(3, d, ri[i].pl.n, ri[i].intersect, colour, yellow_sp, purp_sp, grey_sp, gc, ri);
-						shading(colour, ri[i].pl.n, l, ri[i].intersect, d);
-					}
-				}
-			}
-			if (intersectSphere(yellow_sp, d, origin)) {
-				if(yellow_sp.intmag < closest_mag) {
-					closest_mag = yellow_sp.intmag;
-					colour.x = 0.5;
-					colour.y = 0.5;
-					colour.z = 0;
-					shading(colour, yellow_sp.n, l, yellow_sp.intersect, d);
-				}
-			}
-			if (intersectSphere(grey_sp, d, origin)) {
-				if(grey_sp.intmag < closest_mag) {
-					closest_mag = grey_sp.intmag;
-					colour.x = 0.5;
-					colour.y = 0.5;
-					colour.z = 0.5;
-					scene_reflect2(2, d, grey_sp.n, grey_sp.intersect, colour, yellow_sp, purp_sp, grey_sp, gc, ri);
-					shading(colour, grey_sp.n, l, grey_sp.intersect, d);
-				}
-			}
-			if (intersectSphere(purp_sp, d, origin)) {
-				if(purp_sp.intmag < closest_mag) {
-					closest_mag = purp_sp.intmag;
-					colour.x = 0.5;
-					colour.y = 0;
-					colour.z = 0.5;
-					scene_reflect2(1, d, purp_sp.n, purp_sp.intersect, colour, yellow_sp, purp_sp, grey_sp, gc, ri);
-					shading(colour, purp_sp.n, l, purp_sp.intersect, d);
-				}
-			}
-			img.SetPixel(x, y, colour);
-		}
-	}
+// the image pixel under the cursor, (0, 0) being the bottom-left
+ivec2 CursorPixel(GLFWwindow* window)
+{
+	double x, y;
+	int width, height;
+	glfwGetCursorPos(window, &x, &y);
+	glfwGetWindowSize(window, &width, &height);
+	return ivec2(int(x * img.Width() / width), int((height - y) * img.Height() / height));
 }
-void renderShapes3() {
-	coord3D ray;
-	ray.z = -500;
-	vec3 origin(0, 0, 0);
-
-	// Plane 
-	Plane pl;
-	pl.p = {0, 0, -10.5};
-	pl.n = {0, 0, 1};
-	pl.colour = {0.5, 0.5, 0.5};
-	// Light 
-	Light l;
-	l.p = {1, 1, -12};
-
-	Sphere head;
-	head.c = {0.8, -0.8, -3.5};
-	head.r = 1;
-	head.colour = {0, 0, 0.5};
-
-	Sphere body;
-	body.c = {1.1, -3.5, -3.5};
-	body.r = 2;
-	body.colour = {0, 0, 0.5};
-
-	Sphere eye1;
-	eye1.c = {0.9, 0.1, -3.1};
-	eye1.r = 0.2;
-	eye1.colour = {0.3, 0.3, 0.3};
-	
-	Sphere pupil1;
-	pupil1.c = {0.78, 0.15, -2.8};
-	pupil1.r = 0.08;
-	pupil1.colour = {0, 0, 0};
-	
-	Sphere pupil2;
-	pupil2.c = {0.5, 0.05, -2.9};
-	pupil2.r = 0.08;
-	pupil2.colour = {0, 0, 0};
-	
-	Sphere eye2;
-	eye2.c = {0.5, 0.1, -3.1};
-	eye2.r = 0.2;
-	eye2.colour = {0.3, 0.3, 0.3};
-
-	Triangle mouth;
-	mouth.p0 = {-0.2, -0.8, -3.1};
-	mouth.p1 = {1.8, -0.8, -3.1};
-	mouth.p2 = {0.7, -1.4, -3.1};
-	mouth.colour = {0, 0, 0};
-
-	Triangle mouth2;
-	mouth2.p0 = {-0.2, -0.8, -3.1};
-	mouth2.p1 = {1.8, -0.8, -3.1};
-	mouth2.p2 = {0.7, -0.4, -3.1};
-	mouth.colour = {0, 0, 0};
-
-	for (int x = 0; x < img.Width(); x++) {
-		for (int y = 0; y < img.Height(); y++) {
-			float closest_mag = 200;
-			ray.x = -1*(img.Width()/2.f - 0.5f)+x;
-			ray.y = -1*(img.Height()/2.f - 0.5f)+y;
-			vec3 colour(0, 0, 0);
-			vec3 d(ray.x, ray.y, ray.z);
-
-			if (intersectPlane(pl, d, origin) != 0.f) {
-				if(pl.intmag < closest_mag) {
-					closest_mag = pl.intmag;
-					colour.x = 0.5;
-					colour.y = 0;
-					colour.z = 0.5;
-				}
-			}
-			if (intersectSphere(head, d, origin)) {
-				if(head.intmag < closest_mag) {
-					closest_mag = head.intmag;
-					colour.x = 0;
-					colour.y = 0;
-					colour.z = 0.5;
-					shading(colour, head.n, l, head.intersect, d);
-				}
-			}
-			if (intersectSphere(body, d, origin)) {
-				if(body.intmag < closest_mag) {
-					closest_mag = body.intmag;
-					colour.x = 0;
-					colour.y = 0;
-					colour.z = 0.5;
-					shading(colour, body.n, l, body.intersect, d);
-				}
-			}
-			if (intersectSphere(eye1, d, origin)) {
-				if(eye1.intmag < closest_mag) {
-					closest_mag = eye1.intmag;
-					colour.x = 0.5;
-					colour.y = 0.5;
-					colour.z = 0.5;
-					shading(colour, eye1.n, l, eye1.intersect, d);
-				}
-			}
-			if (intersectSphere(pupil1, d, origin)) {
-				if(pupil1.intmag < closest_mag) {
-					closest_mag = pupil1.intmag;
-					colour.x = 0;
-					colour.y = 0;
-					colour.z = 0;
-					shading(colour, pupil1.n, l, pupil1.intersect, d);
-				}
-			}
-			if (intersectSphere(pupil2, d, origin)) {
-				if(pupil2.intmag < closest_mag) {
-					closest_mag = pupil2.intmag;
-					colour.x = 0;
-					colour.y = 0;
-					colour.z = 0;
-					shading(colour, pupil2.n, l, pupil2.intersect, d);
-				}
-			}
-			if (intersectSphere(eye2, d, origin)) {
-				if(eye2.intmag < closest_mag) {
-					closest_mag = eye2.intmag;
-					colour.x = 0.5;
-					colour.y = 0.5;
-					colour.z = 0.5;
-					shading(colour, eye2.n, l, eye2.intersect, d);
-				}
-			}
 
-			if (intersectTriangle(mouth, d, origin)) {
-				if(mouth.intmag < closest_mag) {
-					closest_mag = mouth.intmag;
-					colour.x = 0;
-					colour.y = 0;
-					colour.z = 0;
-					shading(colour, mouth.pl.n, l, mouth.intersect, d);
-				}
-			}
-			if (intersectTriangle(mouth2, d, origin)) {
-				if(mouth2.intmag < closest_mag) {
-					closest_mag = mouth2.intmag;
-					colour.x = 0;
-					colour.y = 0;
-					colour.z = 0;
-					shading(colour, mouth2.pl.n, l, mouth2.intersect, d);
-				}
-			}
-			img.SetPixel(x, y, colour);
-		}
+// Dragging out a rectangle with the left button crops the render to it, so
+// that only the pixels inside are traced from then on; a click alone does
+// nothing.
+void MouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+{
+	if (button != GLFW_MOUSE_BUTTON_LEFT)
+		return;
+	ivec2 pixel(CursorPixel(window));
+	if (action == GLFW_PRESS) {
+		dragStart = pixel;
+		dragging = true;
+		return;
 	}
+	if (!dragging)
+		return;
+	dragging = false;
+
+	ivec2 lower(glm::min(dragStart, pixel));
+	ivec2 upper(glm::max(dragStart, pixel) + 1);
+	if (upper.x - lower.x > 1 || upper.y - lower.y > 1)
+		renderer.Crop(PixelRect{lower.x, lower.y, upper.x, upper.y});
 }
+
 // ==========================================================================
 // PROGRAM ENTRY POINT
 
+void PrintUsage()
+{
+	cout<<"Run `./boilerplate 1` for scene 1\n";
+	cout<<"Run `./boilerplate 2` for scene 2\n";
+	cout<<"Run `./boilerplate 3` for scene 3\n";
+	cout<<"Run `./boilerplate <file>` for a scene file\n";
+	cout<<"Scene files are reloaded whenever they change.\n";
+	cout<<"Options:\n";
+	cout<<"  --lazy                build the BVH on demand as rays reach it\n";
+	cout<<"  --build <name>        split the BVH by sah (the default), or linear or\n";
+	cout<<"                        treelet for fast rebuilds of moving scenes\n";
+	cout<<"  --no-cache            ignore and do not write the scene file's cache\n";
+	cout<<"  --stream <MB>         page the cached scene in as needed, keeping at most\n";
+	cout<<"                        about this much of it in memory; the cache is\n";
+	cout<<"                        written without loading the whole scene\n";
+	cout<<"  --shadow-samples <n>  most shadow rays per point for area lights,\n";
+	cout<<"                        rounded down to a square of at least 4\n";
+	cout<<"  --threads <n>         render on n threads (one per processor by default)\n";
+	cout<<"  --order <name>        visit pixels in scanline, morton or hilbert order\n";
+	cout<<"                        (hilbert by default)\n";
+	cout<<"  --fast-math           shade with approximate normalisation and powers\n";
+	cout<<"  --accel <name>        trace through a bvh (the default), a uniform grid,\n";
+	cout<<"                        or a quantised 8-wide bvh (wide)\n";
+	cout<<"  --interleave          trace primary rays through the bvh several at a\n";
+	cout<<"                        time, hiding memory stalls on very large scenes\n";
+	cout<<"  --path-trace <n>      path trace n samples per pixel, with global\n";
+	cout<<"                        illumination, instead of Whitted ray tracing\n";
+	cout<<"  --sampler <name>      draw path samples from random, sobol or bluenoise\n";
+	cout<<"                        sequences (sobol by default)\n";
+	cout<<"  --crop <x> <y> <w> <h>\n";
+	cout<<"                        trace only the w x h pixels from (x, y), counted\n";
+	cout<<"                        from the bottom left; drag a rectangle in the\n";
+	cout<<"                        window to crop it, and press C to trace it all\n";
+	cout<<"  --time-budget <s> <file>\n";
+	cout<<"                        path trace until s seconds after starting,\n";
+	cout<<"                        spending paths where the error is highest, then\n";
+	cout<<"                        save the image to file, report its error and exit\n";
+	cout<<"  --checkpoint <file> <s>\n";
+	cout<<"                        when path tracing, save progress to file at most\n";
+	cout<<"                        every s seconds, and resume from it if the same\n";
+	cout<<"                        render is run again\n";
+	cout<<"  --output <file>       save the image to file once finished, and exit\n";
+	cout<<"  --profile <file>      time each render's phases, printing a summary and\n";
+	cout<<"                        writing a Chrome trace to file when it finishes\n";
+	cout<<"  --bench <w> <h>       time rendering a w x h image in each order, math\n";
+	cout<<"                        mode and accelerator, check the fast math\n";
+	cout<<"                        routines and, when path tracing, compare the\n";
+	cout<<"                        samplers' error, then exit\n";
+}
+
 int main(int argc, char *argv[])
 {
 	// initialize the GLFW windowing system
@@ -1195,6 +779,7 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 	glfwSetErrorCallback(ErrorCallback);
+	double launched = glfwGetTime();
 
 	// attempt to create a window with an OpenGL 4.1 core profile context
 	GLFWwindow *window = 0;
@@ -1211,6 +796,7 @@ int main(int argc, char *argv[])
 
 	// set keyboard callback function and make our context current (active)
 	glfwSetKeyCallback(window, KeyCallback);
+	glfwSetMouseButtonCallback(window, MouseButtonCallback);
 	glfwMakeContextCurrent(window);
 
 	//Intialize GLAD
@@ -1237,39 +823,203 @@ int main(int argc, char *argv[])
 	}
 
 	// call function to create and fill buffers with geometry data
-	if ( argc != 2 ) {
-		cout<<"Run `./boilerplate 1` for scene 1\n";
-		cout<<"Run `./boilerplate 2` for scene 2\n";
-		cout<<"Run `./boilerplate 3` for scene 3\n";
+	if ( argc < 2 ) {
+		PrintUsage();
 		return 0;
 	}
+	int shadowSamples = 0;
+	int threads = 0;
+	BvhBuilder builder = SAH_BUILDER;
+	PixelOrder order = HILBERT_ORDER;
+	int benchWidth = 0, benchHeight = 0;
+	string profileFile;
+	int pathSamples = 0;
+	SamplerType sampler = SOBOL_SAMPLER;
+	double timeBudget = 0;
+	PixelRect crop = {0, 0, 0, 0};
+	string budgetFile;
+	string checkpointFile;
+	double checkpointInterval = 0;
+	string outputFile;
+	bool interleaving = false;
+	for (int i = 2; i < argc; i++) {
+		if (string(argv[i]) == "--lazy")
+			lazyBuild = true;
+		else if (string(argv[i]) == "--no-cache")
+			useCache = false;
+		else if (string(argv[i]) == "--build" && i + 1 < argc && parseBvhBuilder(argv[i + 1], builder))
+			i++;
+		else if (string(argv[i]) == "--stream" && i + 1 < argc)
+			streamBudget = size_t(atof(argv[++i]) * (1 << 20));
+		else if (string(argv[i]) == "--shadow-samples" && i + 1 < argc)
+			shadowSamples = atoi(argv[++i]);
+		else if (string(argv[i]) == "--threads" && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (string(argv[i]) == "--order" && i + 1 < argc && parsePixelOrder(argv[i + 1], order))
+			i++;
+		else if (string(argv[i]) == "--fast-math")
+			mathMode = FAST_MATH;
+		else if (string(argv[i]) == "--accel" && i + 1 < argc
+		         && (string(argv[i + 1]) == "bvh" || string(argv[i + 1]) == "grid" || string(argv[i + 1]) == "wide")) {
+			if (string(argv[++i]) == "grid")
+				accelerator = &grid;
+			else if (string(argv[i]) == "wide")
+				accelerator = &wideBvh;
+		}
+		else if (string(argv[i]) == "--interleave")
+			interleaving = true;
+		else if (string(argv[i]) == "--path-trace" && i + 1 < argc)
+			pathSamples = atoi(argv[++i]);
+		else if (string(argv[i]) == "--sampler" && i + 1 < argc && parseSamplerType(argv[i + 1], sampler))
+			i++;
+		else if (string(argv[i]) == "--crop" && i + 4 < argc) {
+			crop.x0 = atoi(argv[++i]);
+			crop.y0 = atoi(argv[++i]);
+			crop.x1 = crop.x0 + atoi(argv[++i]);
+			crop.y1 = crop.y0 + atoi(argv[++i]);
+		}
+		else if (string(argv[i]) == "--time-budget" && i + 2 < argc && atof(argv[i + 1]) > 0) {
+			timeBudget = atof(argv[++i]);
+			budgetFile = argv[++i];
+		}
+		else if (string(argv[i]) == "--checkpoint" && i + 2 < argc) {
+			checkpointFile = argv[++i];
+			checkpointInterval = atof(argv[++i]);
+		}
+		else if (string(argv[i]) == "--output" && i + 1 < argc)
+			outputFile = argv[++i];
+		else if (string(argv[i]) == "--profile" && i + 1 < argc)
+			profileFile = argv[++i];
+		else if (string(argv[i]) == "--bench" && i + 2 < argc) {
+			benchWidth = atoi(argv[++i]);
+			benchHeight = atoi(argv[++i]);
+		}
+		else {
+			PrintUsage();
+			return 0;
+		}
+	}
+
+	// the cache holds a BVH split by SAH, so a grid or linear BVH is always
+	// built from the scene file
+	if (accelerator == &grid || builder != SAH_BUILDER)
+		useCache = false;
+
+	// linear builds are never lazy
+	bvh.SetBuilder(builder);
+	if (builder != SAH_BUILDER)
+		lazyBuild = false;
+
+	// the wide hierarchy is collapsed from a finished binary one in memory
+	if (accelerator == &wideBvh) {
+		lazyBuild = false;
+		streamBudget = 0;
+	}
 
-	int scene = atoi(argv[1]);
-	cout << scene;
 	MyGeometry geometry;
 	if (!InitializeGeometry(&geometry))
 		cout << "Program failed to intialize geometry!" << endl;
-	if (scene == 1)
-		renderShapes();
-	else if (scene == 2)
-		renderShapes2();
-	else if (scene == 3)
-		renderShapes3();
+
+	// scene files are parsed and their BVH built only when their cache is
+	// missing or out of date
+	double buildStart = glfwGetTime();
+	bool sceneFile = true;
+	if (BuildScene(atoi(argv[1]), scene)) {
+		BuildAccelerator();
+		sceneFile = false;
+	}
+	else if (useCache && sceneCache.Load(argv[1], scene, bvh)) {
+		cout << "Scene and BVH mapped from " << SceneCache::CachePath(argv[1]) << endl;
+		if (accelerator == &wideBvh)
+			wideBvh.Build(scene, bvh);
+	}
+	else if (StreamingScenes()) {
+		if (!SceneCache::Write(argv[1]) || !sceneCache.Load(argv[1], scene, bvh)) {
+			cout << "Could not write " << SceneCache::CachePath(argv[1]) << endl;
+			PrintUsage();
+			return 0;
+		}
+		cout << "Scene and BVH written to " << SceneCache::CachePath(argv[1]) << " a part at a time" << endl;
+	}
+	else if (LoadScene(argv[1], scene)) {
+		BuildParsedScene(argv[1]);
+	}
 	else {
-		cout<<"Run `./boilerplate 1` for scene 1\n";
-		cout<<"Run `./boilerplate 2` for scene 2\n";
-		cout<<"Run `./boilerplate 3` for scene 3\n";
+		PrintUsage();
 		return 0;
 	}
-	// run an event-triggered main loop
+	if (streamBudget > 0 && sceneCache.Loaded())
+		sceneCache.Stream(scene, bvh, streamBudget);
+	cout << "Scene ready in " << (glfwGetTime() - buildStart) * 1000.0 << " ms" << endl;
+
+	if (shadowSamples > 0)
+		scene.light.samples = shadowSamples;
+	if (benchWidth > 0 && benchHeight > 0) {
+		BenchmarkOrders(benchWidth, benchHeight, threads);
+		BenchmarkMath(benchWidth, benchHeight, threads, order);
+		BenchmarkAccelerators(benchWidth, benchHeight, threads, order);
+		if (pathSamples > 0)
+			BenchmarkSamplers(benchWidth, benchHeight, threads, order, pathSamples);
+		glfwSetWindowShouldClose(window, GL_TRUE);
+	}
+	else {
+		renderer.SetOrder(order);
+		renderer.SetProfiling(!profileFile.empty());
+		renderer.SetInterleaving(interleaving);
+		renderer.SetSampler(sampler);
+		renderer.SetCheckpoint(checkpointFile, checkpointInterval);
+		renderer.Crop(crop);
+		if (timeBudget > 0) {
+			// every pixel has at least two paths, to tell how noisy it is
+			renderer.SetPathTracing(std::max(pathSamples, 2));
+			RenderToDeadline(launched, timeBudget, budgetFile, threads);
+			glfwSetWindowShouldClose(window, GL_TRUE);
+		}
+		else {
+			renderer.SetPathTracing(pathSamples);
+			renderer.Start(&scene, accelerator, &img, camera, threads);
+			ReportResumed();
+		}
+	}
+
+	FileWatcher watcher;
+	bool watching = sceneFile && watcher.Watch(argv[1]);
+
+	// rendering happens on the renderer's threads; this one handles events,
+	// reloads the scene when its file changes, and shows the renderer's
+	// progress at the display rate, sleeping once the image is fully refined
+	// and reporting on the render if it was profiled
+	bool reported = false;
 	while (!glfwWindowShouldClose(window))
 	{
-		img.Render();
+		if (watching && watcher.Changed())
+			ReloadScene(argv[1]);
+
+		bool finished = renderer.Finished();
+		if (finished && !reported && !profileFile.empty()) {
+			renderer.Profile().PrintSummary(cout);
+			if (!renderer.Profile().WriteTrace(profileFile))
+				cout << "Could not write " << profileFile << endl;
+		}
+		if (finished && !outputFile.empty()) {
+			img.SaveToFile(outputFile);
+			glfwSetWindowShouldClose(window, GL_TRUE);
+		}
+		reported = finished;
+		renderer.Display();
 		glfwSwapBuffers(window);
-		glfwPollEvents();
+		if (!finished)
+			glfwWaitEventsTimeout(DISPLAY_INTERVAL);
+		else if (watching)
+			glfwWaitEventsTimeout(WATCH_INTERVAL);
+		else
+			glfwWaitEvents();
 	}
 
-	// clean up allocated resources before exit
+	// abandon any render in progress, then clean up allocated resources
+	renderer.Stop();
+	if (!checkpointFile.empty() && !renderer.FlushCheckpoints())
+		cout << "Could not write " << checkpointFile << endl;
 	DestroyGeometry(&geometry);
 	DestroyShaders(&shader);
 	img.Destroy();